@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include "auditlog.h"
+#include <err.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every record starts with a header and is padded to its size. A header with length PAD_RECORD
+// marks the unused bytes at the end of the ring before a record that would not fit.
+#define HEADER_SIZE 16
+#define PAD_RECORD  UINT32_MAX
+
+typedef struct record_header {
+    uint32_t len;
+    uint32_t unused;
+    uint64_t seq;
+} record_header;
+
+static audit_ring *rings[AUDIT_MAX_THREADS];
+static _Atomic int ring_count = 0;
+static _Thread_local audit_ring *own_ring = NULL;
+
+// Records are numbered after their space is reserved and published right after, so the writer
+// only ever waits an instant for a missing number.
+static _Atomic uint64_t next_seq = 0;
+static uint64_t write_seq = 0;
+
+static int log_fd = -1;
+static int flush_interval = 0;
+static int sync_policy = SYNC_NONE;
+static _Atomic int stopping = 0;
+static pthread_t writer;
+
+static _Atomic unsigned long queued = 0;
+static _Atomic unsigned long written = 0;
+static _Atomic unsigned long dropped = 0;
+static _Atomic unsigned long backpressure = 0;
+static _Atomic unsigned long batches = 0;
+
+static size_t record_size(size_t len) {
+    return (HEADER_SIZE + len + HEADER_SIZE - 1) & ~(size_t) (HEADER_SIZE - 1);
+}
+
+static audit_ring *get_ring(void) {
+    if (own_ring == NULL) {
+        int index = atomic_fetch_add(&ring_count, 1);
+        if (index >= AUDIT_MAX_THREADS) {
+            errx(EXIT_FAILURE, "too many threads for the audit log");
+        }
+        own_ring = aligned_alloc(64, sizeof(audit_ring));
+        atomic_init(&own_ring->head, 0);
+        atomic_init(&own_ring->tail, 0);
+        rings[index] = own_ring;
+    }
+    return own_ring;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+void audit_record(const char *record, int len) {
+    audit_ring *ring = get_ring();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t need = record_size(len);
+    size_t contiguous = AUDIT_RING_SIZE - (head % AUDIT_RING_SIZE);
+    size_t pad = (contiguous < need) ? contiguous : 0;
+
+    int waited = 0;
+    while (AUDIT_RING_SIZE - (head - atomic_load_explicit(&ring->tail, memory_order_acquire))
+           < pad + need) {
+        if (waited == 0) {
+            atomic_fetch_add(&backpressure, 1);
+        }
+        if (waited >= AUDIT_MAX_WAIT_MS) {
+            atomic_fetch_add(&dropped, 1);
+            return;
+        }
+        sleep_ms(1);
+        waited += 1;
+    }
+
+    if (pad > 0) {
+        record_header *marker = (record_header *) (ring->data + head % AUDIT_RING_SIZE);
+        marker->len = PAD_RECORD;
+        head += pad;
+    }
+    record_header *header = (record_header *) (ring->data + head % AUDIT_RING_SIZE);
+    header->len = len;
+    header->seq = atomic_fetch_add(&next_seq, 1);
+    memcpy((char *) header + HEADER_SIZE, record, len);
+    atomic_fetch_add_explicit(&queued, 1, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + need, memory_order_release);
+}
+
+// Returns the next record of a ring without consuming it, skipping padding.
+static record_header *peek(audit_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+        return NULL;
+    }
+    record_header *header = (record_header *) (ring->data + tail % AUDIT_RING_SIZE);
+    if (header->len == PAD_RECORD) {
+        tail += AUDIT_RING_SIZE - (tail % AUDIT_RING_SIZE);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        if (tail == head) {
+            return NULL;
+        }
+        header = (record_header *) (ring->data + tail % AUDIT_RING_SIZE);
+    }
+    return header;
+}
+
+static void write_batch(char *batch, size_t *len) {
+    size_t offset = 0;
+    while (offset < *len) {
+        ssize_t bytes = write(log_fd, batch + offset, *len - offset);
+        if (bytes <= 0) {
+            break;
+        }
+        offset += bytes;
+    }
+    if (*len > 0) {
+        atomic_fetch_add(&batches, 1);
+        if (sync_policy == SYNC_BATCH) {
+            fdatasync(log_fd);
+        }
+    }
+    *len = 0;
+}
+
+// Merges the per-thread rings by sequence number into batches. When force is set, numbers that
+// never show up (their thread was cancelled mid-record) are skipped instead of waited for.
+static void drain(int force) {
+    static char batch[AUDIT_BATCH_SIZE];
+    size_t len = 0;
+    int misses = 0;
+    for (;;) {
+        int count = atomic_load(&ring_count);
+        audit_ring *found = NULL;
+        record_header *header = NULL;
+        uint64_t lowest = UINT64_MAX;
+        for (int i = 0; i < count && found == NULL; i += 1) {
+            if (rings[i] == NULL) {
+                continue;
+            }
+            record_header *next = peek(rings[i]);
+            if (next && next->seq == write_seq) {
+                found = rings[i];
+                header = next;
+            } else if (next && next->seq < lowest) {
+                lowest = next->seq;
+            }
+        }
+        if (found == NULL) {
+            if (lowest == UINT64_MAX) {
+                break;
+            }
+            if (force && misses > 1000) {
+                write_seq = lowest;
+            } else {
+                misses += 1;
+                sched_yield();
+            }
+            continue;
+        }
+        misses = 0;
+        if (len + header->len > AUDIT_BATCH_SIZE) {
+            write_batch(batch, &len);
+        }
+        memcpy(batch + len, (char *) header + HEADER_SIZE, header->len);
+        len += header->len;
+        write_seq += 1;
+        atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&found->tail, record_size(header->len), memory_order_release);
+    }
+    write_batch(batch, &len);
+}
+
+static void *thread_write(void *args) {
+    (void) args;
+    while (!atomic_load(&stopping)) {
+        sleep_ms(flush_interval);
+        drain(0);
+    }
+    return NULL;
+}
+
+int audit_init(FILE *file, int flush_ms, int sync) {
+    fflush(file);
+    log_fd = fileno(file);
+    flush_interval = flush_ms;
+    sync_policy = sync;
+    return (pthread_create(&writer, NULL, &thread_write, NULL) == 0) ? 0 : -1;
+}
+
+void audit_close(void) {
+    atomic_store(&stopping, 1);
+    pthread_join(writer, NULL);
+    drain(1);
+}
+
+void audit_stats(audit_counters *counters) {
+    counters->written = atomic_load(&written);
+    counters->queued = atomic_load(&queued) - counters->written;
+    counters->dropped = atomic_load(&dropped);
+    counters->backpressure = atomic_load(&backpressure);
+    counters->batches = atomic_load(&batches);
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#pragma once
+
+// Bytes of log records each thread can have waiting for the writer
+#define AUDIT_RING_SIZE (1 << 18)
+// Most threads that can log
+#define AUDIT_MAX_THREADS 1024
+// Bytes the writer gathers before each write
+#define AUDIT_BATCH_SIZE (1 << 16)
+// How long a thread waits for room in its ring before dropping a record
+#define AUDIT_MAX_WAIT_MS 100
+
+enum AUDIT_SYNC { SYNC_NONE, SYNC_BATCH };
+
+// Per-thread single-producer single-consumer ring of variable-length records.
+typedef struct audit_ring {
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) char data[AUDIT_RING_SIZE];
+} audit_ring;
+
+typedef struct audit_counters {
+    unsigned long queued;
+    unsigned long written;
+    unsigned long dropped;
+    unsigned long backpressure;
+    unsigned long batches;
+} audit_counters;
+
+// @brief Starts the writer thread for the audit log.
+// @param file The log file. Records are written with write(2) on its descriptor.
+// @param flush_ms How often the writer gathers and writes records, in milliseconds.
+// @param sync SYNC_BATCH to fdatasync after every batch, SYNC_NONE to leave it to the kernel.
+// @return 0 on success, -1 if the writer could not be started.
+int audit_init(FILE *file, int flush_ms, int sync);
+
+// @brief Queues a preformatted record on the calling thread's ring. Never blocks on the log device:
+// if the ring stays full for AUDIT_MAX_WAIT_MS the record is dropped and counted.
+// Records are written in the order audit_record was called, across all threads.
+// @param record The bytes of the record, including its newline.
+// @param len Number of bytes in the record.
+void audit_record(const char *record, int len);
+
+// @brief Stops the writer thread after it writes every queued record.
+void audit_close(void);
+
+// @brief Reads the audit log counters.
+// @param counters Filled with the current counts.
+void audit_stats(audit_counters *counters);
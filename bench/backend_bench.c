@@ -0,0 +1,215 @@
+// I/O backend benchmark.
+// Starts the server once with -b epoll and once with -b uring and drives each with the same client
+// threads: keep-alive GETs of a small object, one connection per GET (which exercises accept), and
+// keep-alive PUTs of a 1 MiB message (which exercises the body path). Reports requests per second
+// for each scenario and backend.
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BLOCK_2048      2048
+#define CLIENTS         8
+#define DEFAULT_SECONDS 3
+#define SMALL_SIZE      64
+#define BIG_SIZE        (1 << 20)
+#define PORT            18990
+
+enum SCENARIOS { KEEPALIVE_GET, ONESHOT_GET, KEEPALIVE_PUT, SCENARIO_COUNT };
+
+static const char *scenario_names[] = { [KEEPALIVE_GET] = "keep-alive GET 64 B",
+    [ONESHOT_GET] = "one-shot GET 64 B",
+    [KEEPALIVE_PUT] = "keep-alive PUT 1 MiB" };
+
+static char *big_body;
+static volatile int running;
+static int scenario;
+static int port = PORT;
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, buffer, length);
+        if (sent <= 0) {
+            err(EXIT_FAILURE, "write");
+        }
+        buffer += sent;
+        length -= sent;
+    }
+}
+
+// Reads one response and returns its status code. Every response carries a Content-Length.
+static int read_response(int fd) {
+    char buffer[2 * BLOCK_2048];
+    int bytes = 0;
+    char *end = NULL;
+    while (end == NULL) {
+        ssize_t got = read(fd, buffer + bytes, BLOCK_2048 - bytes);
+        if (got <= 0) {
+            errx(EXIT_FAILURE, "connection closed");
+        }
+        bytes += got;
+        end = memmem(buffer, bytes, "\r\n\r\n", 4);
+    }
+    int body = (end + 4) - buffer;
+    long length = strtol(strstr(buffer, "Content-Length: ") + 16, NULL, 10);
+    while (bytes < body + length) {
+        ssize_t got = read(fd, buffer + bytes, body + length - bytes);
+        if (got <= 0) {
+            errx(EXIT_FAILURE, "connection closed");
+        }
+        bytes += got;
+    }
+    return strtol(buffer + 9, NULL, 10);
+}
+
+static void request(int fd, const char *method, const char *uri, const char *body, int length) {
+    char head[BLOCK_2048];
+    int head_len = snprintf(
+        head, sizeof(head), "%s %s HTTP/1.1\r\nContent-Length: %d\r\n\r\n", method, uri, length);
+    send_all(fd, head, head_len);
+    send_all(fd, body, length);
+    if (read_response(fd) >= 400) {
+        errx(EXIT_FAILURE, "%s %s failed", method, uri);
+    }
+}
+
+static void *client(void *args) {
+    long *count = args;
+    char uri[64];
+    snprintf(uri, sizeof(uri), "/put%ld", (long) pthread_self() % 1000);
+    int fd = (scenario == ONESHOT_GET) ? -1 : connect_server();
+    while (running) {
+        if (scenario == ONESHOT_GET) {
+            fd = connect_server();
+            send_all(fd, "GET /small HTTP/1.1\r\nConnection: close\r\n\r\n", 42);
+            read_response(fd);
+            close(fd);
+        } else if (scenario == KEEPALIVE_GET) {
+            send_all(fd, "GET /small HTTP/1.1\r\n\r\n", 23);
+            read_response(fd);
+        } else {
+            request(fd, "PUT", uri, big_body, BIG_SIZE);
+        }
+        *count += 1;
+    }
+    if (scenario != ONESHOT_GET) {
+        close(fd);
+    }
+    return NULL;
+}
+
+static double run(int seconds) {
+    pthread_t threads[CLIENTS];
+    long counts[CLIENTS] = { 0 };
+    struct timespec start, end;
+    running = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CLIENTS; i += 1) {
+        pthread_create(&threads[i], NULL, client, &counts[i]);
+    }
+    sleep(seconds);
+    running = 0;
+    long total = 0;
+    for (int i = 0; i < CLIENTS; i += 1) {
+        pthread_join(threads[i], NULL);
+        total += counts[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return total / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static pid_t start_server(const char *server, const char *backend, const char *dir) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(dir) < 0) {
+            err(EXIT_FAILURE, "chdir");
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        execl(server, server, "-t", "4", "-r", "1000000", "-b", backend, port_arg, (char *) NULL);
+        err(EXIT_FAILURE, "exec %s", server);
+    }
+    for (int i = 0; i < 100; i += 1) {
+        int fd = connect_server();
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        usleep(20000);
+    }
+    errx(EXIT_FAILURE, "server did not start");
+}
+
+int main(int argc, char *argv[]) {
+    char server[4096];
+    const char *backends[] = { "epoll", "uring" };
+    double results[2][SCENARIO_COUNT];
+    int seconds = (argc > 2) ? atoi(argv[2]) : DEFAULT_SECONDS;
+    if (realpath((argc > 1) ? argv[1] : "./httpserver", server) == NULL) {
+        err(EXIT_FAILURE, "server binary");
+    }
+    signal(SIGPIPE, SIG_IGN);
+    port += getpid() % 1000;
+    big_body = malloc(BIG_SIZE);
+    memset(big_body, 'x', BIG_SIZE);
+
+    for (int b = 0; b < 2; b += 1) {
+        char dir[] = "/tmp/backend_bench.XXXXXX";
+        if (mkdtemp(dir) == NULL) {
+            err(EXIT_FAILURE, "mkdtemp");
+        }
+        pid_t pid = start_server(server, backends[b], dir);
+        int fd = connect_server();
+        request(fd, "PUT", "/small", big_body, SMALL_SIZE);
+        close(fd);
+        for (scenario = 0; scenario < SCENARIO_COUNT; scenario += 1) {
+            results[b][scenario] = run(seconds);
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        char command[128];
+        snprintf(command, sizeof(command), "rm -rf %s", dir);
+        if (system(command) != 0) {
+            warnx("could not remove %s", dir);
+        }
+        // The old port may still be in TIME_WAIT.
+        port += 1;
+    }
+
+    printf("%d clients, %d s per scenario\n", CLIENTS, seconds);
+    printf("%-24s %14s %14s %8s\n", "scenario", "epoll req/s", "uring req/s", "ratio");
+    for (int s = 0; s < SCENARIO_COUNT; s += 1) {
+        printf("%-24s %14.0f %14.0f %7.2fx\n", scenario_names[s], results[0][s], results[1][s],
+            results[1][s] / results[0][s]);
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+// GET path benchmark.
+// Serves one object repeatedly through the original GET path (a shared flock, a copy into an
+// O_TMPFILE 2 KB at a time, then sendfile from the temp file) and through the direct path (sendfile
+// from the object itself), into a socket drained by another thread. Reports bytes per second and
+// write amplification, the bytes written to files per byte served. It also reports the bytes the
+// process sent to the storage layer according to /proc/self/io.
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define BLOCK_2048      2048
+#define DEFAULT_SIZE_MB 64
+#define ITERATIONS      8
+#define OBJECT          "get_bench.obj"
+
+static long long file_bytes_written = 0;
+
+static void *drain(void *args) {
+    int fd = *(int *) args;
+    char buffer[1 << 16];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    return NULL;
+}
+
+static void send_all(int out, int in, off_t length) {
+    off_t offset = 0;
+    while (offset < length) {
+        if (sendfile(out, in, &offset, length - offset) <= 0) {
+            err(EXIT_FAILURE, "sendfile");
+        }
+    }
+}
+
+static void staged_get(int sock, int urifd, off_t length) {
+    char buffer[BLOCK_2048];
+    flock(urifd, LOCK_SH);
+    int tmp_fd = open("./", O_TMPFILE | O_RDWR, S_IRWXU);
+    if (tmp_fd < 0) {
+        err(EXIT_FAILURE, "O_TMPFILE");
+    }
+    ssize_t bytes;
+    off_t offset = 0;
+    while ((bytes = pread(urifd, buffer, BLOCK_2048, offset)) > 0) {
+        if (write(tmp_fd, buffer, bytes) != bytes) {
+            err(EXIT_FAILURE, "write");
+        }
+        offset += bytes;
+        file_bytes_written += bytes;
+    }
+    flock(urifd, LOCK_UN);
+    send_all(sock, tmp_fd, length);
+    close(tmp_fd);
+}
+
+static void direct_get(int sock, int urifd, off_t length) {
+    send_all(sock, urifd, length);
+}
+
+static long long storage_writes(void) {
+    long long value = -1;
+    char key[64];
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io == NULL) {
+        return -1;
+    }
+    while (fscanf(io, "%63s %lld", key, &value) == 2) {
+        if (strcmp(key, "write_bytes:") == 0) {
+            break;
+        }
+    }
+    fclose(io);
+    return value;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, void (*get)(int, int, off_t), off_t length) {
+    int pair[2];
+    pthread_t drainer;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        err(EXIT_FAILURE, "socketpair");
+    }
+    pthread_create(&drainer, NULL, drain, &pair[1]);
+    int urifd = open(OBJECT, O_RDONLY);
+    file_bytes_written = 0;
+    long long before = storage_writes();
+    double start = now();
+    for (int i = 0; i < ITERATIONS; i += 1) {
+        get(pair[0], urifd, length);
+    }
+    double elapsed = now() - start;
+    syncfs(urifd);
+    long long after = storage_writes();
+    close(urifd);
+    close(pair[0]);
+    pthread_join(drainer, NULL);
+    close(pair[1]);
+
+    double served = (double) length * ITERATIONS;
+    printf("%-8s %12.1f MB/s %10.2f %16lld\n", name, served / elapsed / 1e6,
+        file_bytes_written / served, (before < 0) ? -1 : after - before);
+}
+
+int main(int argc, char *argv[]) {
+    long size_mb = DEFAULT_SIZE_MB;
+    if (argc > 1) {
+        size_mb = strtol(argv[1], NULL, 10);
+        if (size_mb <= 0) {
+            errx(EXIT_FAILURE, "bad object size");
+        }
+    }
+    off_t length = size_mb << 20;
+    int fd = open(OBJECT, O_CREAT | O_TRUNC | O_WRONLY, S_IRWXU);
+    char block[1 << 16];
+    memset(block, 'x', sizeof(block));
+    for (off_t written = 0; written < length; written += sizeof(block)) {
+        if (write(fd, block, sizeof(block)) != sizeof(block)) {
+            err(EXIT_FAILURE, "write");
+        }
+    }
+    fsync(fd);
+    close(fd);
+
+    printf("%ld MB object, %d GETs per path\n", size_mb, ITERATIONS);
+    printf("%-8s %17s %10s %16s\n", "path", "throughput", "write amp", "storage bytes");
+    run("staged", staged_get, length);
+    run("direct", direct_get, length);
+    unlink(OBJECT);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,599 @@
+// Load generator.
+// Replays a request mix against a server on the loopback interface and reports throughput and
+// latency percentiles. A mix sets the share of GET, PUT and APPEND requests, the range of object
+// sizes (log-uniform between the two bounds), the number of keys and their Zipf popularity, how
+// many requests each connection keeps in flight, and whether every request uses a new connection.
+// Each client thread owns one connection. Before a mix runs every key is written once, so a GET
+// always finds its object. With -x the generator starts its own server in a temporary directory,
+// otherwise the server must already be listening on the given port and should be started with a
+// high -r so that connections are not closed under load. -a passes extra options, separated by
+// spaces, to the server started with -x, so the same scenarios can be compared across policies.
+//
+// usage: bench/loadgen [-t threads] [-d seconds] [-S scenario,...|all] [-x server] [-a args] [port]
+//        bench/loadgen [-m get:put:append] [-s min[-max]] [-k keys] [-z theta] [-p depth] [-1] port
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define OPTIONS         "t:d:S:x:a:m:s:k:z:p:1"
+#define BLOCK_2048      2048
+#define READ_BUFFER     (1 << 16)
+#define DEFAULT_THREADS 8
+#define DEFAULT_SECONDS 5
+#define MAX_THREADS     256
+#define MAX_PIPELINE    64
+#define MAX_SERVER_ARGS 16
+#define MAX_SIZE        (64 << 20)
+#define PORT            19990
+
+// Latencies are kept in log-linear buckets, 16 per power of two, as the server's /_stats does.
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define OCTAVES     40
+#define BUCKETS     ((OCTAVES + 1) << SUB_BITS)
+
+enum METHODS { GET, PUT, APPEND, METHOD_COUNT };
+
+static const char *method_names[] = { [GET] = "GET", [PUT] = "PUT", [APPEND] = "APPEND" };
+
+typedef struct {
+    const char *name;
+    int mix[METHOD_COUNT];
+    long min_size;
+    long max_size;
+    int keys;
+    double zipf;
+    int pipeline;
+    int oneshot;
+    int depth;
+} scenario_t;
+
+// The canned scenarios, each aimed at one hot path of the server.
+static const scenario_t SCENARIOS[] = {
+    // Small objects served from the object cache
+    { "get-hot", { 100, 0, 0 }, 64, 64, 1000, 0.99, 1, 0, 0 },
+    // The same with 16 requests in flight per connection
+    { "get-pipelined", { 100, 0, 0 }, 64, 64, 1000, 0.99, 16, 0, 0 },
+    // A new connection per request, so accept and the poller dominate
+    { "get-oneshot", { 100, 0, 0 }, 64, 64, 1000, 0.99, 1, 1, 0 },
+    // Objects past the cache limit, sent with sendfile
+    { "get-large", { 100, 0, 0 }, 64 << 10, 4 << 20, 64, 0, 1, 0, 0 },
+    // Reads and writes on a skewed key set, so the per-URI locks and the cache invalidation meet
+    { "mixed", { 80, 15, 5 }, 64, 16 << 10, 1000, 0.99, 1, 0, 0 },
+    // Whole-object replacement through the splice path
+    { "put-large", { 0, 100, 0 }, 1 << 20, 1 << 20, 16, 0, 1, 0, 0 },
+    // Small appends to a few hot keys, serialized by their writer locks
+    { "append-hot", { 0, 0, 100 }, 128, 128, 8, 0.99, 1, 0, 0 },
+    // Small objects three directories deep, so path resolution and directory creation dominate
+    { "put-deep", { 0, 100, 0 }, 256, 256, 10000, 0, 1, 0, 3 },
+};
+
+#define SCENARIO_COUNT ((int) (sizeof(SCENARIOS) / sizeof(SCENARIOS[0])))
+
+typedef struct {
+    uint64_t rng;
+    int fd;
+    char *in;
+    int in_off;
+    int in_len;
+    long requests;
+    long errors;
+    long bytes;
+    uint64_t max;
+    uint64_t buckets[BUCKETS];
+} worker_t;
+
+static const scenario_t *current;
+static double *key_cdf;
+static char *payload;
+static volatile int running;
+static int port = PORT;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int index = ((msb - SUB_BITS + 1) << SUB_BITS)
+                + ((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return (index < BUCKETS) ? index : BUCKETS - 1;
+}
+
+// Middle of the values that fall in a bucket.
+static uint64_t value_of(int index) {
+    int octave = index >> SUB_BITS;
+    uint64_t sub = index & (SUB_BUCKETS - 1);
+    if (octave == 0) {
+        return sub;
+    }
+    uint64_t low = (SUB_BUCKETS + sub) << (octave - 1);
+    return low + ((uint64_t) 1 << (octave - 1)) / 2;
+}
+
+// xorshift64*, one generator per thread.
+static double uniform(worker_t *worker) {
+    worker->rng ^= worker->rng >> 12;
+    worker->rng ^= worker->rng << 25;
+    worker->rng ^= worker->rng >> 27;
+    return ((worker->rng * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+// Picks a key by binary search over the cumulative Zipf weights, key 0 being the most popular.
+static int pick_key(worker_t *worker) {
+    double u = uniform(worker);
+    int low = 0;
+    int high = current->keys - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (key_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int pick_method(worker_t *worker) {
+    int total = current->mix[GET] + current->mix[PUT] + current->mix[APPEND];
+    double u = uniform(worker) * total;
+    for (int m = 0; m < METHOD_COUNT - 1; m += 1) {
+        if (u < current->mix[m]) {
+            return m;
+        }
+        u -= current->mix[m];
+    }
+    return METHOD_COUNT - 1;
+}
+
+static long pick_size(worker_t *worker) {
+    if (current->min_size >= current->max_size) {
+        return current->min_size;
+    }
+    double ratio = (double) current->max_size / current->min_size;
+    return (long) (current->min_size * pow(ratio, uniform(worker)));
+}
+
+static void build_keys(void) {
+    free(key_cdf);
+    key_cdf = malloc(current->keys * sizeof(double));
+    double total = 0;
+    for (int k = 0; k < current->keys; k += 1) {
+        total += 1 / pow(k + 1, current->zipf);
+        key_cdf[k] = total;
+    }
+    for (int k = 0; k < current->keys; k += 1) {
+        key_cdf[k] /= total;
+    }
+}
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buffer, long length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, buffer, length);
+        if (sent <= 0) {
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Names a key. With a depth, each decimal digit of the key from the lowest up names one directory.
+static int key_path(char *path, int size, int key) {
+    int len = 0;
+    for (int level = 0, rest = key; level < current->depth; level += 1, rest /= 10) {
+        len += snprintf(path + len, size - len, "/d%d", rest % 10);
+    }
+    return len + snprintf(path + len, size - len, "/lg%d", key);
+}
+
+static int send_request(worker_t *worker, int method, int key, long length, int oneshot) {
+    char head[BLOCK_2048];
+    char path[BLOCK_2048 / 2];
+    if (method == GET) {
+        length = 0;
+    }
+    key_path(path, sizeof(path), key);
+    int head_len = snprintf(head, sizeof(head),
+        "%s %s HTTP/1.1\r\nRequest-Id: %ld\r\nContent-Length: %ld\r\n%s\r\n",
+        method_names[method], path, worker->requests, length, oneshot ? "Connection: close\r\n" : "");
+    if (send_all(worker->fd, head, head_len) < 0 || send_all(worker->fd, payload, length) < 0) {
+        return -1;
+    }
+    worker->bytes += length;
+    return 0;
+}
+
+// Refills the read buffer, keeping any bytes not yet consumed. Returns -1 once the server closes.
+static int fill(worker_t *worker) {
+    if (worker->in_off > 0) {
+        memmove(worker->in, worker->in + worker->in_off, worker->in_len - worker->in_off);
+        worker->in_len -= worker->in_off;
+        worker->in_off = 0;
+    }
+    if (worker->in_len == READ_BUFFER) {
+        return -1;
+    }
+    ssize_t got = read(worker->fd, worker->in + worker->in_len, READ_BUFFER - worker->in_len);
+    if (got <= 0) {
+        return -1;
+    }
+    worker->in_len += got;
+    return 0;
+}
+
+// Reads one response and discards its message. Returns its status code, or -1 if the connection
+// closed first. Bytes past the response stay buffered for the next one.
+static int read_response(worker_t *worker) {
+    char *end = NULL;
+    while ((end = memmem(worker->in + worker->in_off, worker->in_len - worker->in_off, "\r\n\r\n",
+                4))
+           == NULL) {
+        if (fill(worker) < 0) {
+            return -1;
+        }
+    }
+    char *head = worker->in + worker->in_off;
+    *end = '\0';
+    int status = strtol(head + 9, NULL, 10);
+    char *field = strcasestr(head, "\r\nContent-Length:");
+    long remaining = field ? strtol(field + 17, NULL, 10) : 0;
+    worker->in_off = (end + 4) - worker->in;
+    worker->bytes += remaining;
+    while (remaining > 0) {
+        long available = worker->in_len - worker->in_off;
+        if (available >= remaining) {
+            worker->in_off += remaining;
+            break;
+        }
+        remaining -= available;
+        worker->in_off = worker->in_len = 0;
+        if (fill(worker) < 0) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+// Only answered requests count towards throughput and latency.
+static void record(worker_t *worker, long start, int status) {
+    if (status < 0 || status >= 400) {
+        worker->errors += 1;
+    }
+    if (status < 0) {
+        return;
+    }
+    uint64_t value = now_ns() - start;
+    worker->buckets[bucket_of(value)] += 1;
+    worker->max = (value > worker->max) ? value : worker->max;
+    worker->requests += 1;
+}
+
+static void reconnect(worker_t *worker) {
+    if (worker->fd >= 0) {
+        close(worker->fd);
+    }
+    worker->in_off = worker->in_len = 0;
+    worker->fd = connect_server();
+    if (worker->fd < 0) {
+        err(EXIT_FAILURE, "connect");
+    }
+}
+
+static void *client(void *args) {
+    worker_t *worker = args;
+    long starts[MAX_PIPELINE];
+    int depth = current->pipeline;
+    if (!current->oneshot) {
+        reconnect(worker);
+    }
+    while (running) {
+        if (current->oneshot) {
+            reconnect(worker);
+        }
+        int sent = 0;
+        while (sent < depth) {
+            int method = pick_method(worker);
+            starts[sent] = now_ns();
+            if (send_request(worker, method, pick_key(worker), pick_size(worker), current->oneshot)
+                < 0) {
+                break;
+            }
+            sent += 1;
+        }
+        // Every request that was not answered counts as an error, and the connection is replaced.
+        int failed = 0;
+        for (int i = 0; i < depth; i += 1) {
+            int status = (i < sent && !failed) ? read_response(worker) : -1;
+            failed = failed || status < 0;
+            record(worker, starts[i], status);
+        }
+        if (failed && running) {
+            reconnect(worker);
+        }
+    }
+    if (worker->fd >= 0) {
+        close(worker->fd);
+        worker->fd = -1;
+    }
+    return NULL;
+}
+
+// Writes every key once so that GETs find their objects and APPENDs have a file to extend.
+static void preload(void) {
+    worker_t *worker = calloc(1, sizeof(worker_t));
+    worker->in = malloc(READ_BUFFER);
+    worker->rng = 0x9E3779B97F4A7C15ULL;
+    worker->fd = -1;
+    reconnect(worker);
+    for (int k = 0; k < current->keys; k += 1) {
+        if (send_request(worker, PUT, k, pick_size(worker), 0) < 0 || read_response(worker) < 0) {
+            errx(EXIT_FAILURE, "preload of key %d failed", k);
+        }
+    }
+    close(worker->fd);
+    free(worker->in);
+    free(worker);
+}
+
+static void run(const scenario_t *scenario, int threads, int seconds) {
+    current = scenario;
+    build_keys();
+    preload();
+
+    pthread_t ids[MAX_THREADS];
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    running = 1;
+    long start = now_ns();
+    for (int i = 0; i < threads; i += 1) {
+        workers[i].in = malloc(READ_BUFFER);
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].fd = -1;
+        pthread_create(&ids[i], NULL, client, &workers[i]);
+    }
+    sleep(seconds);
+    running = 0;
+
+    uint64_t buckets[BUCKETS] = { 0 };
+    uint64_t max = 0;
+    long requests = 0;
+    long errors = 0;
+    long bytes = 0;
+    for (int i = 0; i < threads; i += 1) {
+        pthread_join(ids[i], NULL);
+        for (int b = 0; b < BUCKETS; b += 1) {
+            buckets[b] += workers[i].buckets[b];
+        }
+        max = (workers[i].max > max) ? workers[i].max : max;
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        free(workers[i].in);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    free(workers);
+
+    const double percentiles[] = { 50, 99, 99.9 };
+    double values[3] = { 0 };
+    for (int p = 0; p < 3 && requests > 0; p += 1) {
+        uint64_t rank = (uint64_t) (percentiles[p] / 100 * requests + 0.5);
+        uint64_t seen = 0;
+        int i = 0;
+        while (i < BUCKETS - 1 && seen + buckets[i] < (rank ? rank : 1)) {
+            seen += buckets[i];
+            i += 1;
+        }
+        uint64_t value = value_of(i);
+        values[p] = ((value < max) ? value : max) / 1000.0;
+    }
+    printf("%-14s %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %7ld\n", scenario->name, requests / elapsed,
+        bytes / elapsed / (1 << 20), values[0], values[1], values[2], max / 1000.0, errors);
+    fflush(stdout);
+}
+
+static pid_t start_server(const char *server, const char *dir, char *extra) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    char *args[MAX_SERVER_ARGS + 6] = { (char *) server, "-t", "4", "-r", "1000000000" };
+    int count = 5;
+    for (char *arg = strtok(extra, " "); arg && count < MAX_SERVER_ARGS + 5;
+         arg = strtok(NULL, " ")) {
+        args[count] = arg;
+        count += 1;
+    }
+    args[count] = port_arg;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(dir) < 0) {
+            err(EXIT_FAILURE, "chdir");
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        execv(server, args);
+        err(EXIT_FAILURE, "exec %s", server);
+    }
+    for (int i = 0; i < 100; i += 1) {
+        int fd = connect_server();
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        usleep(20000);
+    }
+    errx(EXIT_FAILURE, "server did not start");
+}
+
+// Whether a scenario is in the comma separated list given with -S.
+static int is_selected(const char *selected, const char *name) {
+    size_t len = strlen(name);
+    for (const char *item = selected; item; item = strchr(item, ',')) {
+        item += (*item == ',');
+        size_t item_len = strcspn(item, ",");
+        if ((item_len == 3 && strncmp(item, "all", 3) == 0)
+            || (item_len == len && strncmp(item, name, len) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *exec) {
+    fprintf(stderr,
+        "usage: %s [-t threads] [-d seconds] [-S scenario,...|all] [-x server] [-a args] [port]\n"
+        "       %s [-m get:put:append] [-s min[-max]] [-k keys] [-z theta] [-p depth] [-1] [port]\n"
+        "scenarios:",
+        exec, exec);
+    for (int s = 0; s < SCENARIO_COUNT; s += 1) {
+        fprintf(stderr, " %s", SCENARIOS[s].name);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0;
+    int threads = DEFAULT_THREADS;
+    int seconds = DEFAULT_SECONDS;
+    const char *selected = "all";
+    const char *server = NULL;
+    char *server_args = "";
+    int custom = 0;
+    scenario_t mix = { "custom", { 100, 0, 0 }, 64, 64, 1000, 0.99, 1, 0, 0 };
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'S': selected = optarg; break;
+        case 'x': server = optarg; break;
+        case 'a': server_args = optarg; break;
+        case 'm':
+            custom = 1;
+            if (sscanf(optarg, "%d:%d:%d", &mix.mix[GET], &mix.mix[PUT], &mix.mix[APPEND]) != 3) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            custom = 1;
+            if (sscanf(optarg, "%ld-%ld", &mix.min_size, &mix.max_size) == 1) {
+                mix.max_size = mix.min_size;
+            }
+            break;
+        case 'k':
+            custom = 1;
+            mix.keys = atoi(optarg);
+            break;
+        case 'z':
+            custom = 1;
+            mix.zipf = atof(optarg);
+            break;
+        case 'p':
+            custom = 1;
+            mix.pipeline = atoi(optarg);
+            break;
+        case '1':
+            custom = 1;
+            mix.oneshot = 1;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+    } else if (server == NULL) {
+        usage(argv[0]);
+    } else {
+        port += getpid() % 1000;
+    }
+    if (threads < 1 || threads > MAX_THREADS || seconds < 1 || mix.keys < 1 || mix.min_size < 1
+        || mix.max_size > MAX_SIZE || mix.pipeline < 1 || mix.pipeline > MAX_PIPELINE
+        || mix.mix[GET] + mix.mix[PUT] + mix.mix[APPEND] <= 0) {
+        usage(argv[0]);
+    }
+    if (mix.oneshot) {
+        mix.pipeline = 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    payload = malloc(MAX_SIZE);
+    memset(payload, 'x', MAX_SIZE);
+
+    pid_t pid = 0;
+    char dir[] = "/tmp/loadgen.XXXXXX";
+    if (server != NULL) {
+        char path[4096];
+        if (realpath(server, path) == NULL) {
+            err(EXIT_FAILURE, "server binary");
+        }
+        if (mkdtemp(dir) == NULL) {
+            err(EXIT_FAILURE, "mkdtemp");
+        }
+        pid = start_server(path, dir, server_args);
+    }
+
+    printf("%d threads, %d s per scenario, port %d\n", threads, seconds, port);
+    printf("%-14s %10s %9s %9s %9s %9s %9s %7s\n", "scenario", "req/s", "MiB/s", "p50_us", "p99_us",
+        "p99.9_us", "max_us", "errors");
+    int ran = 0;
+    for (int s = 0; s < SCENARIO_COUNT && !custom; s += 1) {
+        if (is_selected(selected, SCENARIOS[s].name)) {
+            run(&SCENARIOS[s], threads, seconds);
+            ran += 1;
+        }
+    }
+    if (custom) {
+        run(&mix, threads, seconds);
+        ran += 1;
+    }
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        char command[128];
+        snprintf(command, sizeof(command), "rm -rf %s", dir);
+        if (system(command) != 0) {
+            warnx("could not remove %s", dir);
+        }
+    }
+    if (ran == 0) {
+        usage(argv[0]);
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Path resolution benchmark.
+// Builds a tree of small objects several directories deep in a temporary directory, then times the
+// ways the server can reach one of them: opening the full path from the working directory and
+// fstat'ing it, openat against the cached descriptor of its directory, and a hit in the open-file
+// cache. It also times making sure an object's directories exist, with a mkdir per path component
+// as before and through the directory cache. Reports nanoseconds per operation.
+//
+// usage: bench/path_bench [-k keys] [-d depth] [-n operations]
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fdcache.h"
+#include "slab.h"
+#include "urilock.h"
+
+#define OPTIONS        "k:d:n:"
+#define DEFAULT_KEYS   1000
+#define DEFAULT_DEPTH  4
+#define DEFAULT_OPS    200000
+#define MAX_DEPTH      64
+
+static int keys = DEFAULT_KEYS;
+static int depth = DEFAULT_DEPTH;
+
+// fdcache.c syncs the parent of each directory it creates through utils.c, which the bench does not
+// link. The server's default durability (-d none) syncs nothing, so that is what is timed here.
+int handle_sync_dir(int dirfd, const char *path) {
+    (void) dirfd;
+    (void) path;
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Each decimal digit of the key from the lowest up names one directory, as in loadgen's put-deep.
+static void key_path(char *path, int size, int key) {
+    int len = snprintf(path, size, ".");
+    for (int level = 0, rest = key; level < depth; level += 1, rest /= 10) {
+        len += snprintf(path + len, size - len, "/d%d", rest % 10);
+    }
+    snprintf(path + len, size - len, "/obj%d", key);
+}
+
+// The directory creation every PUT used to do, one mkdir per component.
+static void mkdir_each(char *path) {
+    char *last = strrchr(path, '/');
+    for (char *cursor = path + 2; cursor <= last; cursor += 1) {
+        if (*cursor == '/') {
+            *cursor = '\0';
+            mkdir(path, S_IRWXU);
+            *cursor = '/';
+        }
+    }
+}
+
+static void report(const char *name, double seconds, int ops) {
+    printf("%-22s %10.0f ns/op\n", name, seconds * 1e9 / ops);
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0;
+    int ops = DEFAULT_OPS;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'k': keys = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'n': ops = atoi(optarg); break;
+        default: errx(EXIT_FAILURE, "usage: %s [-k keys] [-d depth] [-n operations]", argv[0]);
+        }
+    }
+    if (keys < 1 || depth < 0 || depth > MAX_DEPTH || ops < 1) {
+        errx(EXIT_FAILURE, "bad arguments");
+    }
+
+    char dir[] = "/tmp/path_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        err(EXIT_FAILURE, "temporary directory");
+    }
+    slab_init();
+    uri_lock_init();
+    fdcache_init();
+    char path[BLOCK_2048];
+    for (int k = 0; k < keys; k += 1) {
+        key_path(path, sizeof(path), k);
+        mkdir_each(path);
+        int fd = open(path, O_WRONLY | O_CREAT, S_IRWXU);
+        if (fd < 0 || write(fd, "x", 1) != 1) {
+            err(EXIT_FAILURE, "%s", path);
+        }
+        close(fd);
+    }
+    printf("%d keys, %d directories deep, %d operations\n", keys, depth, ops);
+
+    // Keys are visited with a stride coprime to most key counts, so consecutive operations differ.
+    struct stat st;
+    double start = now();
+    for (int i = 0; i < ops; i += 1) {
+        key_path(path, sizeof(path), (int) ((i * 7919L) % keys));
+        int fd = open(path, O_RDONLY);
+        fstat(fd, &st);
+        close(fd);
+    }
+    report("open full path", now() - start, ops);
+
+    start = now();
+    for (int i = 0; i < ops; i += 1) {
+        key_path(path, sizeof(path), (int) ((i * 7919L) % keys));
+        fd_entry *parent = fdcache_dir(path, 0);
+        int fd = openat(parent->fd, strrchr(path, '/') + 1, O_RDONLY);
+        fdcache_release(parent);
+        fstat(fd, &st);
+        close(fd);
+    }
+    report("openat cached dir", now() - start, ops);
+
+    char key[BLOCK_2048];
+    validator valid = { 0 };
+    start = now();
+    for (int i = 0; i < ops; i += 1) {
+        key_path(path, sizeof(path), (int) ((i * 7919L) % keys));
+        int len = uri_normalize(path, key);
+        uint64_t hash = uri_hash(key, len);
+        fd_entry *file = fdcache_file(key, len, hash);
+        if (file == NULL) {
+            int fd = open(path, O_RDONLY);
+            fstat(fd, &st);
+            file = fdcache_insert(key, len, hash, fd, &st, &valid);
+            if (file == NULL) {
+                close(fd);
+            }
+        }
+        fdcache_release(file);
+    }
+    report("open-file cache", now() - start, ops);
+
+    start = now();
+    for (int i = 0; i < ops; i += 1) {
+        key_path(path, sizeof(path), (int) ((i * 7919L) % keys));
+        mkdir_each(path);
+    }
+    report("mkdir per component", now() - start, ops);
+
+    start = now();
+    for (int i = 0; i < ops; i += 1) {
+        key_path(path, sizeof(path), (int) ((i * 7919L) % keys));
+        fdcache_release(fdcache_dir(path, 1));
+    }
+    report("directory cache", now() - start, ops);
+
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    if (system(command) != 0) {
+        warnx("could not remove %s", dir);
+    }
+    return 0;
+}
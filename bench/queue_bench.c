@@ -0,0 +1,123 @@
+// Connection queue microbenchmark.
+// Compares the lock-free ring buffer in queue.c against the original connection queue (an array
+// shifted down on every dequeue under one mutex with two condition variables) by pushing and
+// popping a fixed number of items through each with an equal number of producers and consumers.
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "queue.h"
+
+#define CAPACITY    2048
+#define ITEMS       2000000
+#define MAX_THREADS 64
+
+// Original implementation, kept here as the baseline.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t add_conn = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t take_conn = PTHREAD_COND_INITIALIZER;
+static void *conn_queue[CAPACITY];
+static int socket_count = 0;
+
+static void *legacy_pop(void) {
+    pthread_mutex_lock(&mutex);
+    while (socket_count == 0) {
+        pthread_cond_wait(&add_conn, &mutex);
+    }
+    socket_count -= 1;
+    void *item = conn_queue[0];
+    for (int i = 0; i < socket_count; i += 1) {
+        conn_queue[i] = conn_queue[i + 1];
+    }
+    pthread_cond_signal(&take_conn);
+    pthread_mutex_unlock(&mutex);
+    return item;
+}
+
+static void legacy_push(void *item) {
+    pthread_mutex_lock(&mutex);
+    while (socket_count == CAPACITY - 1) {
+        pthread_cond_wait(&take_conn, &mutex);
+    }
+    conn_queue[socket_count] = item;
+    socket_count += 1;
+    pthread_cond_signal(&add_conn);
+    pthread_mutex_unlock(&mutex);
+}
+
+static queue_t ring;
+static int use_ring = 0;
+static long per_thread = 0;
+
+static void *producer(void *args) {
+    (void) args;
+    for (long i = 0; i < per_thread; i += 1) {
+        void *item = (void *) (i + 1);
+        if (use_ring) {
+            queue_push(&ring, item);
+        } else {
+            legacy_push(item);
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *args) {
+    (void) args;
+    for (long i = 0; i < per_thread; i += 1) {
+        if (use_ring) {
+            queue_pop(&ring);
+        } else {
+            legacy_pop();
+        }
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs producers and consumers (half of the threads each, at least one of each) and returns
+// completed push/pop pairs per second.
+static double run(int threads) {
+    pthread_t pool[MAX_THREADS * 2];
+    int pairs = (threads < 2) ? 1 : threads / 2;
+    per_thread = ITEMS / pairs;
+    double start = now();
+    for (int i = 0; i < pairs; i += 1) {
+        pthread_create(&pool[i], NULL, consumer, NULL);
+        pthread_create(&pool[pairs + i], NULL, producer, NULL);
+    }
+    for (int i = 0; i < pairs * 2; i += 1) {
+        pthread_join(pool[i], NULL);
+    }
+    return (per_thread * pairs) / (now() - start);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = MAX_THREADS;
+    if (argc > 1) {
+        max_threads = strtol(argv[1], NULL, 10);
+        if (max_threads <= 0 || max_threads > MAX_THREADS) {
+            errx(EXIT_FAILURE, "thread count must be between 1 and %d", MAX_THREADS);
+        }
+    }
+    if (queue_init(&ring, CAPACITY) < 0) {
+        err(EXIT_FAILURE, "queue error");
+    }
+    printf("%8s %16s %16s %8s\n", "threads", "legacy ops/s", "ring ops/s", "speedup");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        use_ring = 0;
+        double legacy = run(threads);
+        use_ring = 1;
+        double lockfree = run(threads);
+        printf("%8d %16.0f %16.0f %7.2fx\n", threads, legacy, lockfree, lockfree / legacy);
+    }
+    queue_destroy(&ring);
+    return EXIT_SUCCESS;
+}
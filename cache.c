@@ -0,0 +1,204 @@
+#include "cache.h"
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct cache_stripe {
+    pthread_mutex_t mutex;
+    cache_entry *head;
+} cache_stripe;
+
+// Lookups only take their stripe's mutex. Inserting, invalidating and evicting also take
+// clock_lock, always before the stripe's mutex, which guards the CLOCK ring and the byte count.
+static cache_stripe stripes[CACHE_STRIPES];
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry *hand = NULL;
+static size_t budget = 0;
+static size_t bytes = 0;
+static unsigned long entries = 0;
+
+static _Atomic unsigned long hits = 0;
+static _Atomic unsigned long misses = 0;
+static _Atomic unsigned long evictions = 0;
+
+void cache_init(size_t cache_budget) {
+    budget = cache_budget;
+    for (int i = 0; i < CACHE_STRIPES; i += 1) {
+        pthread_mutex_init(&stripes[i].mutex, NULL);
+        stripes[i].head = NULL;
+    }
+}
+
+static cache_entry **find(cache_stripe *stripe, const char *key, int len, uint64_t hash) {
+    cache_entry **cursor = &stripe->head;
+    while (*cursor
+           && ((*cursor)->hash != hash || (*cursor)->key_len != len
+               || memcmp((*cursor)->key, key, len) != 0)) {
+        cursor = &(*cursor)->chain;
+    }
+    return cursor;
+}
+
+cache_entry *cache_lookup(const char *key, int len, uint64_t hash) {
+    if (budget == 0) {
+        return NULL;
+    }
+    cache_stripe *stripe = &stripes[hash % CACHE_STRIPES];
+    pthread_mutex_lock(&stripe->mutex);
+    cache_entry *entry = *find(stripe, key, len, hash);
+    if (entry) {
+        atomic_fetch_add(&entry->refs, 1);
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    atomic_fetch_add_explicit(entry ? &hits : &misses, 1, memory_order_relaxed);
+    return entry;
+}
+
+void cache_release(cache_entry *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        slab_free(entry, entry->cost);
+    }
+}
+
+// Unlinks an entry from the table and the CLOCK ring. Holds clock_lock and the entry's stripe.
+static void remove_entry(cache_entry **link) {
+    cache_entry *entry = *link;
+    *link = entry->chain;
+    if (entry->next == entry) {
+        hand = NULL;
+    } else {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        if (hand == entry) {
+            hand = entry->next;
+        }
+    }
+    bytes -= entry->cost;
+    entries -= 1;
+    cache_release(entry);
+}
+
+// Second-chance eviction: the hand clears reference bits as it passes and evicts the first entry
+// that was not used since the last pass. Holds clock_lock.
+static void evict(void) {
+    while (bytes > budget && hand) {
+        cache_entry *entry = hand;
+        if (atomic_exchange_explicit(&entry->referenced, 0, memory_order_relaxed)) {
+            hand = entry->next;
+            continue;
+        }
+        cache_stripe *stripe = &stripes[entry->hash % CACHE_STRIPES];
+        pthread_mutex_lock(&stripe->mutex);
+        remove_entry(find(stripe, entry->key, entry->key_len, entry->hash));
+        pthread_mutex_unlock(&stripe->mutex);
+        atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+}
+
+int cache_admits(off_t size) {
+    return budget > 0 && size <= CACHE_MAX_OBJECT;
+}
+
+void cache_insert(
+    const char *key, int len, uint64_t hash, int fd, off_t size, const validator *valid) {
+    char header[BLOCK_256];
+    if (!cache_admits(size)) {
+        return;
+    }
+    int header_len = snprintf(
+        header, sizeof(header), ENTITY_HEAD, (long) size, valid->etag, valid->last_modified);
+    size_t cost = sizeof(cache_entry) + len + header_len + size;
+    if (cost > budget) {
+        return;
+    }
+
+    // Objects up to SLAB_MAX come from the slab, so refilling the cache after an invalidation does
+    // not touch the heap.
+    cache_entry *entry = slab_alloc(cost);
+    if (entry == NULL) {
+        return;
+    }
+    entry->response = entry->key + len;
+    memcpy(entry->key, key, len);
+    memcpy(entry->response, header, header_len);
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t got = pread(fd, entry->response + header_len + offset, size - offset, offset);
+        if (got <= 0) {
+            slab_free(entry, cost);
+            return;
+        }
+        offset += got;
+    }
+    atomic_init(&entry->refs, 1);
+    atomic_init(&entry->referenced, 0);
+    entry->hash = hash;
+    entry->key_len = len;
+    entry->cost = cost;
+    entry->size = header_len + size;
+    entry->valid = *valid;
+
+    cache_stripe *stripe = &stripes[hash % CACHE_STRIPES];
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&stripe->mutex);
+    if (*find(stripe, key, len, hash) != NULL) {
+        // Another reader filled it first.
+        pthread_mutex_unlock(&stripe->mutex);
+        pthread_mutex_unlock(&clock_lock);
+        slab_free(entry, cost);
+        return;
+    }
+    entry->chain = stripe->head;
+    stripe->head = entry;
+    pthread_mutex_unlock(&stripe->mutex);
+    if (hand == NULL) {
+        entry->prev = entry->next = entry;
+        hand = entry;
+    } else {
+        entry->next = hand;
+        entry->prev = hand->prev;
+        hand->prev->next = entry;
+        hand->prev = entry;
+    }
+    bytes += cost;
+    entries += 1;
+    evict();
+    pthread_mutex_unlock(&clock_lock);
+}
+
+void cache_invalidate(const char *key, int len, uint64_t hash) {
+    if (budget == 0) {
+        return;
+    }
+    cache_stripe *stripe = &stripes[hash % CACHE_STRIPES];
+    // Most writes are to objects that are not cached, which only need the stripe to find that out.
+    pthread_mutex_lock(&stripe->mutex);
+    int cached = (*find(stripe, key, len, hash) != NULL);
+    pthread_mutex_unlock(&stripe->mutex);
+    if (!cached) {
+        return;
+    }
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&stripe->mutex);
+    cache_entry **link = find(stripe, key, len, hash);
+    if (*link) {
+        remove_entry(link);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    pthread_mutex_unlock(&clock_lock);
+}
+
+void cache_stats(cache_counters *counters) {
+    counters->hits = atomic_load(&hits);
+    counters->misses = atomic_load(&misses);
+    counters->evictions = atomic_load(&evictions);
+    pthread_mutex_lock(&clock_lock);
+    counters->entries = entries;
+    counters->bytes = bytes;
+    pthread_mutex_unlock(&clock_lock);
+    counters->budget = budget;
+}
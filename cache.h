@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#pragma once
+
+#include "utils.h"
+
+// Number of independently locked buckets in the cache table
+#define CACHE_STRIPES 256
+// Largest object that is cached
+#define CACHE_MAX_OBJECT (1 << 20)
+
+// A cached GET response, headers and body in one buffer, with the validators it was built with so
+// conditional GETs are answered without the file. Entries are reference counted: the table holds
+// one reference and every response being sent from the entry holds another.
+typedef struct cache_entry {
+    _Atomic int refs;
+    _Atomic int referenced;
+    uint64_t hash;
+    int key_len;
+    size_t cost;
+    size_t size;
+    char *response;
+    validator valid;
+    struct cache_entry *chain;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    char key[];
+} cache_entry;
+
+typedef struct cache_counters {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+    size_t budget;
+} cache_counters;
+
+// @brief Initializes the object cache.
+// @param budget Most bytes the cache may hold, 0 to disable it.
+void cache_init(size_t budget);
+
+// @brief Looks up a URI. Keys are the normalized path and hash kept by the URI's lock.
+// @param key Normalized path of the URI.
+// @param len Length of the key.
+// @param hash Hash of the key.
+// @return The entry with a reference taken, or NULL on a miss.
+cache_entry *cache_lookup(const char *key, int len, uint64_t hash);
+
+// @brief Drops a reference taken by cache_lookup.
+// @param entry The entry to release.
+void cache_release(cache_entry *entry);
+
+// @brief Tells whether an object of a size could be cached at all, so a caller can skip reading it.
+// @param size Size of the file.
+// @return Non-zero if the cache is on and the object is at most CACHE_MAX_OBJECT bytes.
+int cache_admits(off_t size);
+
+// @brief Reads a file into a new entry with a prebuilt 200 response and inserts it, evicting
+// entries with CLOCK until the cache fits its budget. The caller holds the URI's lock so the file
+// cannot change while it is read.
+// @param key Normalized path of the URI.
+// @param len Length of the key.
+// @param hash Hash of the key.
+// @param fd File descriptor of the URI.
+// @param size Size of the file.
+// @param valid Validators of the file, sent with the response and kept for conditional GETs.
+void cache_insert(
+    const char *key, int len, uint64_t hash, int fd, off_t size, const validator *valid);
+
+// @brief Removes a URI from the cache. The caller holds the URI's writer lock.
+// @param key Normalized path of the URI.
+// @param len Length of the key.
+// @param hash Hash of the key.
+void cache_invalidate(const char *key, int len, uint64_t hash);
+
+// @brief Reads the cache counters.
+// @param counters Filled with the current counts.
+void cache_stats(cache_counters *counters);
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "fdcache.h"
+#include "urilock.h"
+#include "slab.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+typedef struct fd_stripe {
+    pthread_mutex_t mutex;
+    fd_entry *head;
+} fd_stripe;
+
+// As in the object cache, lookups only take their stripe's mutex. Inserting, invalidating and
+// evicting also take clock_lock first, which guards both CLOCK rings and their counts.
+static fd_stripe stripes[FDCACHE_STRIPES];
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static fd_entry *hands[FDCACHE_KIND_COUNT] = { NULL };
+static int counts[FDCACHE_KIND_COUNT] = { 0 };
+static int limits[FDCACHE_KIND_COUNT] = { 0 };
+
+// The working directory, which every URI is resolved from. It is never inserted or freed.
+static fd_entry root = { .kind = FDCACHE_DIR, .fd = AT_FDCWD };
+
+static _Atomic unsigned long hits[FDCACHE_KIND_COUNT] = { 0 };
+static _Atomic unsigned long misses[FDCACHE_KIND_COUNT] = { 0 };
+static _Atomic unsigned long mkdirs = 0;
+static _Atomic unsigned long evictions = 0;
+
+void fdcache_init(void) {
+    // Cached descriptors count against the same limit as connections, so take all that is allowed.
+    struct rlimit limit;
+    long share = FDCACHE_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur != RLIM_INFINITY) {
+            share = limit.rlim_cur / 4;
+        }
+    }
+    limits[FDCACHE_FILE] = (share < FDCACHE_FILES) ? share : FDCACHE_FILES;
+    limits[FDCACHE_DIR] = (share < FDCACHE_DIRS) ? share : FDCACHE_DIRS;
+    for (int i = 0; i < FDCACHE_STRIPES; i += 1) {
+        pthread_mutex_init(&stripes[i].mutex, NULL);
+        stripes[i].head = NULL;
+    }
+}
+
+static fd_entry **find(fd_stripe *stripe, int kind, const char *key, int len, uint64_t hash) {
+    fd_entry **cursor = &stripe->head;
+    while (*cursor
+           && ((*cursor)->hash != hash || (*cursor)->kind != kind || (*cursor)->key_len != len
+               || memcmp((*cursor)->key, key, len) != 0)) {
+        cursor = &(*cursor)->chain;
+    }
+    return cursor;
+}
+
+static fd_entry *lookup(int kind, const char *key, int len, uint64_t hash) {
+    if (limits[kind] == 0) {
+        return NULL;
+    }
+    fd_stripe *stripe = &stripes[hash % FDCACHE_STRIPES];
+    pthread_mutex_lock(&stripe->mutex);
+    fd_entry *entry = *find(stripe, kind, key, len, hash);
+    if (entry) {
+        atomic_fetch_add(&entry->refs, 1);
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    atomic_fetch_add_explicit(entry ? &hits[kind] : &misses[kind], 1, memory_order_relaxed);
+    return entry;
+}
+
+void fdcache_release(fd_entry *entry) {
+    if (entry == NULL || entry == &root) {
+        return;
+    }
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        close(entry->fd);
+        slab_free(entry, entry->cost);
+    }
+}
+
+// Unlinks an entry from the table and its CLOCK ring. Holds clock_lock and the entry's stripe.
+static void remove_entry(fd_entry **link) {
+    fd_entry *entry = *link;
+    *link = entry->chain;
+    if (entry->next == entry) {
+        hands[entry->kind] = NULL;
+    } else {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        if (hands[entry->kind] == entry) {
+            hands[entry->kind] = entry->next;
+        }
+    }
+    counts[entry->kind] -= 1;
+    fdcache_release(entry);
+}
+
+// Second-chance eviction within one kind, so hot directories never make room for cold files.
+// Holds clock_lock.
+static void evict(int kind) {
+    while (counts[kind] > limits[kind] && hands[kind]) {
+        fd_entry *entry = hands[kind];
+        if (atomic_exchange_explicit(&entry->referenced, 0, memory_order_relaxed)) {
+            hands[kind] = entry->next;
+            continue;
+        }
+        fd_stripe *stripe = &stripes[entry->hash % FDCACHE_STRIPES];
+        pthread_mutex_lock(&stripe->mutex);
+        remove_entry(find(stripe, kind, entry->key, entry->key_len, entry->hash));
+        pthread_mutex_unlock(&stripe->mutex);
+        atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+}
+
+static fd_entry *new_entry(int kind, const char *key, int len, uint64_t hash, int fd) {
+    size_t cost = sizeof(fd_entry) + len;
+    fd_entry *entry = slab_alloc(cost);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy(entry->key, key, len);
+    // One reference for the table and one for the caller.
+    atomic_init(&entry->refs, 2);
+    atomic_init(&entry->referenced, 0);
+    entry->kind = kind;
+    entry->fd = fd;
+    entry->hash = hash;
+    entry->key_len = len;
+    entry->cost = cost;
+    return entry;
+}
+
+/**
+   Links a new entry into the table and its CLOCK ring, evicting as needed. If another thread
+   inserted the same key first, nothing is linked and that entry is returned with a reference taken.
+ */
+static fd_entry *publish(fd_entry *entry) {
+    fd_stripe *stripe = &stripes[entry->hash % FDCACHE_STRIPES];
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&stripe->mutex);
+    fd_entry *existing = *find(stripe, entry->kind, entry->key, entry->key_len, entry->hash);
+    if (existing != NULL) {
+        atomic_fetch_add(&existing->refs, 1);
+        pthread_mutex_unlock(&stripe->mutex);
+        pthread_mutex_unlock(&clock_lock);
+        return existing;
+    }
+    entry->chain = stripe->head;
+    stripe->head = entry;
+    pthread_mutex_unlock(&stripe->mutex);
+    fd_entry *hand = hands[entry->kind];
+    if (hand == NULL) {
+        entry->prev = entry->next = entry;
+        hands[entry->kind] = entry;
+    } else {
+        entry->next = hand;
+        entry->prev = hand->prev;
+        hand->prev->next = entry;
+        hand->prev = entry;
+    }
+    counts[entry->kind] += 1;
+    evict(entry->kind);
+    pthread_mutex_unlock(&clock_lock);
+    return NULL;
+}
+
+fd_entry *fdcache_file(const char *key, int len, uint64_t hash) {
+    return lookup(FDCACHE_FILE, key, len, hash);
+}
+
+fd_entry *fdcache_insert(
+    const char *key, int len, uint64_t hash, int fd, const struct stat *st, const validator *valid) {
+    if (limits[FDCACHE_FILE] == 0) {
+        return NULL;
+    }
+    fd_entry *entry = new_entry(FDCACHE_FILE, key, len, hash, fd);
+    if (entry == NULL) {
+        return NULL;
+    }
+    // Filled in before the entry is published, so no reader ever sees it half built.
+    entry->st = *st;
+    entry->valid = *valid;
+    fd_entry *existing = publish(entry);
+    if (existing != NULL) {
+        // Another reader kept its own descriptor first; this one stays the caller's.
+        fdcache_release(existing);
+        slab_free(entry, entry->cost);
+        return NULL;
+    }
+    return entry;
+}
+
+void fdcache_invalidate(const char *key, int len, uint64_t hash) {
+    if (limits[FDCACHE_FILE] == 0) {
+        return;
+    }
+    fd_stripe *stripe = &stripes[hash % FDCACHE_STRIPES];
+    // Most writes are to files no GET kept open, which only need the stripe to find that out.
+    pthread_mutex_lock(&stripe->mutex);
+    int cached = (*find(stripe, FDCACHE_FILE, key, len, hash) != NULL);
+    pthread_mutex_unlock(&stripe->mutex);
+    if (!cached) {
+        return;
+    }
+    pthread_mutex_lock(&clock_lock);
+    pthread_mutex_lock(&stripe->mutex);
+    fd_entry **link = find(stripe, FDCACHE_FILE, key, len, hash);
+    if (*link) {
+        remove_entry(link);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+    pthread_mutex_unlock(&clock_lock);
+}
+
+/**
+   Keeps a directory opened by fdcache_dir and returns its entry with a reference, or the entry of
+   whichever thread opened it first. Without a table the descriptor is still returned, in an entry
+   of its own that closes it on release. Returns NULL and closes fd if there is no memory.
+ */
+static fd_entry *keep_dir(const char *key, int len, int fd) {
+    fd_entry *entry = new_entry(FDCACHE_DIR, key, len, uri_hash(key, len), fd);
+    if (entry == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (limits[FDCACHE_DIR] == 0) {
+        atomic_store(&entry->refs, 1);
+        return entry;
+    }
+    fd_entry *existing = publish(entry);
+    if (existing != NULL) {
+        close(fd);
+        slab_free(entry, entry->cost);
+        return existing;
+    }
+    return entry;
+}
+
+/**
+   Opens the directory path[0, len) relative to its parent. A cached parent resolves it with one
+   openat of the last component; otherwise the whole path is resolved by one openat from the working
+   directory, which the kernel walks faster than the table could be filled one level at a time.
+ */
+static int open_dir(char *path, int len) {
+    int slash = len - 1;
+    while (slash > 0 && path[slash] != '/') {
+        slash -= 1;
+    }
+    fd_entry *parent = (slash > 0) ? lookup(FDCACHE_DIR, path, slash, uri_hash(path, slash)) : NULL;
+    char saved = path[len];
+    path[len] = '\0';
+    int fd = parent ? openat(parent->fd, path + slash + 1, O_PATH | O_DIRECTORY | O_CLOEXEC)
+                    : openat(AT_FDCWD, path + 1, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    path[len] = saved;
+    int error = errno;
+    fdcache_release(parent);
+    errno = error;
+    return fd;
+}
+
+// Creates every missing directory of path[0, len), one component at a time. Each one made is synced
+// into its parent as the durability policy requires. Returns -1 with errno EIO if a sync fails.
+static int make_dirs(char *path, int len) {
+    int parent = 0;
+    for (int end = 1; end <= len; end += 1) {
+        if (end == len || path[end] == '/') {
+            char saved = path[end];
+            path[end] = '\0';
+            int made = (mkdirat(AT_FDCWD, path + 1, S_IRWXU) == 0);
+            path[end] = saved;
+            if (made) {
+                atomic_fetch_add_explicit(&mkdirs, 1, memory_order_relaxed);
+                int synced;
+                if (parent > 0) {
+                    path[parent] = '\0';
+                    synced = handle_sync_dir(AT_FDCWD, path + 1);
+                    path[parent] = '/';
+                } else {
+                    synced = handle_sync_dir(AT_FDCWD, ".");
+                }
+                if (synced == -1) {
+                    errno = EIO;
+                    return -1;
+                }
+            }
+            parent = end;
+        }
+    }
+    return 0;
+}
+
+fd_entry *fdcache_dir(const char *uri, int create) {
+    char path[BLOCK_2048];
+    int len = uri_normalize(uri, path);
+    // The key of a directory is its normalized path without the trailing slash, "" for the root.
+    while (len > 0 && path[len - 1] != '/') {
+        len -= 1;
+    }
+    len = (len > 0) ? len - 1 : 0;
+    if (len == 0) {
+        return &root;
+    }
+    fd_entry *entry = lookup(FDCACHE_DIR, path, len, uri_hash(path, len));
+    if (entry != NULL) {
+        return entry;
+    }
+    int fd = open_dir(path, len);
+    // Only a directory that is not known yet is ever created.
+    if (fd == -1 && errno == ENOENT && create) {
+        if (make_dirs(path, len) == -1) {
+            return NULL;
+        }
+        fd = open_dir(path, len);
+    }
+    return (fd == -1) ? NULL : keep_dir(path, len, fd);
+}
+
+void fdcache_stats(fdcache_counters *counters) {
+    counters->file_hits = atomic_load(&hits[FDCACHE_FILE]);
+    counters->file_misses = atomic_load(&misses[FDCACHE_FILE]);
+    counters->dir_hits = atomic_load(&hits[FDCACHE_DIR]);
+    counters->dir_misses = atomic_load(&misses[FDCACHE_DIR]);
+    counters->mkdirs = atomic_load(&mkdirs);
+    counters->evictions = atomic_load(&evictions);
+}
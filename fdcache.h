@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#pragma once
+
+#include "utils.h"
+
+// Number of independently locked buckets in the descriptor table
+#define FDCACHE_STRIPES 256
+// Most open files and most directories kept, each lowered to a quarter of the descriptor limit
+#define FDCACHE_FILES 16384
+#define FDCACHE_DIRS  16384
+
+enum FDCACHE_KINDS { FDCACHE_FILE, FDCACHE_DIR, FDCACHE_KIND_COUNT };
+
+// An open descriptor kept across requests. A file entry holds a read-only descriptor of one version
+// of a URI with the fstat taken when it was opened. A directory entry holds an O_PATH descriptor
+// that later lookups resolve names against with openat. Entries are reference counted like those of
+// the object cache, and the descriptor is closed with the last reference.
+typedef struct fd_entry {
+    _Atomic int refs;
+    _Atomic int referenced;
+    int kind;
+    int fd;
+    uint64_t hash;
+    int key_len;
+    size_t cost;
+    struct stat st;
+    validator valid;
+    struct fd_entry *chain;
+    struct fd_entry *prev;
+    struct fd_entry *next;
+    char key[];
+} fd_entry;
+
+typedef struct fdcache_counters {
+    unsigned long file_hits;
+    unsigned long file_misses;
+    unsigned long dir_hits;
+    unsigned long dir_misses;
+    unsigned long mkdirs;
+    unsigned long evictions;
+} fdcache_counters;
+
+// @brief Initializes the descriptor cache. Raises the process's soft descriptor limit to its hard
+// limit and sizes the cache to a quarter of it for files and a quarter for directories.
+void fdcache_init(void);
+
+// @brief Looks up the open file of a URI. Keys are the normalized path and hash kept by the URI's
+// lock.
+// @param key Normalized path of the URI.
+// @param len Length of the key.
+// @param hash Hash of the key.
+// @return The entry with a reference taken, or NULL on a miss.
+fd_entry *fdcache_file(const char *key, int len, uint64_t hash);
+
+// @brief Keeps a file the caller opened, with its fstat and validators, for later GETs. The caller
+// holds the URI's lock, so no write can publish between the open and the insert.
+// @param key Normalized path of the URI.
+// @param len Length of the key.
+// @param hash Hash of the key.
+// @param fd Read-only descriptor of the URI. It belongs to the entry if one is returned.
+// @param st Result of fstat on fd.
+// @param valid Validators built from st.
+// @return The new entry with a reference taken, or NULL if fd was not kept and is still the caller's.
+fd_entry *fdcache_insert(
+    const char *key, int len, uint64_t hash, int fd, const struct stat *st, const validator *valid);
+
+// @brief Forgets the open file of a URI after a PUT replaced it or an APPEND changed its size. The
+// caller holds the URI's writer lock.
+// @param key Normalized path of the URI.
+// @param len Length of the key.
+// @param hash Hash of the key.
+void fdcache_invalidate(const char *key, int len, uint64_t hash);
+
+// @brief Resolves the directory holding a URI. Each directory is opened once with openat relative
+// to its cached parent, so a known directory costs a table lookup instead of a path walk.
+// @param uri Path of the URI, such as ./a/b/c.
+// @param create Non-zero to create missing directories, each synced into its parent as the
+// durability policy requires. Known directories are never created again.
+// @return The entry with a reference taken, or NULL with errno set if a directory is missing, EIO if
+// one that was made could not be synced.
+fd_entry *fdcache_dir(const char *uri, int create);
+
+// @brief Drops a reference taken by any lookup. NULL is ignored.
+// @param entry The entry to release.
+void fdcache_release(fd_entry *entry);
+
+// @brief Reads the descriptor cache counters.
+// @param counters Filled with the current counts.
+void fdcache_stats(fdcache_counters *counters);
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include "follow.h"
+#include "slab.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define FOLLOW_HEADER "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+
+// A followed response. What it still has to send is the unsent part of prefix, then the bytes of
+// the file from offset up to chunk_end. Each chunk's closing CRLF goes out with the next prefix.
+typedef struct follower {
+    conn_struct *conn;
+    int urifd;
+    int wd;
+    int events;
+    int chunks;
+    int ending;
+    int dead;
+    off_t offset;
+    off_t chunk_end;
+    long last_active;
+    int prefix_len;
+    int prefix_sent;
+    char prefix[BLOCK_256];
+    struct follower *prev;
+    struct follower *next;
+} follower;
+
+// Handed over by the workers, not yet adopted by the follower thread
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static follower *pending = NULL;
+static _Atomic int follower_count = 0;
+
+// Only the follower thread touches the rest.
+static follower *active = NULL;
+static follower *dropped = NULL;
+static int epollfd = -1;
+static int inotifyfd = -1;
+static int wakefd = -1;
+static long idle_ms = 0;
+static void (*close_conn)(conn_struct *) = NULL;
+static pthread_t thread;
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/**
+   Ends a response and closes its connection. The follower itself is only freed after the current
+   batch of events, which may still name it.
+ */
+static void drop(follower *f) {
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        active = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    }
+    // Followers of the same file share its watch.
+    int shared = 0;
+    for (follower *other = active; other && !shared; other = other->next) {
+        shared = (other->wd == f->wd);
+    }
+    if (f->wd >= 0 && !shared) {
+        inotify_rm_watch(inotifyfd, f->wd);
+    }
+    close(f->urifd);
+    close_conn(f->conn);
+    f->dead = 1;
+    f->next = dropped;
+    dropped = f;
+    atomic_fetch_sub(&follower_count, 1);
+}
+
+/**
+   Queues the next chunk: whatever the file grew by, or the last chunk when end is set or the URI
+   was replaced. Only called once every byte of the previous chunk is out.
+   Returns 1 if anything was queued.
+ */
+static int queue_chunk(follower *f, int end) {
+    struct stat uri_stat;
+    if (!end && (fstat(f->urifd, &uri_stat) == -1 || uri_stat.st_nlink == 0)) {
+        // A PUT published a new inode, so this file never grows again.
+        end = 1;
+    }
+    char *prefix = f->prefix + f->prefix_len;
+    int size = sizeof(f->prefix) - f->prefix_len;
+    const char *crlf = f->chunks ? "\r\n" : "";
+    if (end) {
+        f->prefix_len += snprintf(prefix, size, "%s0\r\n\r\n", crlf);
+        f->ending = 1;
+        return 1;
+    }
+    if (uri_stat.st_size <= f->offset) {
+        return 0;
+    }
+    f->prefix_len += snprintf(prefix, size, "%s%lx\r\n", crlf, (long) (uri_stat.st_size - f->offset));
+    f->chunk_end = uri_stat.st_size;
+    f->chunks += 1;
+    f->last_active = now_ms();
+    return 1;
+}
+
+/**
+   Sends what is queued without blocking. Returns 1 once all of it is out, 0 if the socket is full,
+   and -1 if the client is gone.
+ */
+static int flush(follower *f) {
+    int fd = f->conn->fd;
+    while (f->prefix_sent < f->prefix_len) {
+        ssize_t sent = send(fd, f->prefix + f->prefix_sent, f->prefix_len - f->prefix_sent,
+            (f->offset < f->chunk_end) ? MSG_MORE : 0);
+        if (sent == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        f->prefix_sent += sent;
+        f->last_active = now_ms();
+    }
+    while (f->offset < f->chunk_end) {
+        ssize_t sent = sendfile(fd, f->urifd, &f->offset, f->chunk_end - f->offset);
+        if (sent == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        f->last_active = now_ms();
+    }
+    f->prefix_len = f->prefix_sent = 0;
+    return 1;
+}
+
+// Waits for room in the socket only while output is blocked, so an idle follower costs nothing.
+static void watch(follower *f, int events) {
+    if (f->events != events) {
+        struct epoll_event event = { .events = events, .data.ptr = f };
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, f->conn->fd, &event);
+        f->events = events;
+    }
+}
+
+/**
+   Sends chunks until the file stops growing or the socket fills up.
+ */
+static void pump(follower *f) {
+    for (;;) {
+        // A follower resumed with part of a chunk still unsent finishes it before looking for more.
+        int caught_up = (f->offset == f->chunk_end);
+        int queued = (caught_up && !f->ending) ? queue_chunk(f, 0) : 0;
+        int done = flush(f);
+        if (done < 0 || (done == 1 && f->ending)) {
+            drop(f);
+            return;
+        }
+        if (done == 0) {
+            watch(f, EPOLLOUT);
+            return;
+        }
+        if (caught_up && !queued) {
+            watch(f, 0);
+            return;
+        }
+    }
+}
+
+static void adopt(void) {
+    uint64_t count;
+    if (read(wakefd, &count, sizeof(count)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&pending_lock);
+    follower *f = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&pending_lock);
+
+    while (f) {
+        follower *next = f->next;
+        f->prev = NULL;
+        f->next = active;
+        if (active) {
+            active->prev = f;
+        }
+        active = f;
+        // The watch is taken through the descriptor, so it stays on the inode that was opened.
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", f->urifd);
+        f->wd = inotify_add_watch(inotifyfd, path, IN_MODIFY | IN_ATTRIB);
+        struct epoll_event event = { .events = 0, .data.ptr = f };
+        if (f->wd < 0 || epoll_ctl(epollfd, EPOLL_CTL_ADD, f->conn->fd, &event) < 0) {
+            drop(f);
+        } else {
+            pump(f);
+        }
+        f = next;
+    }
+}
+
+static void notified(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(inotifyfd, buffer, sizeof(buffer))) > 0) {
+        for (char *cursor = buffer; cursor < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *) cursor;
+            for (follower *f = active, *next; f; f = next) {
+                next = f->next;
+                // A follower still blocked on its socket is resumed by EPOLLOUT instead.
+                if (f->wd == event->wd && f->events == 0) {
+                    pump(f);
+                }
+            }
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/**
+   Ends every response whose file has not grown for the idle timeout, and drops every client that
+   has not taken any bytes for as long.
+ */
+static void sweep(void) {
+    long deadline = now_ms() - idle_ms;
+    for (follower *f = active, *next; f; f = next) {
+        next = f->next;
+        if (f->last_active >= deadline) {
+            continue;
+        }
+        if (f->events != 0) {
+            drop(f);
+        } else if (!f->ending) {
+            queue_chunk(f, 1);
+            pump(f);
+        }
+    }
+}
+
+static void *follow_thread(void *args) {
+    (void) args;
+    struct epoll_event events[FOLLOW_EVENTS];
+    for (;;) {
+        int ready = epoll_wait(epollfd, events, FOLLOW_EVENTS, FOLLOW_SWEEP_MS);
+        for (int i = 0; i < ready; i += 1) {
+            void *ptr = events[i].data.ptr;
+            follower *f = ptr;
+            if (ptr == &wakefd) {
+                adopt();
+            } else if (ptr == &inotifyfd) {
+                notified();
+            } else if (f->dead) {
+                continue;
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                drop(f);
+            } else {
+                pump(f);
+            }
+        }
+        sweep();
+        while (dropped) {
+            follower *f = dropped;
+            dropped = f->next;
+            slab_free(f, sizeof(follower));
+        }
+    }
+    return NULL;
+}
+
+int follow_init(int idle_seconds, void (*close_connection)(conn_struct *)) {
+    idle_ms = idle_seconds * 1000L;
+    close_conn = close_connection;
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event wake_event = { .events = EPOLLIN, .data.ptr = &wakefd };
+    struct epoll_event inotify_event = { .events = EPOLLIN, .data.ptr = &inotifyfd };
+    if (epollfd < 0 || inotifyfd < 0 || wake < 0
+        || epoll_ctl(epollfd, EPOLL_CTL_ADD, wake, &wake_event) < 0
+        || epoll_ctl(epollfd, EPOLL_CTL_ADD, inotifyfd, &inotify_event) < 0) {
+        close(epollfd);
+        close(inotifyfd);
+        close(wake);
+        return -1;
+    }
+    wakefd = wake;
+    if (pthread_create(&thread, NULL, follow_thread, NULL) != 0) {
+        wakefd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int follow_start(conn_struct *conn, int urifd) {
+    if (wakefd == -1) {
+        return -1;
+    }
+    if (atomic_fetch_add(&follower_count, 1) >= FOLLOW_MAX) {
+        atomic_fetch_sub(&follower_count, 1);
+        return -1;
+    }
+    follower *f = slab_alloc(sizeof(follower));
+    if (f == NULL) {
+        atomic_fetch_sub(&follower_count, 1);
+        return -1;
+    }
+    memset(f, 0, offsetof(follower, prefix));
+    f->conn = conn;
+    f->urifd = urifd;
+    f->wd = -1;
+    f->last_active = now_ms();
+    f->prefix_len = sizeof(FOLLOW_HEADER) - 1;
+    memcpy(f->prefix, FOLLOW_HEADER, f->prefix_len);
+
+    pthread_mutex_lock(&pending_lock);
+    f->next = pending;
+    pending = f;
+    pthread_mutex_unlock(&pending_lock);
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include <sys/types.h>
+
+#pragma once
+
+#include "utils.h"
+
+// Most GET responses being followed at once, more are served as plain snapshots
+#define FOLLOW_MAX 1024
+// Most events handled per wakeup of the follower thread
+#define FOLLOW_EVENTS 64
+// How often followers are checked against the idle timeout, in milliseconds
+#define FOLLOW_SWEEP_MS 1000
+
+// @brief Starts the follower thread, which streams files that grow through APPEND to the GET
+// requests following them.
+// @param idle_seconds A followed response ends once its file has not grown for this long.
+// @param close_conn Closes a connection once its response has ended.
+// @return 0 on success, -1 if the thread could not be started. Following is then unavailable.
+int follow_init(int idle_seconds, void (*close_conn)(conn_struct *));
+
+// @brief Hands a GET response over to the follower thread. It sends a 200 with
+// Transfer-Encoding: chunked and Connection: close, the file as it is, then every byte appended to
+// it as a chunk of its own. The response ends with the last chunk when the URI is replaced by a
+// PUT or the file stops growing for the idle timeout, and the connection is closed.
+// @param conn The connection, which the caller must no longer touch on success.
+// @param urifd Open descriptor of the URI, owned by the follower thread on success.
+// @return 0 if the follower took the response over, -1 if it is unavailable or busy.
+int follow_start(conn_struct *conn, int urifd);
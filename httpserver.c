@@ -1,150 +1,814 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <poll.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <poll.h>
-#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/sysinfo.h>
 #include "utils.h"
+#include "queue.h"
+#include "urilock.h"
+#include "auditlog.h"
+#include "cache.h"
+#include "uring.h"
+#include "stats.h"
+#include "slab.h"
+#include "follow.h"
+#include "syncer.h"
+#include "fdcache.h"
 
 #define DEFAULT_THREAD_COUNT 4
-#define OPTIONS              "t:l:"
+#define DEFAULT_QUEUE_SIZE   BLOCK_2048
+#define OPTIONS              "t:l:q:i:r:f:s:c:b:n:a:d:w:o:H:B:D:L:m:"
+#define EPOLL_EVENTS         64
+#define SWEEP_INTERVAL       1000
+#define DEFAULT_IDLE_TIMEOUT 5
+#define DEFAULT_MAX_REQUESTS 100
+#define DEFAULT_FLUSH_MS     10
+#define DEFAULT_CACHE_MB     64
+#define DEFAULT_SHARDS       1
+#define DEFAULT_BACKLOG      128
+#define DEFAULT_SYNC_MS      2
+#define DEFAULT_HEAD_TIMEOUT 10
+#define DEFAULT_XFER_TIMEOUT 30
+#define SHED_DRAIN_READS     4
+#define IP_SLOTS             65536
+#define URING_ENTRIES        4096
+#define URING_BUFFERS        4096
+#define URING_MIN_BUFFERS    256
+#define URING_GROUP          0
 static FILE *logfile;
-#define LOG(...) handle_log(logfile, __VA_ARGS__);
 
-pthread_mutex_t mutex;
-pthread_mutex_t lock;
-pthread_cond_t add_conn;
-pthread_cond_t take_conn;
-int socket_count = 0;
+// Parked connections, linked through their prev and next fields.
+typedef struct parked_list {
+    conn_struct *head;
+    conn_struct *tail;
+} parked_list;
+
+// A shard owns a listener, the thread that accepts and polls its connections, a queue and the
+// workers that serve it. A connection stays in the shard that accepted it until it is closed, and
+// every thread of a shard is pinned to the same CPUs.
+typedef struct shard {
+    int listenfd;
+    int epollfd;
+    queue_t queue;
+    pthread_mutex_t parked_lock;
+    parked_list idle;
+    parked_list waiting;
+    uring reactor;
+    uring_bufs recv_bufs;
+    pthread_t poll_thread;
+    cpu_set_t cpus;
+    _Atomic long sojourn;
+} shard_t;
+
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+int max_requests = DEFAULT_MAX_REQUESTS;
+int header_timeout = DEFAULT_HEAD_TIMEOUT;
+int shed_depth = 0;
+int shed_latency = 0;
+int max_per_ip = 0;
 pthread_t *thread_pool;
 int thread_count = 0;
+shard_t *shards;
+int shard_count = DEFAULT_SHARDS;
+
+// The shard of the calling thread, set when a poller or worker starts.
+static _Thread_local shard_t *local_shard = NULL;
 
-typedef struct conn_struct {
-    char buffer[BLOCK_2048];
-    int fd;
-    int bytes_read;
-} conn_struct;
+// Written whole to a connection the server will not serve, so refusing one costs a single send.
+static const char SHED_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 20 \r\n"
+                                    "Retry-After: 1\r\nConnection: close\r\n\r\n"
+                                    "Service Unavailable\n";
 
-conn_struct *conn_queue[BLOCK_2048];
+// Open connections per client address, counted in hashed slots. Addresses that share a slot share
+// its limit, which only ever errs toward refusing.
+static _Atomic int ip_conns[IP_SLOTS];
+
+static _Atomic unsigned long shed_queued = 0;
+static _Atomic unsigned long shed_late = 0;
+static _Atomic unsigned long shed_ip = 0;
+static _Atomic unsigned long head_timeouts = 0;
+
+// Completions that do not belong to a receive. Connections are at least 8-byte aligned, so these
+// can never be mistaken for one, and a connection with the low bit set is a worker parking it.
+enum URING_TAGS { TAG_PARK = 1, TAG_ACCEPT = 2, TAG_TIMER = 4, TAG_CANCEL = 6 };
 
 conn_struct *get_connection(void);
 void submit_connection(conn_struct *conn);
+void close_connection(conn_struct *conn);
+void park_connection(conn_struct *conn, int op);
+void *thread_poll(void *args);
+void *thread_uring(void *args);
 void *thread_dispatch(void *args);
+static void accept_connections(shard_t *shard);
 void handle_connection(conn_struct *conn);
+static int find_head(conn_struct *conn, int offset);
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+   Refuses a connection with the precomputed 503 and closes it. Whatever the client already sent is
+   read off first, a bounded number of times, so the close does not reset the connection before
+   the response reaches it.
+ */
+static void shed_connection(conn_struct *conn, _Atomic unsigned long *counter) {
+    char scratch[BLOCK_2048];
+    for (int i = 0; i < SHED_DRAIN_READS; i += 1) {
+        if (recv(conn->fd, scratch, sizeof(scratch), MSG_DONTWAIT) <= 0) {
+            break;
+        }
+    }
+    // A connection that is part way through a response can only be cut off.
+    if (conn->xfer.phase != XFER_SEND) {
+        send(conn->fd, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+    close_connection(conn);
+}
+
+/**
+   Whether a shard is too far behind to take on more work: its queue is past the depth limit, or
+   requests are waiting in it longer than the latency limit. The wait is the one last measured by a
+   worker, which only counts while the queue is not empty, since an empty queue is never late.
+ */
+static int overloaded(shard_t *shard) {
+    int depth = (shed_depth > 0 || shed_latency > 0) ? queue_size(&shard->queue) : 0;
+    return (shed_depth > 0 && depth >= shed_depth)
+           || (shed_latency > 0 && depth > 0
+               && atomic_load_explicit(&shard->sojourn, memory_order_relaxed) > shed_latency);
+}
 
 conn_struct *get_connection(void) {
-    pthread_mutex_lock(&mutex);
-    while (socket_count == 0) {
-        pthread_cond_wait(&add_conn, &mutex);
-    }
-    assert(socket_count > 0);
-    socket_count -= 1;
-    conn_struct *conn = conn_queue[0];
-    for (int i = 0; i < socket_count; i += 1) {
-        conn_queue[i] = conn_queue[i + 1];
-    }
-    pthread_cond_signal(&take_conn);
-    pthread_mutex_unlock(&mutex);
+    conn_struct *conn = queue_pop(&local_shard->queue);
+    STATS_RECORD(STAGE_QUEUE, conn->queued);
+    if (shed_latency > 0) {
+        long waited = now_ms() - conn->enqueued;
+        atomic_store_explicit(&local_shard->sojourn, waited, memory_order_relaxed);
+    }
     return conn;
 }
 
+/**
+   Queues a connection with bytes to serve for the shard's workers. Only pollers submit, so a full
+   queue sheds the connection with a 503 instead of stalling every other connection of the shard.
+ */
 void submit_connection(conn_struct *conn) {
-    pthread_mutex_lock(&mutex);
-    if (socket_count == BLOCK_2048 - 1) {
-        pthread_cond_wait(&take_conn, &mutex);
-    }
-    conn_queue[socket_count] = conn;
-    socket_count += 1;
-    pthread_cond_signal(&add_conn);
-    pthread_mutex_unlock(&mutex);
+    conn->queued = STATS_STAMP();
+    if (shed_latency > 0) {
+        conn->enqueued = now_ms();
+    }
+    if (!queue_offer(&local_shard->queue, conn)) {
+        shed_connection(conn, &shed_queued);
+    }
+    return;
+}
+
+// Connections between requests wait on the idle list, in the order they went idle. Those in the
+// middle of a request wait on their own list, since each has a deadline of its own.
+static parked_list *parked_on(shard_t *shard, conn_struct *conn) {
+    return conn->deadline ? &shard->waiting : &shard->idle;
+}
+
+static int parked(shard_t *shard, conn_struct *conn) {
+    return conn->prev || parked_on(shard, conn)->head == conn;
+}
+
+static void parked_unlink(shard_t *shard, conn_struct *conn) {
+    parked_list *list = parked_on(shard, conn);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        list->head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        list->tail = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+static void parked_append(shard_t *shard, conn_struct *conn) {
+    parked_list *list = parked_on(shard, conn);
+    conn->last_active = now_ms();
+    conn->prev = list->tail;
+    conn->next = NULL;
+    if (list->tail) {
+        list->tail->next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+}
+
+// When a connection that is parked in the middle of a request has to be woken even if its socket
+// never becomes ready: at the header timeout while its head is incomplete, and otherwise when its
+// transfer falls behind. A transfer without a time limit is left to the idle timeout.
+static long wait_deadline(conn_struct *conn) {
+    if (conn->xfer.phase != XFER_HEAD) {
+        return transfer_deadline(&conn->xfer);
+    }
+    if (conn->head_started) {
+        return conn->head_started + header_timeout * 1000L;
+    }
+    return 0;
+}
+
+/**
+   Counts a new connection against the limit of its client's address. Returns 0 if that address
+   already has max_per_ip connections open. The slot is kept in the connection, plus one so that
+   0 means none, and given back when it closes.
+ */
+static int admit_address(conn_struct *conn) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(conn->fd, (struct sockaddr *) &addr, &len) < 0 || addr.sin_family != AF_INET) {
+        return 1;
+    }
+    int slot = (uint32_t) (addr.sin_addr.s_addr * 2654435761u) % IP_SLOTS;
+    if (atomic_fetch_add(&ip_conns[slot], 1) >= max_per_ip) {
+        atomic_fetch_sub(&ip_conns[slot], 1);
+        return 0;
+    }
+    conn->ip_slot = slot + 1;
+    return 1;
+}
+
+/**
+   Takes a connection object from the calling thread's slab. Only the fields before the buffer are
+   cleared, since every byte of the buffer is written before it is read. A connection that an
+   overloaded shard or its address's limit refuses is answered with a 503 and NULL is returned.
+ */
+static conn_struct *open_connection(int fd) {
+    conn_struct *conn = slab_alloc(sizeof(conn_struct));
+    if (conn == NULL) {
+        close(fd);
+        return NULL;
+    }
+    memset(conn, 0, offsetof(conn_struct, buffer));
+    conn->fd = fd;
+    STATS_CONNECTION(1);
+    if (overloaded(local_shard)) {
+        shed_connection(conn, &shed_queued);
+        return NULL;
+    }
+    if (max_per_ip > 0 && !admit_address(conn)) {
+        shed_connection(conn, &shed_ip);
+        return NULL;
+    }
+    return conn;
+}
+
+void close_connection(conn_struct *conn) {
+    STATS_CONNECTION(-1);
+    handle_abort(conn);
+    if (conn->ip_slot > 0) {
+        atomic_fetch_sub(&ip_conns[conn->ip_slot - 1], 1);
+    }
+    close(conn->fd);
+    slab_free(conn, sizeof(conn_struct));
     return;
 }
 
+/**
+   Queues a receive for a parked connection on the reactor's ring. By default the kernel picks a
+   buffer from the provided buffer ring when bytes arrive, so an idle connection lends it nothing;
+   if that ring runs dry the receive goes straight into the connection's own buffer instead.
+   Only the reactor submits to its ring, so the kernel also runs the deferred part of every
+   receive on the reactor rather than on whichever worker parked the connection.
+ */
+static struct io_uring_sqe *reactor_sqe(void) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_sqe(&local_shard->reactor)) == NULL) {
+        uring_submit(&local_shard->reactor, 0);
+    }
+    return sqe;
+}
+
+static void arm_recv(conn_struct *conn, int select) {
+    struct io_uring_sqe *sqe = reactor_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = BLOCK_2048 - conn->bytes_read;
+    if (select) {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_GROUP;
+    } else {
+        sqe->addr = (uintptr_t) (conn->buffer + conn->bytes_read);
+    }
+    sqe->user_data = (uintptr_t) conn;
+}
+
+// Waits for room in the socket of a connection that is in the middle of sending a response.
+static void arm_poll(conn_struct *conn) {
+    struct io_uring_sqe *sqe = reactor_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uintptr_t) conn;
+}
+
+static void arm_tag(int opcode, int fd, uint64_t addr, int tag) {
+    static struct __kernel_timespec interval = { .tv_sec = SWEEP_INTERVAL / 1000 };
+    struct io_uring_sqe *sqe = reactor_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    if (opcode == IORING_OP_ACCEPT) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else if (opcode == IORING_OP_TIMEOUT) {
+        sqe->addr = (uintptr_t) &interval;
+        sqe->len = 1;
+    }
+    sqe->user_data = tag;
+}
+
+void park_failed(uint64_t user_data) {
+    warnx("io_uring message error");
+    close_connection((conn_struct *) (uintptr_t) user_data);
+}
+
+/**
+   Hands a connection back to the reactor from a worker. The worker posts a completion straight
+   into the reactor's ring from its own ring, tagged with the low bit, and the reactor arms the
+   receive when it reaps it. The message itself produces no completion on the worker's ring unless
+   it fails.
+ */
+static void uring_park(conn_struct *conn) {
+    uring *ring = uring_local();
+    struct io_uring_sqe *sqe = ring ? uring_sqe(ring) : NULL;
+    if (sqe == NULL) {
+        warnx("io_uring unavailable in worker");
+        close_connection(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_MSG_RING;
+    sqe->fd = local_shard->reactor.fd;
+    sqe->addr = IORING_MSG_DATA;
+    sqe->off = (uintptr_t) conn | TAG_PARK;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = (uintptr_t) conn;
+    uring_submit(ring, 0);
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek(ring)) != NULL) {
+        park_failed(cqe->user_data);
+        uring_advance(ring);
+    }
+}
+
+/**
+   Hands a connection to the poller until its socket becomes readable, or writable when it is in
+   the middle of sending a response.
+   Edge-triggered and one-shot, so exactly one wakeup is delivered per arming
+   and a parked connection costs nothing until bytes arrive. Re-arming with
+   EPOLL_CTL_MOD re-checks readiness, so data that raced in is never missed.
+   Connections between requests are appended to a list ordered by when they
+   went idle, which the poller sweeps from the front to enforce the idle
+   timeout. The rest carry the deadline of their head or transfer instead. With
+   the io_uring backend a receive is queued on the reactor's ring instead.
+ */
+void park_connection(conn_struct *conn, int op) {
+    shard_t *shard = local_shard;
+    conn->deadline = wait_deadline(conn);
+    struct epoll_event event;
+    // A response that filled the socket waits for room in it. EPOLLRDHUP is left out there, since a
+    // client that only shut down its side still reads and would wake it again and again.
+    event.events = ((conn->xfer.phase == XFER_SEND) ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLET
+                   | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if (io_backend == BACKEND_URING) {
+        uring_park(conn);
+        return;
+    }
+    pthread_mutex_lock(&shard->parked_lock);
+    parked_append(shard, conn);
+    if (epoll_ctl(shard->epollfd, op, conn->fd, &event) < 0) {
+        warn("epoll_ctl error");
+        parked_unlink(shard, conn);
+        close_connection(conn);
+    }
+    pthread_mutex_unlock(&shard->parked_lock);
+    return;
+}
+
+/**
+   Closes every connection that has been idle between requests longer than the
+   timeout, and hands every connection whose request ran out of time to a
+   worker, which finds the expired head or transfer and answers it with a 408.
+   Only the poller calls this, between batches of events, so a connection on
+   the lists cannot have a wakeup that was returned but not yet handled.
+ */
+static void sweep_idle(shard_t *shard) {
+    long now = now_ms();
+    long deadline = now - idle_timeout * 1000L;
+    conn_struct *expired = NULL;
+    pthread_mutex_lock(&shard->parked_lock);
+    while (shard->idle.head && shard->idle.head->last_active <= deadline) {
+        conn_struct *conn = shard->idle.head;
+        parked_unlink(shard, conn);
+        epoll_ctl(shard->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close_connection(conn);
+    }
+    conn_struct *next;
+    for (conn_struct *conn = shard->waiting.head; conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->deadline <= now) {
+            // Disarmed, so the worker owns it alone until it parks it again.
+            struct epoll_event none = { 0 };
+            parked_unlink(shard, conn);
+            epoll_ctl(shard->epollfd, EPOLL_CTL_MOD, conn->fd, &none);
+            conn->next = expired;
+            expired = conn;
+        }
+    }
+    pthread_mutex_unlock(&shard->parked_lock);
+    while (expired != NULL) {
+        conn_struct *conn = expired;
+        expired = conn->next;
+        conn->next = NULL;
+        submit_connection(conn);
+    }
+}
+
+/**
+   Accepts every pending connection on the shard's listener and parks it with the shard's poller.
+   The listener is non-blocking and level-triggered in the poller's set, so a backlog that is not
+   drained in one pass is reported again.
+ */
+static void accept_connections(shard_t *shard) {
+    for (;;) {
+        int connfd = accept4(shard->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                warn("accept error");
+            }
+            return;
+        }
+        conn_struct *conn = open_connection(connfd);
+        if (conn != NULL) {
+            park_connection(conn, EPOLL_CTL_ADD);
+        }
+    }
+}
+
+/**
+   Poller of a shard with the epoll backend. It accepts the shard's connections itself, so a
+   connection is accepted, polled and served by threads on the same CPUs. The listener is
+   registered with a NULL pointer, which no connection can have.
+ */
+void *thread_poll(void *args) {
+    shard_t *shard = args;
+    local_shard = shard;
+    struct epoll_event events[EPOLL_EVENTS];
+    for (;;) {
+        int ready = epoll_wait(shard->epollfd, events, EPOLL_EVENTS, SWEEP_INTERVAL);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                warn("epoll_wait error");
+            }
+            continue;
+        }
+        int listener = 0;
+        pthread_mutex_lock(&shard->parked_lock);
+        for (int i = 0; i < ready; i += 1) {
+            if (events[i].data.ptr == NULL) {
+                listener = 1;
+            } else {
+                parked_unlink(shard, events[i].data.ptr);
+            }
+        }
+        pthread_mutex_unlock(&shard->parked_lock);
+        for (int i = 0; i < ready; i += 1) {
+            if (events[i].data.ptr != NULL) {
+                submit_connection(events[i].data.ptr);
+            }
+        }
+        if (listener) {
+            accept_connections(shard);
+        }
+        sweep_idle(shard);
+    }
+}
+
+/**
+   Cancels the receive or poll of every connection that has been idle between requests longer
+   than the timeout, or whose request ran out of time. The pending operation still owns the
+   connection. When it completes cancelled, an idle connection is closed and one in the middle of
+   a request goes to a worker, which answers it with a 408.
+ */
+static void sweep_uring(shard_t *shard) {
+    long now = now_ms();
+    long deadline = now - idle_timeout * 1000L;
+    pthread_mutex_lock(&shard->parked_lock);
+    while (shard->idle.head && shard->idle.head->last_active <= deadline) {
+        conn_struct *conn = shard->idle.head;
+        parked_unlink(shard, conn);
+        arm_tag(IORING_OP_ASYNC_CANCEL, -1, (uintptr_t) conn, TAG_CANCEL);
+    }
+    conn_struct *next;
+    for (conn_struct *conn = shard->waiting.head; conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->deadline <= now) {
+            parked_unlink(shard, conn);
+            arm_tag(IORING_OP_ASYNC_CANCEL, -1, (uintptr_t) conn, TAG_CANCEL);
+        }
+    }
+    pthread_mutex_unlock(&shard->parked_lock);
+}
+
+static void uring_receive(shard_t *shard, conn_struct *conn, int res, unsigned flags) {
+    pthread_mutex_lock(&shard->parked_lock);
+    if (parked(shard, conn)) {
+        parked_unlink(shard, conn);
+    }
+    if (res == -ENOBUFS) {
+        parked_append(shard, conn);
+        arm_recv(conn, 0);
+    }
+    pthread_mutex_unlock(&shard->parked_lock);
+    if (res == -ENOBUFS) {
+        return;
+    }
+    if (res == -ECANCELED && conn->deadline) {
+        submit_connection(conn);
+        return;
+    }
+    if (res < 0) {
+        close_connection(conn);
+        return;
+    }
+    if (conn->xfer.phase == XFER_SEND) {
+        // A poll for room to send, which brings no bytes.
+        submit_connection(conn);
+        return;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        memcpy(conn->buffer + conn->bytes_read, uring_buf(&shard->recv_bufs, flags), res);
+        uring_buf_recycle(&shard->recv_bufs, flags);
+    }
+    conn->bytes_read += res;
+    if (conn->head_len == 0) {
+        find_head(conn, conn->bytes_read - res);
+    }
+    submit_connection(conn);
+}
+
+/**
+   Completion loop of the io_uring backend, which replaces both the accept loop and the epoll
+   poller. One multishot accept produces every new connection, and each parked connection has a
+   single receive in flight whose bytes are copied into the connection before it is queued, so a
+   request that arrives in one segment reaches a worker without any further read. Everything
+   armed while handling a batch is submitted by the same io_uring_enter that waits for the next.
+   Each shard has its own reactor on its own listener.
+ */
+void *thread_uring(void *args) {
+    shard_t *shard = args;
+    local_shard = shard;
+    arm_tag(IORING_OP_ACCEPT, shard->listenfd, 0, TAG_ACCEPT);
+    arm_tag(IORING_OP_TIMEOUT, -1, 0, TAG_TIMER);
+    for (;;) {
+        uring_submit(&shard->reactor, 1);
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&shard->reactor)) != NULL) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_advance(&shard->reactor);
+
+            if (tag == TAG_ACCEPT) {
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    arm_tag(IORING_OP_ACCEPT, shard->listenfd, 0, TAG_ACCEPT);
+                }
+                if (res < 0) {
+                    errno = -res;
+                    warn("accept error");
+                    continue;
+                }
+                conn_struct *conn = open_connection(res);
+                if (conn == NULL) {
+                    continue;
+                }
+                tag = (uintptr_t) conn | TAG_PARK;
+            } else if (tag == TAG_TIMER) {
+                arm_tag(IORING_OP_TIMEOUT, -1, 0, TAG_TIMER);
+                sweep_uring(shard);
+                continue;
+            } else if (tag == TAG_CANCEL) {
+                continue;
+            }
+
+            conn_struct *conn = (conn_struct *) (uintptr_t) (tag & ~(uint64_t) TAG_PARK);
+            if (tag & TAG_PARK) {
+                pthread_mutex_lock(&shard->parked_lock);
+                parked_append(shard, conn);
+                if (conn->xfer.phase == XFER_SEND) {
+                    arm_poll(conn);
+                } else {
+                    arm_recv(conn, 1);
+                }
+                pthread_mutex_unlock(&shard->parked_lock);
+            } else {
+                uring_receive(shard, conn, res, flags);
+            }
+        }
+    }
+}
+
 void *thread_dispatch(void *args) {
-    (void) args;
-    struct pollfd pollfd[1];
+    local_shard = args;
     for (;;) {
         conn_struct *conn = get_connection();
-        pollfd[0].fd = conn->fd;
-        pollfd[0].events = POLLIN;
-        while (poll(pollfd, 1, 100) < 0) {
-            submit_connection(conn);
-            conn = get_connection();
-            pollfd[0].fd = conn->fd;
+        // A request that already waited past the latency limit is answered at once rather than
+        // served late, which keeps the queue short enough for those behind it.
+        if (shed_latency > 0 && conn->xfer.phase == XFER_HEAD
+            && now_ms() - conn->enqueued > shed_latency) {
+            shed_connection(conn, &shed_late);
+            continue;
         }
         handle_connection(conn);
     }
 }
 
+/**
+   Looks for the end of a request head in the buffered bytes from offset on.
+   Returns 1 and sets head_len once the double CRLF is present.
+ */
+static int find_head(conn_struct *conn, int offset) {
+    offset = (offset > 3) ? offset - 3 : 0;
+    char *end = memmem(conn->buffer + offset, conn->bytes_read - offset, "\r\n\r\n", 4);
+    if (end != NULL) {
+        conn->head_len = (end + 4) - conn->buffer;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+   Reports whether a connection that is waiting on the rest of a request head has run out of time.
+   The clock starts the first time it waits with part of a head, so a client that sends a byte at a
+   time still has header_timeout to finish, however often each byte refreshes its idle time.
+ */
+static int head_expired(conn_struct *conn) {
+    if (conn->bytes_read == 0) {
+        return 0;
+    }
+    long now = now_ms();
+    if (conn->head_started == 0) {
+        conn->head_started = now;
+        return 0;
+    }
+    return now - conn->head_started > header_timeout * 1000L;
+}
+
+/**
+   Serves requests from a connection until it must wait, in which case it is parked again, or until
+   it is finished, in which case it is closed. Each request runs through the phases kept in
+   conn->xfer: its head is read, then its message, then its response is sent. Whenever the socket
+   runs dry or fills up, the worker leaves the request where it is and moves on. The next wakeup,
+   on whichever worker, parses the head again, since it stays at the start of the buffer until the
+   request is done, and carries on from the saved phase. Pipelined requests already in the buffer
+   are served back to back, so their responses go out in request order.
+ */
 void handle_connection(conn_struct *conn) {
-    void (*Method_Functions[])() = { put_request, get_request, append_request };
-    char hf[BLOCK_2048] = { 0 };
-    int method = -1;
-    int length = 0;
-    int local_read = 0;
-    int uri_fd = -1;
-    char uri[BLOCK_2048] = { 0 };
-    int status_code = OK;
-
-    while ((local_read = read(conn->fd, conn->buffer + conn->bytes_read, 1)) > 0) {
-        conn->bytes_read += local_read;
-        if (conn->bytes_read >= BLOCK_2048 && strstr(conn->buffer, "\r\n\r\n") == NULL) {
+    void (*Method_Functions[])(conn_struct *, request_t *, char *, int *)
+        = { put_request, get_request, append_request, mget_request };
+
+    for (;;) {
+        request_t req;
+        int local_read = 1;
+        char uri[BLOCK_2048];
+        int status_code = OK;
+        int phase = conn->xfer.phase;
+        uri[0] = '\0';
+        STATS_BEGIN();
+        long stage = STATS_NOW();
+
+        // Read as much as the buffer holds and only scan the new bytes (plus the three before them,
+        // in case the terminator straddles two reads) for the end of the head.
+        while (phase == XFER_HEAD && conn->head_len == 0 && conn->bytes_read < BLOCK_2048
+               && (local_read
+                      = read(conn->fd, conn->buffer + conn->bytes_read, BLOCK_2048 - conn->bytes_read))
+                      > 0) {
+            conn->bytes_read += local_read;
+            if (find_head(conn, conn->bytes_read - local_read)) {
+                break;
+            }
+        }
+        if (conn->head_len == 0 && conn->bytes_read >= BLOCK_2048) {
             status_code = BAD_REQ;
-            break;
         }
-        if (strstr(conn->buffer, "\r\n\r\n") != NULL) {
-            break;
+        if (local_read <= -1) {
+            if ((errno == EWOULDBLOCK || errno == EAGAIN) && !head_expired(conn)) {
+                park_connection(conn, EPOLL_CTL_MOD);
+                return;
+            } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                atomic_fetch_add_explicit(&head_timeouts, 1, memory_order_relaxed);
+                status_code = REQ_TIMEOUT;
+            } else {
+                status_code = BAD_REQ;
+            }
         }
-    }
-    if (local_read <= -1) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            submit_connection(conn);
+        if (local_read == 0 && conn->bytes_read == 0) {
+            // Closed cleanly between requests.
+            close_connection(conn);
             return;
-        } else {
-            status_code = BAD_REQ;
         }
-    }
+        if (phase == XFER_HEAD) {
+            memset(&conn->xfer, 0, sizeof(conn->xfer));
+            stage = STATS_RECORD(STAGE_HEAD, stage);
+        }
 
-    if (status_code == OK) {
-        handle_request(conn->buffer, &method, &uri_fd, uri, &status_code);
-        if (status_code == OK || status_code == CREATED) {
-            handle_hf(conn->buffer, hf, &length, &status_code);
-            if (status_code == OK || status_code == CREATED) {
-                Method_Functions[method](uri_fd, uri, conn->fd, length, &status_code, &lock);
-            } else {
-                pthread_mutex_lock(&lock);
-                handle_response(conn->fd, length, &status_code);
+        request_init(&req);
+        handle_request(conn->buffer, conn->bytes_read, &req, uri, &status_code);
+        if (status_code == OK || status_code == NOT_IMPL) {
+            handle_hf(conn->buffer, conn->bytes_read, &req, &status_code);
+        }
+        if (phase != XFER_HEAD) {
+            status_code = conn->xfer.code;
+            req.body_done = conn->xfer.body_done;
+        }
+        long request = STATS_RECORD(STAGE_PARSE, stage);
+
+        // The method functions open the URI, respond and log under the URI's lock themselves, so the
+        // audit log follows the order in which operations on each URI took effect.
+        int body_read = conn->bytes_read - conn->head_len;
+        int consumed = -1;
+        if (phase == XFER_SEND) {
+            int logged = status_code;
+            handle_flush(conn, conn->xfer.out, &status_code);
+            if (status_code != logged) {
+                // The request was logged when its response started; a response cut short is
+                // logged again with what ended it.
+                LOG(conn->buffer, &req, &status_code);
+            }
+        } else if (status_code == OK) {
+            Method_Functions[req.method](conn, &req, uri, &status_code);
+            if (req.detached) {
+                // Another thread owns the connection now.
+                STATS_END(request);
+                return;
             }
         } else {
-            pthread_mutex_lock(&lock);
-            handle_response(conn->fd, length, &status_code);
+            LOG(conn->buffer, &req, &status_code);
+            handle_response(conn, &status_code);
         }
-    } else {
-        pthread_mutex_lock(&lock);
-        handle_response(conn->fd, length, &status_code);
-    }
-    if (uri_fd != -1) {
-        close(uri_fd);
-        uri_fd = -1;
-    }
+        if (conn->xfer.phase != XFER_HEAD) {
+            // Waiting on the socket, in the middle of the message or the response.
+            conn->xfer.code = status_code;
+            conn->xfer.body_done = req.body_done;
+            park_connection(conn, EPOLL_CTL_MOD);
+            return;
+        }
+        if ((req.length == 0 && !req.chunked) || req.body_done) {
+            // A message is taken out of the buffer as it is moved, so the next request follows the
+            // head.
+            consumed = 0;
+        } else if (req.head_len > 0 && !req.chunked && conn->xfer.moved == 0
+                   && req.length <= body_read) {
+            // An unread body that was fully buffered can still be skipped over.
+            consumed = req.length;
+        }
+        STATS_END(request);
 
-    close(conn->fd);
-    LOG(conn->buffer, &status_code);
-    pthread_mutex_unlock(&lock);
-    free(conn);
-    return;
+        conn->requests += 1;
+        if (consumed == -1 || req.head_len == 0 || req.close || status_code == BAD_REQ
+            || status_code == REQ_TIMEOUT || status_code == INTER_SERV_ERROR
+            || conn->requests >= max_requests) {
+            close_connection(conn);
+            return;
+        }
+
+        // Keep whatever follows this request, the start of a pipelined one, for the next pass.
+        consumed += conn->head_len;
+        conn->bytes_read -= consumed;
+        memmove(conn->buffer, conn->buffer + consumed, conn->bytes_read);
+        conn->head_len = 0;
+        conn->head_started = 0;
+        find_head(conn, 0);
+    }
 }
 
 /**
@@ -161,12 +825,14 @@ uint16_t strtouint16(char number[]) {
 }
 
 /**
-   Creates a socket for listening for connections.
+   Creates a non-blocking socket for listening for connections.
+   With reuseport several sockets listen on the same port and the kernel spreads new connections
+   across them.
    Closes the program and prints an error message on error.
  */
-int create_listen_socket(uint16_t port) {
+int create_listen_socket(uint16_t port, int backlog, int reuseport) {
     struct sockaddr_in addr;
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (listenfd < 0) {
         err(EXIT_FAILURE, "socket error");
     }
@@ -174,45 +840,193 @@ int create_listen_socket(uint16_t port) {
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htons(INADDR_ANY);
     addr.sin_port = htons(port);
+    // Accepted sockets inherit TCP_NODELAY. Every response is written whole, so Nagle only delays
+    // the responses to pipelined requests until the client's delayed ACK.
+    int one = 1;
+    setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        err(EXIT_FAILURE, "SO_REUSEPORT error");
+    }
     if (bind(listenfd, (struct sockaddr *) &addr, sizeof addr) < 0) {
         err(EXIT_FAILURE, "bind error");
     }
-    if (listen(listenfd, 128) < 0) {
+    if (listen(listenfd, backlog) < 0) {
         err(EXIT_FAILURE, "listen error");
     }
     return listenfd;
 }
 
+/**
+   Splits the CPUs this process may run on between the shards. With at least as many CPUs as
+   shards each shard gets a contiguous block of CPU numbers, otherwise shards share CPUs round
+   robin. A shard left with no usable CPU may run on any of them.
+ */
+static void assign_cpus(int cpus) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int s = 0; s < shard_count; s += 1) {
+        CPU_ZERO(&shards[s].cpus);
+        for (int c = 0; c < cpus && c < CPU_SETSIZE; c += 1) {
+            int owner = (shard_count > cpus) ? (c == s % cpus) : ((long) c * shard_count / cpus == s);
+            if (owner && CPU_ISSET(c, &allowed)) {
+                CPU_SET(c, &shards[s].cpus);
+            }
+        }
+        if (CPU_COUNT(&shards[s].cpus) == 0) {
+            shards[s].cpus = allowed;
+        }
+    }
+}
+
+/**
+   Has the kernel hand each new connection to the listener of the shard that owns the CPU which
+   received it, using the same split as assign_cpus, so a connection stays on one block of CPUs
+   from the network stack to close. The filter applies to the whole SO_REUSEPORT group, whose
+   listeners are numbered in the order they started listening. Without it, or with more shards
+   than CPUs, the kernel picks a listener by hashing the connection's addresses.
+ */
+static void steer_connections(int cpus) {
+    if (shard_count == 1 || shard_count > cpus) {
+        return;
+    }
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MUL | BPF_K, 0, 0, shard_count },
+        { BPF_ALU | BPF_DIV | BPF_K, 0, 0, cpus },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog program = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    if (setsockopt(shards[0].listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+            sizeof(program))
+        < 0) {
+        warn("cannot steer connections by CPU");
+    }
+}
+
+static void start_thread(pthread_t *thread, shard_t *shard, void *(*routine)(void *)) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &shard->cpus);
+    if (pthread_create(thread, &attr, routine, shard) != 0) {
+        errx(EXIT_FAILURE, "thread error");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+   Sets up the reactor and the provided buffers of every shard. The buffers are split between the
+   shards, down to a floor, so adding shards does not multiply the memory they pin.
+   Returns -1 and leaves no ring behind if io_uring is unavailable.
+ */
+static int uring_shards(void) {
+    int buffers = URING_BUFFERS;
+    while (buffers > URING_MIN_BUFFERS && (long) buffers * shard_count > URING_BUFFERS) {
+        buffers /= 2;
+    }
+    int s = 0;
+    for (; s < shard_count; s += 1) {
+        if (uring_init(&shards[s].reactor, URING_ENTRIES) < 0) {
+            break;
+        }
+        if (uring_bufs_init(&shards[s].reactor, &shards[s].recv_bufs, URING_GROUP, buffers,
+                BLOCK_2048)
+            < 0) {
+            uring_destroy(&shards[s].reactor);
+            break;
+        }
+    }
+    if (s == shard_count) {
+        return 0;
+    }
+    while (s > 0) {
+        s -= 1;
+        uring_destroy(&shards[s].reactor);
+    }
+    return -1;
+}
+
 static void sigterm_handler(int sig) {
     if (sig == SIGTERM) {
         for (int i = 0; i < thread_count; i += 1) {
             pthread_cancel(thread_pool[i]);
             pthread_join(thread_pool[i], NULL);
-            pthread_mutex_unlock(&mutex);
         }
-        for (int i = 0; i < socket_count; i += 1) {
-            close(conn_queue[i]->fd);
-            free(conn_queue[i]);
+        for (int s = 0; s < shard_count; s += 1) {
+            shard_t *shard = &shards[s];
+            pthread_cancel(shard->poll_thread);
+            pthread_join(shard->poll_thread, NULL);
+            if (io_backend == BACKEND_URING) {
+                uring_destroy(&shard->reactor);
+            } else {
+                close(shard->epollfd);
+            }
+            close(shard->listenfd);
+            void *conn = NULL;
+            while (queue_try_pop(&shard->queue, &conn)) {
+                close_connection(conn);
+            }
+            while (shard->idle.head || shard->waiting.head) {
+                conn = shard->idle.head ? shard->idle.head : shard->waiting.head;
+                parked_unlink(shard, conn);
+                close_connection(conn);
+            }
+            queue_destroy(&shard->queue);
+            pthread_mutex_destroy(&shard->parked_lock);
         }
-        pthread_mutex_destroy(&mutex);
-        pthread_mutex_destroy(&lock);
-        pthread_cond_destroy(&add_conn);
-        pthread_cond_destroy(&take_conn);
+        free(shards);
         free(thread_pool);
-        warnx("received SIGTERM");
+        audit_close();
+        audit_counters counters;
+        audit_stats(&counters);
+        warnx("received SIGTERM, audit log: %lu written, %lu dropped, %lu backpressure, %lu batches",
+            counters.written, counters.dropped, counters.backpressure, counters.batches);
+        cache_counters cache;
+        cache_stats(&cache);
+        warnx("object cache: %lu hits, %lu misses, %lu evictions, %lu entries, %zu of %zu bytes",
+            cache.hits, cache.misses, cache.evictions, cache.entries, cache.bytes, cache.budget);
+        fdcache_counters fds;
+        fdcache_stats(&fds);
+        warnx("descriptor cache: %lu file hits, %lu file misses, %lu directory hits, %lu directory "
+              "misses, %lu mkdirs, %lu evictions",
+            fds.file_hits, fds.file_misses, fds.dir_hits, fds.dir_misses, fds.mkdirs, fds.evictions);
+        slab_counters slab;
+        slab_stats(&slab);
+        warnx("slab: %lu bytes carved, %lu transfers, %lu heap allocations", slab.carved,
+            slab.transfers, slab.heap_allocations);
+        syncer_counters syncer;
+        syncer_stats(&syncer);
+        warnx("sync thread: %lu requests, %lu syncs, %lu batches", syncer.requests, syncer.syncs,
+            syncer.batches);
+        warnx("admission: %lu shed on arrival, %lu shed late, %lu over the per-address limit, "
+              "%lu head timeouts",
+            atomic_load(&shed_queued), atomic_load(&shed_late), atomic_load(&shed_ip),
+            atomic_load(&head_timeouts));
         fclose(logfile);
         exit(EXIT_SUCCESS);
     }
 }
 
 static void usage(char *exec) {
-    fprintf(stderr, "usage: %s [-t threads] [-l logfile] <port>\n", exec);
+    fprintf(stderr,
+        "usage: %s [-t threads] [-l logfile] [-c cache_mb] [-q queue_size] [-i idle_timeout] "
+        "[-r max_requests] [-f flush_ms] [-s none|batch] [-b epoll|uring] [-n shards] "
+        "[-a backlog] [-d none|request|batch] [-w sync_ms] [-o direct_mb] [-H header_timeout] "
+        "[-B transfer_timeout] [-D shed_depth] [-L shed_ms] [-m max_per_ip] <port>\n",
+        exec);
 }
 
 int main(int argc, char *argv[]) {
     int opt = 0;
     int threads = DEFAULT_THREAD_COUNT;
+    long queue_size = DEFAULT_QUEUE_SIZE;
+    int flush_ms = DEFAULT_FLUSH_MS;
+    int sync = SYNC_NONE;
+    long cache_mb = DEFAULT_CACHE_MB;
+    int backlog = DEFAULT_BACKLOG;
+    int sync_ms = DEFAULT_SYNC_MS;
     logfile = stderr;
+    transfer_timeout = DEFAULT_XFER_TIMEOUT;
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 't':
@@ -221,6 +1035,119 @@ int main(int argc, char *argv[]) {
                 errx(EXIT_FAILURE, "bad number of threads");
             }
             break;
+        case 'c':
+            cache_mb = strtol(optarg, NULL, 10);
+            if (cache_mb < 0) {
+                errx(EXIT_FAILURE, "bad cache size");
+            }
+            break;
+        case 'q':
+            queue_size = strtol(optarg, NULL, 10);
+            if (queue_size <= 0) {
+                errx(EXIT_FAILURE, "bad queue size");
+            }
+            break;
+        case 'i':
+            idle_timeout = strtol(optarg, NULL, 10);
+            if (idle_timeout <= 0) {
+                errx(EXIT_FAILURE, "bad idle timeout");
+            }
+            break;
+        case 'r':
+            max_requests = strtol(optarg, NULL, 10);
+            if (max_requests <= 0) {
+                errx(EXIT_FAILURE, "bad max requests");
+            }
+            break;
+        case 'f':
+            flush_ms = strtol(optarg, NULL, 10);
+            if (flush_ms <= 0) {
+                errx(EXIT_FAILURE, "bad flush interval");
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "none") == 0) {
+                sync = SYNC_NONE;
+            } else if (strcmp(optarg, "batch") == 0) {
+                sync = SYNC_BATCH;
+            } else {
+                errx(EXIT_FAILURE, "bad sync policy");
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "none") == 0) {
+                durability = DURABLE_NONE;
+            } else if (strcmp(optarg, "request") == 0) {
+                durability = DURABLE_REQUEST;
+            } else if (strcmp(optarg, "batch") == 0) {
+                durability = DURABLE_BATCH;
+            } else {
+                errx(EXIT_FAILURE, "bad durability policy");
+            }
+            break;
+        case 'w':
+            sync_ms = strtol(optarg, NULL, 10);
+            if (sync_ms <= 0) {
+                errx(EXIT_FAILURE, "bad sync window");
+            }
+            break;
+        case 'o':
+            direct_threshold = strtol(optarg, NULL, 10) << 20;
+            if (direct_threshold <= 0) {
+                errx(EXIT_FAILURE, "bad O_DIRECT threshold");
+            }
+            break;
+        case 'H':
+            header_timeout = strtol(optarg, NULL, 10);
+            if (header_timeout <= 0) {
+                errx(EXIT_FAILURE, "bad header timeout");
+            }
+            break;
+        case 'B':
+            transfer_timeout = strtol(optarg, NULL, 10);
+            if (transfer_timeout < 0) {
+                errx(EXIT_FAILURE, "bad transfer timeout");
+            }
+            break;
+        case 'D':
+            shed_depth = strtol(optarg, NULL, 10);
+            if (shed_depth < 0) {
+                errx(EXIT_FAILURE, "bad shedding depth");
+            }
+            break;
+        case 'L':
+            shed_latency = strtol(optarg, NULL, 10);
+            if (shed_latency < 0) {
+                errx(EXIT_FAILURE, "bad shedding latency");
+            }
+            break;
+        case 'm':
+            max_per_ip = strtol(optarg, NULL, 10);
+            if (max_per_ip < 0) {
+                errx(EXIT_FAILURE, "bad connections per address");
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "epoll") == 0) {
+                io_backend = BACKEND_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                io_backend = BACKEND_URING;
+            } else {
+                errx(EXIT_FAILURE, "bad backend");
+            }
+            break;
+        case 'n':
+            shard_count = strtol(optarg, NULL, 10);
+            if (shard_count <= 0) {
+                errx(EXIT_FAILURE, "bad number of shards");
+            }
+            break;
+        case 'a':
+            backlog = strtol(optarg, NULL, 10);
+            if (backlog <= 0) {
+                errx(EXIT_FAILURE, "bad backlog");
+            }
+            break;
         case 'l':
             logfile = fopen(optarg, "w");
             if (!logfile) {
@@ -239,33 +1166,77 @@ int main(int argc, char *argv[]) {
     if (port == 0) {
         errx(EXIT_FAILURE, "bad port number: %s", argv[1]);
     }
+    if (threads < shard_count) {
+        errx(EXIT_FAILURE, "fewer threads than shards");
+    }
+    if (transfer_timeout == 0) {
+        // Parked requests are closed by their own deadlines, so without one a stalled transfer can
+        // only be closed by the idle timeout, which cannot answer it.
+        warnx("no transfer timeout, stalled transfers are closed after %d s idle without a 408",
+            idle_timeout);
+    }
     signal(SIGPIPE, SIG_IGN);
     signal(SIGTERM, sigterm_handler);
-    int listenfd = create_listen_socket(port);
+
+    // Each shard listens on its own SO_REUSEPORT socket and keeps its own queue.
+    int cpus = get_nprocs_conf();
+    shards = calloc(shard_count, sizeof(shard_t));
+    queue_t **queues = calloc(shard_count, sizeof(queue_t *));
+    for (int s = 0; s < shard_count; s += 1) {
+        shards[s].listenfd = create_listen_socket(port, backlog, shard_count > 1);
+        shards[s].epollfd = -1;
+        pthread_mutex_init(&shards[s].parked_lock, NULL);
+        if (queue_init(&shards[s].queue, queue_size) < 0) {
+            err(EXIT_FAILURE, "queue error");
+        }
+        queues[s] = &shards[s].queue;
+    }
+    steer_connections(cpus);
+    assign_cpus(cpus);
 
     thread_count = threads;
     thread_pool = calloc(threads, sizeof(pthread_t));
-    pthread_mutex_init(&lock, NULL);
-    pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&add_conn, NULL);
-    pthread_cond_init(&take_conn, NULL);
+    slab_init();
+    uri_lock_init();
+    cache_init((size_t) cache_mb << 20);
+    fdcache_init();
+    handle_ranges_init();
+    if (audit_init(logfile, flush_ms, sync) < 0) {
+        errx(EXIT_FAILURE, "audit log error");
+    }
+    STATS_INIT(queues, shard_count);
+    if (durability == DURABLE_BATCH && syncer_init(sync_ms, threads) < 0) {
+        errx(EXIT_FAILURE, "sync thread error");
+    }
+    if (follow_init(idle_timeout, close_connection) < 0) {
+        warn("follower thread unavailable, followed GETs get snapshots");
+    }
+    if (io_backend == BACKEND_URING && uring_shards() < 0) {
+        warn("io_uring unavailable, using epoll");
+        io_backend = BACKEND_EPOLL;
+    }
+    for (int s = 0; s < shard_count; s += 1) {
+        shard_t *shard = &shards[s];
+        if (io_backend == BACKEND_URING) {
+            start_thread(&shard->poll_thread, shard, &thread_uring);
+            continue;
+        }
+        shard->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        if (shard->epollfd < 0
+            || epoll_ctl(shard->epollfd, EPOLL_CTL_ADD, shard->listenfd, &event) < 0) {
+            err(EXIT_FAILURE, "epoll error");
+        }
+        start_thread(&shard->poll_thread, shard, &thread_poll);
+    }
+    // Workers are dealt out to the shards in turn.
     for (int i = 0; i < threads; i += 1) {
-        pthread_create(&thread_pool[i], NULL, &thread_dispatch, NULL);
+        start_thread(&thread_pool[i], &shards[i % shard_count], &thread_dispatch);
     }
 
+    // The pollers accept connections themselves.
     for (;;) {
-        int connfd = accept(listenfd, NULL, NULL);
-        if (connfd < 0) {
-            warn("accept error");
-            continue;
-        } else {
-            conn_struct *conn = malloc(sizeof(conn_struct));
-            fcntl(connfd, F_SETFL, O_NONBLOCK);
-            conn->fd = connfd;
-            memset(conn->buffer, 0, BLOCK_2048);
-            conn->bytes_read = 0;
-            submit_connection(conn);
-        }
+        pause();
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,352 @@
+#include "utils.h"
+#include "parser.h"
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+
+// Character classes from the request grammar, looked up once per byte.
+enum CHAR_CLASS { C_ALPHA = 1, C_DIGIT = 2, C_URI = 4, C_KEY = 8 };
+
+static const unsigned char CLASSES[256] = {
+    ['-'] = C_KEY,
+    ['.'] = C_URI | C_KEY,
+    ['/'] = C_URI,
+    ['_'] = C_URI | C_KEY,
+#define DIGIT(c) [c] = C_DIGIT | C_URI | C_KEY
+    DIGIT('0'), DIGIT('1'), DIGIT('2'), DIGIT('3'), DIGIT('4'), DIGIT('5'), DIGIT('6'), DIGIT('7'),
+    DIGIT('8'), DIGIT('9'),
+#undef DIGIT
+#define ALPHA(c) [c] = C_ALPHA | C_URI | C_KEY, [c - 'a' + 'A'] = C_ALPHA | C_URI | C_KEY
+    ALPHA('a'), ALPHA('b'), ALPHA('c'), ALPHA('d'), ALPHA('e'), ALPHA('f'), ALPHA('g'), ALPHA('h'),
+    ALPHA('i'), ALPHA('j'), ALPHA('k'), ALPHA('l'), ALPHA('m'), ALPHA('n'), ALPHA('o'), ALPHA('p'),
+    ALPHA('q'), ALPHA('r'), ALPHA('s'), ALPHA('t'), ALPHA('u'), ALPHA('v'), ALPHA('w'), ALPHA('x'),
+    ALPHA('y'), ALPHA('z'),
+#undef ALPHA
+};
+
+#define IS(c, class) (CLASSES[(unsigned char) (c)] & (class))
+
+void request_init(request_t *req) {
+    memset(req, 0, sizeof(request_t));
+    req->method = -1;
+}
+
+static int match_method(const char *method, int len) {
+    if (len == 3 && strncasecmp(method, "PUT", 3) == 0) {
+        return PUT;
+    } else if (len == 3 && strncasecmp(method, "GET", 3) == 0) {
+        return GET;
+    } else if (len == 6 && strncasecmp(method, "APPEND", 6) == 0) {
+        return APPEND;
+    } else if (len == 4 && strncasecmp(method, "MGET", 4) == 0) {
+        return MGET;
+    }
+    return -1;
+}
+
+int parse_request_line(const char *buffer, int size, request_t *req) {
+    int i = 0;
+    while (i < size && IS(buffer[i], C_ALPHA)) {
+        i += 1;
+    }
+    req->method_len = i;
+    int method = match_method(buffer, i);
+    if (i == 0 || i >= size || buffer[i] != ' ') {
+        return BAD_REQ;
+    }
+    while (i < size && buffer[i] == ' ') {
+        i += 1;
+    }
+
+    req->uri_off = i;
+    if (i >= size || buffer[i] != '/') {
+        return BAD_REQ;
+    }
+    while (i < size && IS(buffer[i], C_URI)) {
+        i += 1;
+    }
+    req->uri_len = i - req->uri_off;
+    // The URI of an MGET is the directory its list is under, which may be the root.
+    if (i >= size || buffer[i] != ' '
+        || (buffer[i - 1] == '/' && (method != MGET || req->uri_len != 1))) {
+        return BAD_REQ;
+    }
+    while (i < size && buffer[i] == ' ') {
+        i += 1;
+    }
+
+    if (size - i < 10 || memcmp(buffer + i, "HTTP/1.1\r\n", 10) != 0) {
+        return BAD_REQ;
+    }
+    req->hf_off = i + 10;
+
+    req->method = method;
+    return (req->method == -1) ? NOT_IMPL : OK;
+}
+
+int parse_uri(const char *uri, int len) {
+    if (len < 2 || uri[0] != '/' || uri[len - 1] == '/') {
+        return BAD_REQ;
+    }
+    for (int i = 1; i < len; i += 1) {
+        if (!IS(uri[i], C_URI)) {
+            return BAD_REQ;
+        }
+    }
+    return OK;
+}
+
+// Parses a non-negative decimal of at most max that spans the whole value.
+static int parse_number(const char *value, int len, long max, long *number) {
+    long n = 0;
+    if (len == 0) {
+        return -1;
+    }
+    for (int i = 0; i < len; i += 1) {
+        if (!IS(value[i], C_DIGIT) || n > (max - (value[i] - '0')) / 10) {
+            return -1;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+    *number = n;
+    return 0;
+}
+
+int parse_header_fields(const char *buffer, int size, request_t *req) {
+    const char *end = buffer + size;
+    const char *cursor = buffer + req->hf_off;
+    int has_length = 0;
+    for (;;) {
+        // memchr is vectorized by libc, so line ends are found a word or more at a time.
+        const char *cr = memchr(cursor, '\r', end - cursor);
+        if (cr == NULL || cr + 1 >= end || cr[1] != '\n') {
+            return BAD_REQ;
+        }
+        if (cr == cursor) {
+            // A message framed both ways is how requests get smuggled past proxies.
+            if (req->chunked && has_length) {
+                return BAD_REQ;
+            }
+            req->head_len = (cr + 2) - buffer;
+            return OK;
+        }
+
+        const char *key = cursor;
+        while (cursor < cr && IS(*cursor, C_KEY)) {
+            cursor += 1;
+        }
+        int key_len = cursor - key;
+        if (key_len == 0 || cr - cursor < 3 || cursor[0] != ':' || cursor[1] != ' ') {
+            return BAD_REQ;
+        }
+        const char *value = cursor + 2;
+        int value_len = cr - value;
+        if (memchr(value, '\n', value_len) != NULL) {
+            return BAD_REQ;
+        }
+
+        if (key_len == 14 && strncasecmp(key, "Content-Length", 14) == 0) {
+            // Sizes are 64-bit throughout, so only a length that overflows an off_t is refused.
+            if (parse_number(value, value_len, LONG_MAX, &req->length) < 0) {
+                return BAD_REQ;
+            }
+            has_length = 1;
+        } else if (key_len == 17 && strncasecmp(key, "Transfer-Encoding", 17) == 0) {
+            if (value_len != 7 || strncasecmp(value, "chunked", 7) != 0) {
+                return NOT_IMPL;
+            }
+            req->chunked = 1;
+        } else if (key_len == 6 && strncasecmp(key, "Follow", 6) == 0) {
+            req->follow = (value_len == 4 && strncasecmp(value, "true", 4) == 0);
+        } else if (key_len == 10 && strncasecmp(key, "Request-Id", 10) == 0) {
+            int negative = (value_len > 0 && value[0] == '-');
+            long id;
+            if (parse_number(value + negative, value_len - negative, INT_MAX, &id) == 0) {
+                req->request_id = negative ? -id : id;
+            }
+        } else if (key_len == 10 && strncasecmp(key, "Connection", 10) == 0) {
+            req->close = (value_len == 5 && strncasecmp(value, "close", 5) == 0);
+        } else if (key_len == 5 && strncasecmp(key, "Range", 5) == 0) {
+            req->range_off = value - buffer;
+            req->range_len = value_len;
+        } else if (key_len == 8 && strncasecmp(key, "If-Match", 8) == 0) {
+            req->if_match_off = value - buffer;
+            req->if_match_len = value_len;
+        } else if (key_len == 13 && strncasecmp(key, "If-None-Match", 13) == 0) {
+            req->if_none_match_off = value - buffer;
+            req->if_none_match_len = value_len;
+        } else if (key_len == 17 && strncasecmp(key, "If-Modified-Since", 17) == 0) {
+            req->if_modified_since_off = value - buffer;
+            req->if_modified_since_len = value_len;
+        }
+        cursor = cr + 2;
+    }
+}
+
+// Parses the digits at the cursor, if any, and moves past them.
+static int parse_offset(const char **cursor, const char *end, long *number) {
+    const char *start = *cursor;
+    long n = 0;
+    while (*cursor < end && IS(**cursor, C_DIGIT)) {
+        if (n > (LONG_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (**cursor - '0');
+        *cursor += 1;
+    }
+    *number = n;
+    return (*cursor > start) ? 0 : -1;
+}
+
+int parse_range(const char *value, int len, long size, byte_range *ranges, int max) {
+    const char *end = value + len;
+    const char *cursor = value + 6;
+    int specs = 0;
+    int count = 0;
+    if (len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    for (;;) {
+        long first = -1;
+        long last = -1;
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+            cursor += 1;
+        }
+        if (cursor < end && *cursor != '-' && parse_offset(&cursor, end, &first) < 0) {
+            return -1;
+        }
+        if (cursor >= end || *cursor != '-') {
+            return -1;
+        }
+        cursor += 1;
+        if (cursor < end && IS(*cursor, C_DIGIT) && parse_offset(&cursor, end, &last) < 0) {
+            return -1;
+        }
+        if ((first == -1 && last == -1) || (last != -1 && first > last)) {
+            return -1;
+        }
+        specs += 1;
+        if (specs > max) {
+            return -1;
+        }
+
+        if (first == -1) {
+            // A suffix: the last bytes of the representation.
+            if (last > 0 && size > 0) {
+                ranges[count].start = (last < size) ? size - last : 0;
+                ranges[count].end = size - 1;
+                count += 1;
+            }
+        } else if (first < size) {
+            ranges[count].start = first;
+            ranges[count].end = (last == -1 || last >= size) ? size - 1 : last;
+            count += 1;
+        }
+
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+            cursor += 1;
+        }
+        if (cursor == end) {
+            return count;
+        }
+        if (*cursor != ',') {
+            return -1;
+        }
+        cursor += 1;
+    }
+}
+
+long parse_chunk_size(const char *line, int len) {
+    long size = 0;
+    int i = 0;
+    while (i < len && i < CHUNK_SIZE_DIGITS && isxdigit((unsigned char) line[i])) {
+        char c = line[i] | 0x20;
+        size = size * 16 + ((c <= '9') ? c - '0' : c - 'a' + 10);
+        i += 1;
+    }
+    if (i == 0) {
+        return -1;
+    }
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+        i += 1;
+    }
+    // Chunk extensions carry nothing this server understands.
+    return (i == len || line[i] == ';') ? size : -1;
+}
+
+int parse_etag_match(const char *value, int len, const char *etag, int etag_len, int weak) {
+    const char *cursor = value;
+    const char *end = value + len;
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+        cursor += 1;
+    }
+    if (end - cursor == 1 && *cursor == '*') {
+        return 1;
+    }
+    while (cursor < end) {
+        int is_weak = (end - cursor > 2 && cursor[0] == 'W' && cursor[1] == '/');
+        cursor += is_weak ? 2 : 0;
+        if (cursor >= end || *cursor != '"') {
+            return 0;
+        }
+        const char *close = memchr(cursor + 1, '"', end - cursor - 1);
+        if (close == NULL) {
+            return 0;
+        }
+        int tag_len = close + 1 - cursor;
+        if ((weak || !is_weak) && tag_len == etag_len && memcmp(cursor, etag, etag_len) == 0) {
+            return 1;
+        }
+        cursor = close + 1;
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == ',')) {
+            cursor += 1;
+        }
+    }
+    return 0;
+}
+
+// Parses exactly count digits.
+static int parse_digits(const char *value, int count) {
+    int n = 0;
+    for (int i = 0; i < count; i += 1) {
+        if (!IS(value[i], C_DIGIT)) {
+            return -1;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+    return n;
+}
+
+long parse_http_date(const char *value, int len) {
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    if (len != 29 || value[3] != ',' || value[4] != ' ' || value[7] != ' ' || value[11] != ' '
+        || value[16] != ' ' || value[19] != ':' || value[22] != ':'
+        || memcmp(value + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+    int month = 0;
+    while (month < 12 && memcmp(MONTHS + 3 * month, value + 8, 3) != 0) {
+        month += 1;
+    }
+    int day = parse_digits(value + 5, 2);
+    int year = parse_digits(value + 12, 4);
+    int hour = parse_digits(value + 17, 2);
+    int minute = parse_digits(value + 20, 2);
+    int second = parse_digits(value + 23, 2);
+    if (month == 12 || day < 1 || day > 31 || year < 1970 || hour < 0 || hour > 23 || minute < 0
+        || minute > 59 || second < 0 || second > 60) {
+        return -1;
+    }
+
+    // Days since the epoch of a proleptic Gregorian date, counting years from March so that the
+    // leap day comes last.
+    month += 1;
+    year -= (month <= 2);
+    long era = year / 400;
+    long year_of_era = year - era * 400;
+    long day_of_year = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+    long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long days = era * 146097 + day_of_era - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+// Most hex digits accepted in a chunk size, which keeps it well inside a long
+#define CHUNK_SIZE_DIGITS 15
+
+// Offsets and values parsed out of a request head. Every offset is relative to the start of the
+// buffer the head was parsed from, nothing is copied and nothing is allocated. body_done is set
+// by whoever reads the whole message and detached by whoever takes the connection over.
+typedef struct request_t {
+    int method;
+    int method_len;
+    int uri_off;
+    int uri_len;
+    int hf_off;
+    int head_len;
+    long length;
+    int request_id;
+    int close;
+    int body_done;
+    int range_off;
+    int range_len;
+    int chunked;
+    int follow;
+    int detached;
+    int if_match_off;
+    int if_match_len;
+    int if_none_match_off;
+    int if_none_match_len;
+    int if_modified_since_off;
+    int if_modified_since_len;
+} request_t;
+
+// Inclusive byte offsets of one satisfiable range
+typedef struct byte_range {
+    long start;
+    long end;
+} byte_range;
+
+// @brief Resets a request so it can be parsed into.
+// @param req The request to reset.
+void request_init(request_t *req);
+
+// @brief Parses the request-line at the start of the buffer in a single pass.
+// Grammar: Method SP+ URI SP+ HTTP/1.1 CRLF, where a method is letters only and a URI is a / followed
+// by letters, digits, _ . and /, not ending with a /. The URI of an MGET may also be / alone.
+// @param buffer Buffer containing the request head.
+// @param size Number of valid bytes in the buffer.
+// @param req Filled with the method, URI offsets and the offset of the first header-field.
+// @return OK, BAD_REQ on malformed input, or NOT_IMPL for a well-formed but unsupported method.
+int parse_request_line(const char *buffer, int size, request_t *req);
+
+// @brief Checks that a URI listed in the message of an MGET follows the grammar of the request-line.
+// @param uri The URI, not terminated.
+// @param len Length of the URI.
+// @return OK, or BAD_REQ if it is malformed.
+int parse_uri(const char *uri, int len);
+
+// @brief Parses the header-fields following the request-line up to the empty line.
+// Grammar: (Key: Value CRLF)* CRLF, where a key is letters, digits, _ . and - and a value is
+// non-empty. Picks up Content-Length, Transfer-Encoding: chunked, Follow: true, Request-Id,
+// Connection: close and where the values of Range and the conditional headers are.
+// @param buffer Buffer containing the request head.
+// @param size Number of valid bytes in the buffer.
+// @param req Request whose hf_off was set by parse_request_line. Gains length, request_id, head_len.
+// @return OK, BAD_REQ, or NOT_IMPL for a transfer coding other than chunked.
+int parse_header_fields(const char *buffer, int size, request_t *req);
+
+// @brief Parses the value of a Range header against the size of the representation.
+// Grammar: bytes= spec (, spec)*, where a spec is first-last, first- or -suffix. Ranges that start
+// past the end are skipped and the others are clipped to it.
+// @param value The header value.
+// @param len Length of the value.
+// @param size Size of the representation.
+// @param ranges Filled with the satisfiable ranges in request order.
+// @param max Most ranges accepted.
+// @return Number of satisfiable ranges, 0 if there are none, or -1 if the value is malformed or
+// lists more than max ranges, in which case the header is to be ignored.
+int parse_range(const char *value, int len, long size, byte_range *ranges, int max);
+
+// @brief Parses the size line that starts a chunk of a chunked message.
+// Grammar: HEXDIG+ [BWS ; extension], with the CRLF already stripped. Extensions are ignored.
+// @param line The line, without its CRLF.
+// @param len Length of the line.
+// @return The chunk size, or -1 if the line is malformed or the size has too many digits.
+long parse_chunk_size(const char *line, int len);
+
+// @brief Looks for an entity-tag in the value of an If-Match or If-None-Match header.
+// Grammar: * or a comma separated list of entity-tags, each a quoted string with an optional W/.
+// @param value The header value.
+// @param len Length of the value.
+// @param etag The quoted entity-tag of the current version.
+// @param etag_len Length of etag.
+// @param weak Non-zero for the weak comparison of If-None-Match, zero for the strong comparison of
+// If-Match, under which a weak tag never matches.
+// @return 1 if the value is * or lists a matching tag, 0 otherwise, including when it is malformed.
+int parse_etag_match(const char *value, int len, const char *etag, int etag_len, int weak);
+
+// @brief Parses an HTTP-date in the IMF-fixdate format, such as Sun, 06 Nov 1994 08:49:37 GMT.
+// The obsolete formats are not accepted.
+// @param value The header value.
+// @param len Length of the value.
+// @return Seconds since the epoch, or -1 if the value is not such a date and is to be ignored.
+long parse_http_date(const char *value, int len);
@@ -0,0 +1,181 @@
+#include "queue.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// A raw futex is not a cancellation point, so the wait is made asynchronously cancellable the same
+// way libc does it for its own blocking calls. Nothing but the syscall runs in that window.
+static void futex_wait(_Atomic uint32_t *addr, uint32_t expected) {
+    int type = 0;
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &type);
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+    pthread_setcanceltype(type, NULL);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Event words count the parked threads in the low half and the wakes owed to them in the high half,
+// and never owe more wakes than there are threads. A waiter counts itself in, retries its operation,
+// then sleeps until it can take a wake. A signaller owes one more wake only while a parked thread is
+// not owed one yet, and wakes a single thread for it. Since the word holds the wakes, a waiter never
+// sleeps past one owed after it looked, so every wake owed is taken by a thread that retries. The
+// fences make each side's operation visible before it looks at the word, so a signaller that finds
+// nobody to wake ran before the waiter's retry, which therefore succeeds. A wakeup is never lost and
+// an idle signaller costs a fence and a load. Nothing wakes every waiter: at shutdown the parked
+// threads are cancelled in futex_wait.
+#define EVENT_WAITER 1u
+#define EVENT_WOKEN  (1u << 16)
+
+static void event_enter(_Atomic uint32_t *event) {
+    atomic_fetch_add(event, EVENT_WAITER);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Leaves after a retry that succeeded, taking a wake if one is owed so the word never owes more
+// wakes than there are threads.
+static void event_leave(_Atomic uint32_t *event) {
+    uint32_t value = atomic_load(event);
+    while (!atomic_compare_exchange_weak(
+        event, &value, value - EVENT_WAITER - ((value >= EVENT_WOKEN) ? EVENT_WOKEN : 0))) {
+    }
+}
+
+static void event_wait(_Atomic uint32_t *event) {
+    uint32_t value = atomic_load(event);
+    for (;;) {
+        if (value < EVENT_WOKEN) {
+            futex_wait(event, value);
+            value = atomic_load(event);
+        } else if (atomic_compare_exchange_weak(event, &value, value - EVENT_WAITER - EVENT_WOKEN)) {
+            atomic_thread_fence(memory_order_seq_cst);
+            return;
+        }
+    }
+}
+
+static void event_signal(_Atomic uint32_t *event) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t value = atomic_load_explicit(event, memory_order_relaxed);
+    while ((value >> 16) < (value & (EVENT_WOKEN - 1))) {
+        if (atomic_compare_exchange_weak(event, &value, value + EVENT_WOKEN)) {
+            futex_wake(event, 1);
+            return;
+        }
+    }
+}
+
+int queue_init(queue_t *q, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    q->slots = calloc(size, sizeof(queue_slot));
+    if (q->slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i += 1) {
+        atomic_init(&q->slots[i].sequence, i);
+    }
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->not_empty, 0);
+    atomic_init(&q->not_full, 0);
+    return 0;
+}
+
+void queue_destroy(queue_t *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+bool queue_try_push(queue_t *q, void *item) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    queue_slot *slot;
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    slot->item = item;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+bool queue_try_pop(queue_t *q, void **item) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    queue_slot *slot;
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    *item = slot->item;
+    atomic_store_explicit(&slot->sequence, pos + q->mask + 1, memory_order_release);
+    return true;
+}
+
+void queue_push(queue_t *q, void *item) {
+    while (!queue_try_push(q, item)) {
+        event_enter(&q->not_full);
+        if (queue_try_push(q, item)) {
+            event_leave(&q->not_full);
+            break;
+        }
+        event_wait(&q->not_full);
+    }
+    event_signal(&q->not_empty);
+}
+
+bool queue_offer(queue_t *q, void *item) {
+    if (!queue_try_push(q, item)) {
+        return false;
+    }
+    event_signal(&q->not_empty);
+    return true;
+}
+
+void *queue_pop(queue_t *q) {
+    void *item = NULL;
+    while (!queue_try_pop(q, &item)) {
+        event_enter(&q->not_empty);
+        if (queue_try_pop(q, &item)) {
+            event_leave(&q->not_empty);
+            break;
+        }
+        event_wait(&q->not_empty);
+    }
+    event_signal(&q->not_full);
+    return item;
+}
+
+size_t queue_size(queue_t *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return (head > tail) ? head - tail : 0;
+}
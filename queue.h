@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#pragma once
+
+// Size of a cache line, used to keep the producer and consumer cursors apart
+#define CACHE_LINE 64
+
+typedef struct queue_slot {
+    _Atomic size_t sequence;
+    void *item;
+} queue_slot;
+
+// Bounded multi-producer multi-consumer ring buffer. Each slot carries a sequence number that tells
+// producers and consumers whose turn it is, so neither side ever takes a lock. Idle consumers and
+// blocked producers park on an event word (the threads parked and the wakes owed to them) and the
+// other side only makes a wake syscall, for a single thread, when a parked thread is owed one. Fewer
+// than 65536 threads may park on one queue.
+typedef struct queue_t {
+    queue_slot *slots;
+    size_t mask;
+    _Alignas(CACHE_LINE) _Atomic size_t head;
+    _Alignas(CACHE_LINE) _Atomic size_t tail;
+    _Alignas(CACHE_LINE) _Atomic uint32_t not_empty;
+    _Alignas(CACHE_LINE) _Atomic uint32_t not_full;
+} queue_t;
+
+// @brief Initializes a queue. The capacity is rounded up to the next power of two.
+// @param q The queue to initialize.
+// @param capacity The minimum number of items the queue can hold.
+// @return 0 on success, -1 if the slots could not be allocated.
+int queue_init(queue_t *q, size_t capacity);
+
+// @brief Frees the slots of a queue. Items still in the queue are not touched.
+// @param q The queue to destroy.
+void queue_destroy(queue_t *q);
+
+// @brief Attempts to add an item without blocking.
+// @param q The queue to add to.
+// @param item The item to add.
+// @return false if the queue is full.
+bool queue_try_push(queue_t *q, void *item);
+
+// @brief Attempts to remove the oldest item without blocking.
+// @param q The queue to remove from.
+// @param item Set to the removed item on success.
+// @return false if the queue is empty.
+bool queue_try_pop(queue_t *q, void **item);
+
+// @brief Adds an item, parking the caller while the queue is full.
+// @param q The queue to add to.
+// @param item The item to add.
+void queue_push(queue_t *q, void *item);
+
+// @brief Adds an item without blocking and wakes a consumer parked in queue_pop.
+// @param q The queue to add to.
+// @param item The item to add.
+// @return false if the queue is full.
+bool queue_offer(queue_t *q, void *item);
+
+// @brief Removes the oldest item, parking the caller while the queue is empty.
+// @param q The queue to remove from.
+// @return The removed item.
+void *queue_pop(queue_t *q);
+
+// @brief Approximate number of items in the queue.
+// @param q The queue to measure.
+size_t queue_size(queue_t *q);
@@ -0,0 +1,157 @@
+#include "slab.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// A free object holds the link to the next one in its first bytes.
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object;
+
+typedef struct slab_list {
+    slab_object *head;
+    unsigned count;
+} slab_list;
+
+typedef struct slab_shared {
+    pthread_mutex_t mutex;
+    slab_list list;
+} slab_shared;
+
+static size_t sizes[SLAB_CLASSES];
+static unsigned limits[SLAB_CLASSES];
+static slab_shared shared[SLAB_CLASSES];
+static _Thread_local slab_list lists[SLAB_CLASSES];
+
+static _Atomic unsigned long carved = 0;
+static _Atomic unsigned long transfers = 0;
+static _Atomic unsigned long heap_allocations = 0;
+
+#ifdef COUNT_ALLOCS
+// Linked with --wrap, so only calls from the server's own objects land here.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&heap_allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&heap_allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&heap_allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+#endif
+
+static int class_of(size_t size) {
+    if (size <= SLAB_MIN) {
+        return 0;
+    }
+    size_t value = size - 1;
+    int msb = 63 - __builtin_clzll(value);
+    return 4 * (msb - SLAB_MIN_SHIFT) + ((value >> (msb - 2)) & 3) + 1;
+}
+
+void slab_init(void) {
+    for (int i = 0; i < SLAB_CLASSES; i += 1) {
+        int shift = (i - 1) / 4 + SLAB_MIN_SHIFT;
+        sizes[i] = (i == 0) ? SLAB_MIN : (size_t) (5 + (i - 1) % 4) << (shift - 2);
+        limits[i] = SLAB_THREAD_BYTES / sizes[i];
+        limits[i] = (limits[i] > SLAB_MIN_CACHED) ? limits[i] : SLAB_MIN_CACHED;
+        pthread_mutex_init(&shared[i].mutex, NULL);
+        shared[i].list.head = NULL;
+        shared[i].list.count = 0;
+    }
+}
+
+static void move(slab_list *from, slab_list *to, unsigned count) {
+    while (count > 0 && from->head) {
+        slab_object *object = from->head;
+        from->head = object->next;
+        from->count -= 1;
+        object->next = to->head;
+        to->head = object;
+        to->count += 1;
+        count -= 1;
+    }
+}
+
+// Fills an empty thread list with half its limit, from the shared list when it has any and
+// otherwise from one new chunk.
+static void refill(int index) {
+    slab_list *list = &lists[index];
+    unsigned batch = (limits[index] + 1) / 2;
+    pthread_mutex_lock(&shared[index].mutex);
+    move(&shared[index].list, list, batch);
+    pthread_mutex_unlock(&shared[index].mutex);
+    atomic_fetch_add_explicit(&transfers, 1, memory_order_relaxed);
+    if (list->count > 0) {
+        return;
+    }
+    char *chunk = malloc(sizes[index] * batch);
+    if (chunk == NULL) {
+        return;
+    }
+    for (unsigned i = 0; i < batch; i += 1) {
+        slab_object *object = (slab_object *) (chunk + i * sizes[index]);
+        object->next = list->head;
+        list->head = object;
+    }
+    list->count = batch;
+    atomic_fetch_add_explicit(&carved, sizes[index] * batch, memory_order_relaxed);
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX) {
+        return malloc(size);
+    }
+    int index = class_of(size);
+    slab_list *list = &lists[index];
+    if (list->head == NULL) {
+        refill(index);
+        if (list->head == NULL) {
+            return NULL;
+        }
+    }
+    slab_object *object = list->head;
+    list->head = object->next;
+    list->count -= 1;
+    return object;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX) {
+        free(ptr);
+        return;
+    }
+    int index = class_of(size);
+    slab_list *list = &lists[index];
+    slab_object *object = ptr;
+    object->next = list->head;
+    list->head = object;
+    list->count += 1;
+    // A thread that frees more than it allocates, such as a worker closing connections the poller
+    // accepted, passes the surplus back.
+    if (list->count > limits[index]) {
+        pthread_mutex_lock(&shared[index].mutex);
+        move(list, &shared[index].list, list->count / 2);
+        pthread_mutex_unlock(&shared[index].mutex);
+        atomic_fetch_add_explicit(&transfers, 1, memory_order_relaxed);
+    }
+}
+
+void slab_stats(slab_counters *counters) {
+    counters->carved = atomic_load(&carved);
+    counters->transfers = atomic_load(&transfers);
+    counters->heap_allocations = atomic_load(&heap_allocations);
+}
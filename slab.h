@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+#pragma once
+
+// Size classes run from SLAB_MIN to SLAB_MAX bytes, four to each power of two, so a request is
+// rounded up by at most a quarter. Larger requests go straight to malloc.
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SHIFT 18
+#define SLAB_MIN       (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX       (1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASSES   (4 * (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT) + 1)
+// Bytes of each class a thread keeps before handing half of them to the shared list
+#define SLAB_THREAD_BYTES (256 << 10)
+// Objects of each class a thread may always keep, however large
+#define SLAB_MIN_CACHED 2
+
+typedef struct slab_counters {
+    unsigned long carved;
+    unsigned long transfers;
+    unsigned long heap_allocations;
+} slab_counters;
+
+// @brief Initializes the size classes and their shared free lists.
+void slab_init(void);
+
+// @brief Takes an object from the calling thread's free list for its size class, refilling the
+// list from the shared one, or from a new chunk, only when it is empty. The object is not zeroed.
+// @param size Bytes needed.
+// @return The object, or NULL if memory is exhausted.
+void *slab_alloc(size_t size);
+
+// @brief Puts an object back on the calling thread's free list. It may be freed by a different
+// thread than the one that allocated it.
+// @param ptr The object, or NULL.
+// @param size The size it was allocated with.
+void slab_free(void *ptr, size_t size);
+
+// @brief Reads the allocator's counters. Heap allocations are only counted when the server is built
+// with COUNT_ALLOCS (make allocs), which wraps malloc, calloc and realloc.
+// @param counters Filled with the bytes carved into objects, the batches moved to and from the
+// shared lists, and the heap allocations made by the server's own code.
+void slab_stats(slab_counters *counters);
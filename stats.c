@@ -0,0 +1,219 @@
+#include "stats.h"
+#include "slab.h"
+#include "cache.h"
+#include "auditlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SUB_BUCKETS (1 << STATS_SUB_BITS)
+
+typedef struct stats_thread {
+    stats_histogram stages[STAGE_COUNT];
+    _Atomic uint64_t requests;
+    struct stats_thread *next;
+} stats_thread;
+
+static const char *STAGE_NAMES[] = { [STAGE_QUEUE] = "queue",
+    [STAGE_HEAD] = "head",
+    [STAGE_PARSE] = "parse",
+    [STAGE_LOCK] = "lock",
+    [STAGE_BODY] = "body",
+    [STAGE_SEND] = "send",
+    [STAGE_REQUEST] = "request" };
+
+static const double PERCENTILES[] = { 50, 90, 99, 99.9 };
+#define PERCENTILE_COUNT 4
+
+// Threads register their histograms once, on their first record, and never leave.
+static _Atomic(stats_thread *) threads = NULL;
+static _Thread_local stats_thread *local = NULL;
+static _Thread_local int sampled = 1;
+static _Atomic long connections = 0;
+static queue_t **conn_queues = NULL;
+static int queue_count = 0;
+
+void stats_init(queue_t **queues, int count) {
+    conn_queues = queues;
+    queue_count = count;
+}
+
+static stats_thread *stats_local(void) {
+    if (local == NULL) {
+        local = calloc(1, sizeof(stats_thread));
+        local->next = atomic_load(&threads);
+        while (!atomic_compare_exchange_weak(&threads, &local->next, local)) {
+        }
+    }
+    return local;
+}
+
+void stats_begin(void) {
+    static _Thread_local unsigned passes = 0;
+    sampled = (passes % STATS_SAMPLE_RATE) == 0;
+    passes += 1;
+}
+
+// Never 0, which stands for a stage that is not timed.
+static long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec + 1;
+}
+
+long stats_now(void) {
+    return sampled ? clock_ns() : 0;
+}
+
+long stats_stamp(void) {
+    static _Thread_local unsigned stamps = 0;
+    stamps += 1;
+    return (stamps % STATS_SAMPLE_RATE == 1) ? clock_ns() : 0;
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int index = ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+                + ((value >> (msb - STATS_SUB_BITS)) & (SUB_BUCKETS - 1));
+    return (index < STATS_BUCKETS) ? index : STATS_BUCKETS - 1;
+}
+
+// Middle of the values that fall in a bucket.
+static uint64_t value_of(int index) {
+    int octave = index >> STATS_SUB_BITS;
+    uint64_t sub = index & (SUB_BUCKETS - 1);
+    if (octave == 0) {
+        return sub;
+    }
+    uint64_t low = (SUB_BUCKETS + sub) << (octave - 1);
+    return low + ((uint64_t) 1 << (octave - 1)) / 2;
+}
+
+static void bump(_Atomic uint64_t *counter, uint64_t by) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+long stats_record(int stage, long start) {
+    if (start == 0 || (start == -1 && !sampled)) {
+        return 0;
+    }
+    long now = (start == -1) ? -1 : clock_ns();
+    uint64_t value = (now > start) ? now - start : 0;
+    stats_local();
+    stats_histogram *histogram = &local->stages[stage];
+    bump(&histogram->buckets[bucket_of(value)], 1);
+    bump(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+    return now;
+}
+
+void stats_end(long start) {
+    stats_thread *thread = stats_local();
+    uint64_t requests = atomic_load_explicit(&thread->requests, memory_order_relaxed);
+    atomic_store_explicit(&thread->requests, requests + 1, memory_order_relaxed);
+    stats_record(STAGE_REQUEST, start);
+}
+
+void stats_connection(int delta) {
+    atomic_fetch_add_explicit(&connections, delta, memory_order_relaxed);
+}
+
+int stats_render(char *buffer, int size, int json) {
+    int len = 0;
+    long depth = 0;
+    for (int i = 0; i < queue_count; i += 1) {
+        depth += queue_size(conn_queues[i]);
+    }
+    uint64_t requests = 0;
+    for (stats_thread *thread = atomic_load(&threads); thread; thread = thread->next) {
+        requests += atomic_load_explicit(&thread->requests, memory_order_relaxed);
+    }
+    long active = atomic_load(&connections);
+    cache_counters cache;
+    cache_stats(&cache);
+    audit_counters audit;
+    audit_stats(&audit);
+
+    // Every append checks for room first, since a truncated one leaves len past size.
+    if (json && len < size) {
+        len += snprintf(buffer + len, size - len, "{");
+    }
+#ifdef COUNT_ALLOCS
+    // Test builds report the heap allocations made by the server's own code.
+    slab_counters slab;
+    slab_stats(&slab);
+    if (len < size) {
+        len += snprintf(buffer + len, size - len,
+            json ? "\"heap_allocations\":%lu," : "heap_allocations %lu\n", slab.heap_allocations);
+    }
+#endif
+    if (json && len < size) {
+        len += snprintf(buffer + len, size - len,
+            "\"connections_active\":%ld,\"queue_depth\":%ld,\"requests\":%lu,"
+            "\"cache\":{\"hits\":%lu,\"misses\":%lu,\"evictions\":%lu},"
+            "\"audit\":{\"dropped\":%lu,\"backpressure\":%lu},\"sample_rate\":%d,\"stages\":{",
+            active, depth, (unsigned long) requests, cache.hits, cache.misses, cache.evictions,
+            audit.dropped, audit.backpressure, STATS_SAMPLE_RATE);
+    } else if (!json && len < size) {
+        len += snprintf(buffer + len, size - len,
+            "connections_active %ld\nqueue_depth %ld\nrequests %lu\ncache_hits %lu\n"
+            "cache_misses %lu\ncache_evictions %lu\naudit_dropped %lu\naudit_backpressure %lu\n"
+            "sample_rate 1/%d\n%-8s %10s %10s %10s %10s %10s %10s %10s\n",
+            active, depth, (unsigned long) requests, cache.hits, cache.misses, cache.evictions,
+            audit.dropped, audit.backpressure, STATS_SAMPLE_RATE, "stage", "samples", "mean_us",
+            "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+    }
+    for (int stage = 0; stage < STAGE_COUNT && len < size; stage += 1) {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        uint64_t buckets[STATS_BUCKETS] = { 0 };
+        for (stats_thread *thread = atomic_load(&threads); thread; thread = thread->next) {
+            stats_histogram *histogram = &thread->stages[stage];
+            for (int i = 0; i < STATS_BUCKETS; i += 1) {
+                uint64_t n = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+                buckets[i] += n;
+                count += n;
+            }
+            sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+            uint64_t thread_max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+            max = (thread_max > max) ? thread_max : max;
+        }
+
+        double values[PERCENTILE_COUNT] = { 0 };
+        for (int p = 0; p < PERCENTILE_COUNT && count > 0; p += 1) {
+            uint64_t rank = (uint64_t) (PERCENTILES[p] / 100 * count + 0.5);
+            uint64_t seen = 0;
+            int i = 0;
+            while (i < STATS_BUCKETS - 1 && seen + buckets[i] < (rank ? rank : 1)) {
+                seen += buckets[i];
+                i += 1;
+            }
+            // A bucket midpoint can overshoot the largest value actually seen.
+            uint64_t value = value_of(i);
+            values[p] = ((value < max) ? value : max) / 1000.0;
+        }
+        double mean = count ? (double) sum / count / 1000.0 : 0;
+        if (json) {
+            len += snprintf(buffer + len, size - len,
+                "%s\"%s\":{\"samples\":%lu,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,"
+                "\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}",
+                stage ? "," : "", STAGE_NAMES[stage], (unsigned long) count, mean, values[0],
+                values[1], values[2], values[3], max / 1000.0);
+        } else {
+            len += snprintf(buffer + len, size - len,
+                "%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", STAGE_NAMES[stage],
+                (unsigned long) count, mean, values[0], values[1], values[2], values[3], max / 1000.0);
+        }
+    }
+    if (json && len < size) {
+        len += snprintf(buffer + len, size - len, "}}\n");
+    }
+    return (len < size) ? len : size - 1;
+}
@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include "queue.h"
+
+#pragma once
+
+// Each power of two is split into 2^STATS_SUB_BITS buckets, so a recorded value is off by at most
+// 1/16 of itself. Values are nanoseconds and anything past 2^(STATS_OCTAVES + 3) ns (about 2.3 h)
+// lands in the last bucket.
+#define STATS_SUB_BITS 4
+#define STATS_OCTAVES  40
+#define STATS_BUCKETS  ((STATS_OCTAVES + 1) << STATS_SUB_BITS)
+
+// Every request is counted but only one in STATS_SAMPLE_RATE per thread is timed, which keeps the
+// clock reads off most requests. Each stage of a timed request is recorded.
+#define STATS_SAMPLE_RATE 32
+
+// Reserved URIs that serve the statistics as text and as JSON
+#define STATS_URI      "/_stats"
+#define STATS_URI_JSON "/_stats.json"
+
+enum STAGES {
+    STAGE_QUEUE,
+    STAGE_HEAD,
+    STAGE_PARSE,
+    STAGE_LOCK,
+    STAGE_BODY,
+    STAGE_SEND,
+    STAGE_REQUEST,
+    STAGE_COUNT
+};
+
+// Log-linear latency histogram in the style of HdrHistogram. Only its own thread writes to it,
+// so updates are plain relaxed loads and stores; readers merge them without stopping anyone.
+typedef struct stats_histogram {
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[STATS_BUCKETS];
+} stats_histogram;
+
+// Building with -DNO_STATS removes every timestamp and record from the request path.
+#ifdef NO_STATS
+static inline long stats_skip(long start) {
+    (void) start;
+    return 0;
+}
+#define STATS_BEGIN()
+#define STATS_NOW()                0L
+#define STATS_STAMP()              0L
+#define STATS_RECORD(stage, start) stats_skip(start)
+#define STATS_END(start)           stats_skip(start)
+#define STATS_CONNECTION(delta)
+#define STATS_INIT(queues, count)
+#else
+#define STATS_BEGIN()              stats_begin()
+#define STATS_NOW()                stats_now()
+#define STATS_STAMP()              stats_stamp()
+#define STATS_RECORD(stage, start) stats_record(stage, start)
+#define STATS_END(start)           stats_end(start)
+#define STATS_CONNECTION(delta)    stats_connection(delta)
+#define STATS_INIT(queues, count)  stats_init(queues, count)
+#endif
+
+// @brief Sets the queues whose combined depth is reported.
+// @param queues The connection queue of every shard.
+// @param count Number of queues.
+void stats_init(queue_t **queues, int count);
+
+// @brief Decides whether the request the calling thread is about to read is timed.
+void stats_begin(void);
+
+// @brief Reads the monotonic clock if the calling thread is timing its current request.
+// @return Nanoseconds since an arbitrary point, or 0 when the request is not timed.
+long stats_now(void);
+
+// @brief Reads the monotonic clock on one call in STATS_SAMPLE_RATE, for stages such as queueing
+// that start on one thread and end on another.
+// @return Nanoseconds since an arbitrary point, or 0 when this call is not timed.
+long stats_stamp(void);
+
+// @brief Records the time since start in the calling thread's histogram for a stage.
+// @param stage The stage that ran.
+// @param start Value of stats_now when the stage began, 0 if it was not timed, or -1 to record a
+// stage that took no time.
+// @return The current time, so the next stage can start from it, or 0 if nothing was recorded.
+long stats_record(int stage, long start);
+
+// @brief Counts a served request and records its total time.
+// @param start Value of stats_now when the request began.
+void stats_end(long start);
+
+// @brief Counts connections opening and closing.
+// @param delta 1 when a connection is accepted, -1 when it is closed.
+void stats_connection(int delta);
+
+// @brief Merges every thread's histograms and writes them out.
+// @param buffer Buffer to write to.
+// @param size Size of the buffer.
+// @param json Non-zero for JSON, zero for text.
+// @return Number of bytes written.
+int stats_render(char *buffer, int size, int json);
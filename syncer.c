@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include "syncer.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// A request to sync one file, waiting on the stack of the thread that made it.
+typedef struct sync_ticket {
+    int fd;
+    int done;
+    int result;
+    dev_t dev;
+    ino_t ino;
+    struct sync_ticket *owner;
+    struct sync_ticket *next;
+} sync_ticket;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requested = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER;
+static sync_ticket *pending = NULL;
+static int pending_count = 0;
+static int window = 0;
+static int full = 0;
+static pthread_t thread;
+
+static _Atomic unsigned long requests = 0;
+static _Atomic unsigned long syncs = 0;
+static _Atomic unsigned long batches = 0;
+
+/**
+   Syncs a batch. Tickets for a file already in this batch share its sync, since fdatasync on any
+   descriptor of an inode covers the writes made through all of them. Writeback of every file is
+   started before the first fdatasync waits, so the device works on all of them at once.
+ */
+static void sync_batch(sync_ticket *batch) {
+    sync_ticket *distinct[SYNCER_BATCH];
+    int count = 0;
+    for (sync_ticket *ticket = batch; ticket; ticket = ticket->next) {
+        struct stat fd_stat;
+        ticket->owner = ticket;
+        if (fstat(ticket->fd, &fd_stat) == -1) {
+            continue;
+        }
+        ticket->dev = fd_stat.st_dev;
+        ticket->ino = fd_stat.st_ino;
+        int i = 0;
+        while (i < count && (distinct[i]->dev != ticket->dev || distinct[i]->ino != ticket->ino)) {
+            i += 1;
+        }
+        if (i < count) {
+            ticket->owner = distinct[i];
+        } else if (count < SYNCER_BATCH) {
+            distinct[count] = ticket;
+            count += 1;
+        }
+        if (ticket->owner == ticket) {
+            sync_file_range(ticket->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+    for (sync_ticket *ticket = batch; ticket; ticket = ticket->next) {
+        if (ticket->owner == ticket) {
+            ticket->result = fdatasync(ticket->fd);
+            atomic_fetch_add_explicit(&syncs, 1, memory_order_relaxed);
+        }
+    }
+    for (sync_ticket *ticket = batch; ticket; ticket = ticket->next) {
+        ticket->result = ticket->owner->result;
+    }
+}
+
+static void *syncer_thread(void *args) {
+    (void) args;
+    struct timespec last = { 0 };
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+        while (pending == NULL) {
+            pthread_cond_wait(&requested, &mutex);
+        }
+        // Batches start at most one window apart, and a full batch cannot grow so it goes at once.
+        struct timespec deadline = last;
+        deadline.tv_nsec += (window % 1000) * 1000000L;
+        deadline.tv_sec += window / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (pending_count < full
+               && pthread_cond_timedwait(&requested, &mutex, &deadline) != ETIMEDOUT) {
+        }
+        clock_gettime(CLOCK_REALTIME, &last);
+        sync_ticket *batch = pending;
+        pending = NULL;
+        pending_count = 0;
+        pthread_mutex_unlock(&mutex);
+
+        sync_batch(batch);
+        atomic_fetch_add_explicit(&batches, 1, memory_order_relaxed);
+
+        pthread_mutex_lock(&mutex);
+        for (sync_ticket *ticket = batch; ticket; ticket = ticket->next) {
+            ticket->done = 1;
+        }
+        pthread_cond_broadcast(&synced);
+    }
+    return NULL;
+}
+
+int syncer_init(int window_ms, int waiters) {
+    window = window_ms;
+    full = waiters;
+    return (pthread_create(&thread, NULL, syncer_thread, NULL) == 0) ? 0 : -1;
+}
+
+int syncer_wait(int fd) {
+    sync_ticket ticket = { .fd = fd };
+    atomic_fetch_add_explicit(&requests, 1, memory_order_relaxed);
+    pthread_mutex_lock(&mutex);
+    ticket.next = pending;
+    pending = &ticket;
+    pending_count += 1;
+    pthread_cond_signal(&requested);
+    while (!ticket.done) {
+        pthread_cond_wait(&synced, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    return ticket.result;
+}
+
+void syncer_stats(syncer_counters *counters) {
+    counters->requests = atomic_load(&requests);
+    counters->syncs = atomic_load(&syncs);
+    counters->batches = atomic_load(&batches);
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+
+#pragma once
+
+// Most distinct files a batch remembers so later requests can share their sync; files past that
+// are synced on their own
+#define SYNCER_BATCH 256
+
+typedef struct syncer_counters {
+    unsigned long requests;
+    unsigned long syncs;
+    unsigned long batches;
+} syncer_counters;
+
+// @brief Starts the sync thread, which syncs the data of every file handed to syncer_wait in
+// batches, one fdatasync per distinct file per batch.
+// @param window_ms Shortest time between the starts of two batches, in milliseconds. A request that
+// arrives after a quiet window is synced at once; the rest gather until the window is over.
+// @param waiters Most threads that can wait at once. A batch holding that many requests cannot grow
+// any more, so it is synced without waiting out the window.
+// @return 0 on success, -1 if the thread could not be started.
+int syncer_init(int window_ms, int waiters);
+
+// @brief Blocks until a batch that started after this call has synced the file's data. Requests
+// for the same file in one batch share its fdatasync.
+// @param fd Descriptor of the file, kept open until this returns.
+// @return 0 once the data is durable, -1 if fdatasync failed.
+int syncer_wait(int fd);
+
+// @brief Reads the sync counters.
+// @param counters Filled with the current counts.
+void syncer_stats(syncer_counters *counters);
@@ -0,0 +1,760 @@
+// Parser conformance harness.
+// Checks the hand-written parser on fixed edge cases and on seeded random inputs. The request-line
+// and header-field checks are differential: the expected result comes from the regexes the parser
+// replaced, anchored to the start of the line and to its CRLF, which the unanchored originals only
+// approximated. Where the grammar was changed on purpose, the difference is named and counted
+// instead of failed:
+//   - a URI of slashes only names a directory and is refused, except / as the base of an MGET;
+//   - empty path segments, as in /a//b, are accepted, since URIs are normalized before use;
+//   - a method must match in full, where strncasecmp took GETX for GET, and MGET is new.
+// Range, chunk size and HTTP-date values had no regex before; they are checked against small
+// reference implementations written for clarity rather than speed. Exits 1 if any check failed.
+//
+// usage: test/parser_test [-n cases] [-s seed]
+#define _GNU_SOURCE
+#include <err.h>
+#include <getopt.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "utils.h"
+#include "parser.h"
+
+#define OPTIONS       "n:s:"
+#define DEFAULT_CASES 100000
+#define DEFAULT_SEED  1
+#define MAX_REPORTS   20
+#define CASE_SIZE     512
+#define MAX_RANGES    8
+
+// The request-line and header-field regexes of the original parser, anchored.
+#define OLD_LINE_REGEX "^([a-zA-Z]+) +(/+(/?[a-zA-Z0-9_.])*) +HTTP/1\\.1\r\n"
+#define OLD_HF_REGEX   "^[a-zA-Z0-9_.-]+: [^\r\n]+$"
+// The request-line grammar of parser.h before its trailing slash rule, which is checked apart.
+#define LINE_REGEX     "^([a-zA-Z]+) +(/[a-zA-Z0-9_./]*) +HTTP/1\\.1\r\n"
+#define CHUNK_REGEX    "^([0-9a-fA-F]{1,15})[ \t]*(;.*)?$"
+#define SPEC_REGEX     "^([0-9]*)-([0-9]*)$"
+#define DATE_REGEX                                                                                 \
+    "^.{3}, ([0-9]{2}) (Jan|Feb|Mar|Apr|May|Jun|Jul|Aug|Sep|Oct|Nov|Dec) ([0-9]{4}) "              \
+    "([0-9]{2}):([0-9]{2}):([0-9]{2}) GMT$"
+
+static regex_t old_line, old_hf, line_regex, chunk_regex, spec_regex, date_regex;
+static unsigned long state = DEFAULT_SEED;
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                                           \
+    do {                                                                                           \
+        checks += 1;                                                                               \
+        if (!(cond)) {                                                                             \
+            failures += 1;                                                                         \
+            if (failures <= MAX_REPORTS) {                                                         \
+                fprintf(stderr, __VA_ARGS__);                                                      \
+                fputc('\n', stderr);                                                               \
+            }                                                                                      \
+        }                                                                                          \
+    } while (0)
+
+// xorshift64*, so a seed always produces the same cases.
+static unsigned long next_random(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717UL;
+}
+
+static int pick(int n) {
+    return next_random() % n;
+}
+
+// Escapes a case for a report. Returns a static buffer, so one per message.
+static const char *show(const char *s, int len) {
+    static char out[4 * CASE_SIZE + 1];
+    int n = 0;
+    for (int i = 0; i < len; i += 1) {
+        unsigned char c = s[i];
+        if (c == '\r') {
+            n += sprintf(out + n, "\\r");
+        } else if (c == '\n') {
+            n += sprintf(out + n, "\\n");
+        } else if (c == '\t') {
+            n += sprintf(out + n, "\\t");
+        } else if (c < 0x20 || c > 0x7e) {
+            n += sprintf(out + n, "\\x%02x", c);
+        } else {
+            out[n] = c;
+            n += 1;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static void compile(regex_t *regex, const char *pattern) {
+    int error = regcomp(regex, pattern, REG_EXTENDED);
+    if (error != 0) {
+        char message[BLOCK_256];
+        regerror(error, regex, message, sizeof(message));
+        errx(EXIT_FAILURE, "bad regex %s: %s", pattern, message);
+    }
+}
+
+// Appends a random element of a pool.
+#define APPEND_ONE(buffer, len, pool)                                                              \
+    (len += snprintf(buffer + len, CASE_SIZE - len, "%s", pool[pick(sizeof(pool) / sizeof(*pool))]))
+
+/* ----------------------------------------------------------------------------------------------
+   Request-line
+   ---------------------------------------------------------------------------------------------- */
+
+static int method_exact(const char *method, int len) {
+    static const struct {
+        const char *name;
+        int method;
+    } KNOWN[] = { { "PUT", PUT }, { "GET", GET }, { "APPEND", APPEND }, { "MGET", MGET } };
+    for (size_t i = 0; i < sizeof(KNOWN) / sizeof(*KNOWN); i += 1) {
+        if ((int) strlen(KNOWN[i].name) == len && strncasecmp(method, KNOWN[i].name, len) == 0) {
+            return KNOWN[i].method;
+        }
+    }
+    return -1;
+}
+
+// What the original parser made of the method: a prefix match in the order it tried them.
+static int method_prefix(const char *method) {
+    if (strncasecmp(method, "PUT", 3) == 0) {
+        return PUT;
+    } else if (strncasecmp(method, "GET", 3) == 0) {
+        return GET;
+    } else if (strncasecmp(method, "APPEND", 6) == 0) {
+        return APPEND;
+    }
+    return -1;
+}
+
+// Differences from the original grammar, counted as the random cases run into them.
+static struct {
+    long slash_only;
+    long empty_segment;
+    long method;
+} deviations;
+
+// The expected result of a request-line, with the matches of LINE_REGEX in m.
+static int expected_line(const char *line, regmatch_t *m) {
+    int old = (regexec(&old_line, line, 0, NULL, 0) == 0);
+    if (regexec(&line_regex, line, 3, m, 0) != 0) {
+        if (old) {
+            errx(EXIT_FAILURE, "the original grammar accepts what the new one cannot: %s",
+                show(line, strlen(line)));
+        }
+        return BAD_REQ;
+    }
+    const char *method = line + m[1].rm_so;
+    const char *uri = line + m[2].rm_so;
+    int uri_len = m[2].rm_eo - m[2].rm_so;
+    int expected = method_exact(method, m[1].rm_eo - m[1].rm_so);
+    if (uri[uri_len - 1] == '/' && (expected != MGET || uri_len != 1)) {
+        deviations.slash_only += old;
+        return BAD_REQ;
+    }
+    deviations.empty_segment += !old;
+    deviations.method += old && expected != method_prefix(method);
+    return (expected == -1) ? NOT_IMPL : OK;
+}
+
+static void check_line(const char *line, int len) {
+    request_t req;
+    regmatch_t m[3];
+    request_init(&req);
+    int expected = expected_line(line, m);
+    int code = parse_request_line(line, len, &req);
+    CHECK(code == expected, "request-line %s: got %d, expected %d", show(line, len), code,
+        expected);
+    if (code != expected || expected == BAD_REQ) {
+        return;
+    }
+    CHECK(req.method_len == m[1].rm_eo && req.uri_off == m[2].rm_so
+              && req.uri_len == m[2].rm_eo - m[2].rm_so && req.hf_off == m[0].rm_eo,
+        "request-line %s: offsets %d %d %d %d", show(line, len), req.method_len, req.uri_off,
+        req.uri_len, req.hf_off);
+    // Any prefix that stops short of the CRLF is incomplete, never accepted.
+    int cut = pick(m[0].rm_eo);
+    request_init(&req);
+    code = parse_request_line(line, cut, &req);
+    CHECK(code == BAD_REQ, "request-line %s cut at %d: got %d", show(line, len), cut, code);
+}
+
+static void request_line_cases(void) {
+    static const struct {
+        const char *line;
+        int code;
+    } CASES[] = {
+        { "GET /a.txt HTTP/1.1\r\n", OK },
+        { "get /a HTTP/1.1\r\n", OK },
+        { "APPEND /x HTTP/1.1\r\n", OK },
+        { "GET  /a   HTTP/1.1\r\n", OK },
+        { "GET /a//b HTTP/1.1\r\n", OK },
+        { "MGET / HTTP/1.1\r\n", OK },
+        { "MGET /d/ HTTP/1.1\r\n", BAD_REQ },
+        { "GET / HTTP/1.1\r\n", BAD_REQ },
+        { "GET /a/ HTTP/1.1\r\n", BAD_REQ },
+        { "GET a HTTP/1.1\r\n", BAD_REQ },
+        { "GET /a-b HTTP/1.1\r\n", BAD_REQ },
+        { "GET /a%20b HTTP/1.1\r\n", BAD_REQ },
+        { "GET /a HTTP/1.0\r\n", BAD_REQ },
+        { "GET /a http/1.1\r\n", BAD_REQ },
+        { "GET /a HTTP/1.1\n", BAD_REQ },
+        { "GET /a HTTP/1.1 \r\n", BAD_REQ },
+        { " GET /a HTTP/1.1\r\n", BAD_REQ },
+        { "GET\t/a HTTP/1.1\r\n", BAD_REQ },
+        { "GET/a HTTP/1.1\r\n", BAD_REQ },
+        { "G3T /a HTTP/1.1\r\n", BAD_REQ },
+        { "", BAD_REQ },
+        { "DELETE /a HTTP/1.1\r\n", NOT_IMPL },
+        { "GETX /a HTTP/1.1\r\n", NOT_IMPL },
+        { "DELETE /a/ HTTP/1.1\r\n", BAD_REQ },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        request_t req;
+        request_init(&req);
+        int len = strlen(CASES[i].line);
+        int code = parse_request_line(CASES[i].line, len, &req);
+        CHECK(code == CASES[i].code, "request-line %s: got %d, expected %d",
+            show(CASES[i].line, len), code, CASES[i].code);
+        check_line(CASES[i].line, len);
+    }
+}
+
+static void request_line_random(int cases) {
+    static const char *METHODS[] = { "GET", "PUT", "APPEND", "MGET", "get", "Put", "GETX", "PU",
+        "G3T", "", "DELETE", "appended" };
+    static const char *SPACES[] = { " ", " ", "  ", "", "\t" };
+    static const char *PIECES[] = { "/", "/", "a", "b.txt", "_", "//", "9", "-", "%", ".", "/x" };
+    static const char *VERSIONS[] = { "HTTP/1.1", "HTTP/1.1", "HTTP/1.0", "http/1.1", "HTTP/1.11",
+        "HTTP/1.", "" };
+    static const char *ENDINGS[] = { "\r\n", "\r\n", "\n", "\r", "\r\r\n", "", " \r\n" };
+    static const char NOISE[] = " /aZ9_.-\r\nHT1%:\t";
+    for (int n = 0; n < cases; n += 1) {
+        char line[CASE_SIZE];
+        int len = 0;
+        APPEND_ONE(line, len, METHODS);
+        APPEND_ONE(line, len, SPACES);
+        if (pick(8) != 0) {
+            len += snprintf(line + len, CASE_SIZE - len, "/");
+        }
+        for (int pieces = pick(5); pieces > 0; pieces -= 1) {
+            APPEND_ONE(line, len, PIECES);
+        }
+        APPEND_ONE(line, len, SPACES);
+        APPEND_ONE(line, len, VERSIONS);
+        APPEND_ONE(line, len, ENDINGS);
+        if (pick(4) == 0 && len > 0) {
+            line[pick(len)] = NOISE[pick(sizeof(NOISE) - 1)];
+        }
+        if (pick(2) == 0) {
+            len += snprintf(line + len, CASE_SIZE - len, "Host: x\r\n\r\n");
+        }
+        check_line(line, len);
+    }
+}
+
+/* ----------------------------------------------------------------------------------------------
+   Header-fields
+   ---------------------------------------------------------------------------------------------- */
+
+#define REQUEST_LINE "GET /a HTTP/1.1\r\n"
+
+// The expected result of the header-fields after REQUEST_LINE, with the head length in head_len.
+// Each line up to the empty one is matched on its own, as the original parser did.
+static int expected_fields(const char *head, int *head_len) {
+    const char *cursor = head + strlen(REQUEST_LINE);
+    for (;;) {
+        const char *crlf = strstr(cursor, "\r\n");
+        if (crlf == NULL) {
+            return BAD_REQ;
+        }
+        if (crlf == cursor) {
+            *head_len = crlf + 2 - head;
+            return OK;
+        }
+        char line[CASE_SIZE];
+        memcpy(line, cursor, crlf - cursor);
+        line[crlf - cursor] = '\0';
+        if (regexec(&old_hf, line, 0, NULL, 0) != 0) {
+            return BAD_REQ;
+        }
+        cursor = crlf + 2;
+    }
+}
+
+static int parse_head(const char *head, int len, request_t *req) {
+    request_init(req);
+    int code = parse_request_line(head, len, req);
+    return (code == OK) ? parse_header_fields(head, len, req) : code;
+}
+
+static void header_fields_random(int cases) {
+    // None of these keys means anything to the parser, so only the syntax decides.
+    static const char *KEYS[] = { "Host", "X-Trace", "a.b_c-d", "K9", "", "Bad Key", "Key:", "\xc3",
+        "User-Agent" };
+    static const char *SEPARATORS[] = { ": ", ": ", ": ", ":", ":  ", " : ", ": \t", "=" };
+    static const char *VALUES[] = { "x", "hello world", "a:b", "", "\t", "v\rw", "v\nw", "1",
+        "\xff" };
+    static const char *ENDINGS[] = { "\r\n", "\r\n", "\r\n", "\n", "\r", "" };
+    for (int n = 0; n < cases; n += 1) {
+        char head[CASE_SIZE];
+        int len = snprintf(head, CASE_SIZE, REQUEST_LINE);
+        for (int lines = pick(5); lines > 0; lines -= 1) {
+            APPEND_ONE(head, len, KEYS);
+            APPEND_ONE(head, len, SEPARATORS);
+            APPEND_ONE(head, len, VALUES);
+            APPEND_ONE(head, len, ENDINGS);
+        }
+        if (pick(10) != 0) {
+            len += snprintf(head + len, CASE_SIZE - len, "\r\n");
+        }
+        request_t req;
+        int head_len = 0;
+        int expected = expected_fields(head, &head_len);
+        int code = parse_head(head, len, &req);
+        CHECK(code == expected && (code != OK || req.head_len == head_len),
+            "header-fields %s: got %d with head %d, expected %d with head %d", show(head, len),
+            code, req.head_len, expected, head_len);
+    }
+}
+
+static void header_fields_cases(void) {
+    static const struct {
+        const char *fields;
+        int code;
+        long length;
+        int request_id;
+        int chunked;
+        int close;
+        int follow;
+    } CASES[] = {
+        { "\r\n", OK, 0, 0, 0, 0, 0 },
+        { "Content-Length: 12\r\n\r\n", OK, 12, 0, 0, 0, 0 },
+        { "content-length: 0\r\n\r\n", OK, 0, 0, 0, 0, 0 },
+        { "Content-Length: 9223372036854775807\r\n\r\n", OK, LONG_MAX, 0, 0, 0, 0 },
+        { "Content-Length: 9223372036854775808\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        // The original sscanf read these as 12 and -1; a length must now be digits only.
+        { "Content-Length: 12abc\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Content-Length: -1\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Content-Length: \t\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Transfer-Encoding: chunked\r\n\r\n", OK, 0, 0, 1, 0, 0 },
+        { "Transfer-Encoding: gzip\r\n\r\n", NOT_IMPL, 0, 0, 0, 0, 0 },
+        { "Transfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Request-Id: 42\r\n\r\n", OK, 0, 42, 0, 0, 0 },
+        { "Request-Id: -7\r\n\r\n", OK, 0, -7, 0, 0, 0 },
+        { "Request-Id: 2147483648\r\n\r\n", OK, 0, 0, 0, 0, 0 },
+        { "Request-Id: x\r\n\r\n", OK, 0, 0, 0, 0, 0 },
+        { "Connection: close\r\n\r\n", OK, 0, 0, 0, 1, 0 },
+        { "Connection: keep-alive\r\n\r\n", OK, 0, 0, 0, 0, 0 },
+        { "Follow: TRUE\r\n\r\n", OK, 0, 0, 0, 0, 1 },
+        { "Host: x\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Host: x\r\n\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Host:x\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { ": x\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Host: a\rb\r\n\r\n", BAD_REQ, 0, 0, 0, 0, 0 },
+        { "Host:  \r\n\r\n", OK, 0, 0, 0, 0, 0 },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        char head[CASE_SIZE];
+        int len = snprintf(head, CASE_SIZE, REQUEST_LINE "%s", CASES[i].fields);
+        request_t req;
+        int code = parse_head(head, len, &req);
+        CHECK(code == CASES[i].code, "header-fields %s: got %d, expected %d", show(head, len), code,
+            CASES[i].code);
+        if (code == OK && CASES[i].code == OK) {
+            CHECK(req.length == CASES[i].length && req.request_id == CASES[i].request_id
+                      && req.chunked == CASES[i].chunked && req.close == CASES[i].close
+                      && req.follow == CASES[i].follow && req.head_len == len,
+                "header-fields %s: length %ld, id %d, chunked %d, close %d, follow %d, head %d",
+                show(head, len), req.length, req.request_id, req.chunked, req.close, req.follow,
+                req.head_len);
+        }
+    }
+
+    // Where the values of the headers that are only looked at later were found.
+    const char *head = REQUEST_LINE "Range: bytes=0-1\r\nIf-Match: \"a\"\r\nIf-None-Match: *\r\n"
+                                    "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n";
+    request_t req;
+    int code = parse_head(head, strlen(head), &req);
+    CHECK(code == OK && req.range_len == 9 && memcmp(head + req.range_off, "bytes=0-1", 9) == 0
+              && req.if_match_len == 3 && memcmp(head + req.if_match_off, "\"a\"", 3) == 0
+              && req.if_none_match_len == 1 && head[req.if_none_match_off] == '*'
+              && req.if_modified_since_len == 29,
+        "header-fields: value offsets of Range and the conditional headers");
+}
+
+/* ----------------------------------------------------------------------------------------------
+   URIs listed by MGET
+   ---------------------------------------------------------------------------------------------- */
+
+static void uri_cases(void) {
+    static const struct {
+        const char *uri;
+        int code;
+    } CASES[] = {
+        { "/a", OK },
+        { "/a/b.txt", OK },
+        { "/a//b", OK },
+        { "/", BAD_REQ },
+        { "/a/", BAD_REQ },
+        { "a", BAD_REQ },
+        { "", BAD_REQ },
+        { "/a b", BAD_REQ },
+        { "/a\r", BAD_REQ },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        int len = strlen(CASES[i].uri);
+        int code = parse_uri(CASES[i].uri, len);
+        CHECK(code == CASES[i].code, "uri %s: got %d, expected %d", show(CASES[i].uri, len), code,
+            CASES[i].code);
+    }
+}
+
+/* ----------------------------------------------------------------------------------------------
+   Range
+   ---------------------------------------------------------------------------------------------- */
+
+// Splits the value at every comma and matches each trimmed spec whole.
+static int reference_range(const char *value, long size, byte_range *ranges, int max) {
+    if (strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    int specs = 0;
+    int count = 0;
+    const char *cursor = value + 6;
+    for (;;) {
+        const char *comma = strchr(cursor, ',');
+        const char *end = comma ? comma : cursor + strlen(cursor);
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+            cursor += 1;
+        }
+        while (end > cursor && (end[-1] == ' ' || end[-1] == '\t')) {
+            end -= 1;
+        }
+        char spec[CASE_SIZE];
+        regmatch_t m[3];
+        memcpy(spec, cursor, end - cursor);
+        spec[end - cursor] = '\0';
+        if (regexec(&spec_regex, spec, 3, m, 0) != 0) {
+            return -1;
+        }
+        long first = (m[1].rm_eo > m[1].rm_so) ? strtol(spec + m[1].rm_so, NULL, 10) : -1;
+        long last = (m[2].rm_eo > m[2].rm_so) ? strtol(spec + m[2].rm_so, NULL, 10) : -1;
+        if ((first == -1 && last == -1) || (last != -1 && first > last)) {
+            return -1;
+        }
+        specs += 1;
+        if (specs > max) {
+            return -1;
+        }
+        if (first == -1 && last > 0 && size > 0) {
+            ranges[count] = (byte_range) { (last < size) ? size - last : 0, size - 1 };
+            count += 1;
+        } else if (first != -1 && first < size) {
+            ranges[count] = (byte_range) { first, (last == -1 || last >= size) ? size - 1 : last };
+            count += 1;
+        }
+        if (comma == NULL) {
+            return count;
+        }
+        cursor = comma + 1;
+    }
+}
+
+static void check_range(const char *value, long size, int max) {
+    byte_range got[MAX_RANGES];
+    byte_range expected[MAX_RANGES];
+    int len = strlen(value);
+    int count = parse_range(value, len, size, got, max);
+    int expected_count = reference_range(value, size, expected, max);
+    int same = (count == expected_count);
+    for (int i = 0; same && i < count; i += 1) {
+        same = got[i].start == expected[i].start && got[i].end == expected[i].end;
+    }
+    CHECK(same, "range %s of %ld, at most %d: got %d, expected %d", show(value, len), size, max,
+        count, expected_count);
+}
+
+static void range_cases(void) {
+    static const struct {
+        const char *value;
+        long size;
+        int count;
+        long start;
+        long end;
+    } CASES[] = {
+        { "bytes=0-9", 100, 1, 0, 9 },
+        { "BYTES=0-9", 100, 1, 0, 9 },
+        { "bytes=90-", 100, 1, 90, 99 },
+        { "bytes=90-200", 100, 1, 90, 99 },
+        { "bytes=-10", 100, 1, 90, 99 },
+        { "bytes=-200", 100, 1, 0, 99 },
+        { "bytes= 0-0 ,\t5-5", 100, 2, 0, 0 },
+        { "bytes=100-", 100, 0, 0, 0 },
+        { "bytes=-0", 100, 0, 0, 0 },
+        { "bytes=0-0", 0, 0, 0, 0 },
+        { "bytes=99999999999999999-", 100, 0, 0, 0 },
+        { "bytes=99999999999999999999-", 100, -1, 0, 0 },
+        { "bytes=5-4", 100, -1, 0, 0 },
+        { "bytes=-", 100, -1, 0, 0 },
+        { "bytes=", 100, -1, 0, 0 },
+        { "bytes=0-1,", 100, -1, 0, 0 },
+        { "bytes=0-1,,2-3", 100, -1, 0, 0 },
+        { "bytes=0 -1", 100, -1, 0, 0 },
+        { "bytes=1-2-3", 100, -1, 0, 0 },
+        { "items=0-1", 100, -1, 0, 0 },
+        { "bytes=0-1,2-3,4-5,6-7,8-9", 100, -1, 0, 0 },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        byte_range ranges[MAX_RANGES];
+        int len = strlen(CASES[i].value);
+        int count = parse_range(CASES[i].value, len, CASES[i].size, ranges, 4);
+        int first_ok
+            = count <= 0 || (ranges[0].start == CASES[i].start && ranges[0].end == CASES[i].end);
+        CHECK(count == CASES[i].count && first_ok,
+            "range %s of %ld: got %d, expected %d", show(CASES[i].value, len), CASES[i].size, count,
+            CASES[i].count);
+    }
+}
+
+static void range_random(int cases) {
+    static const char *UNITS[] = { "bytes=", "bytes=", "bytes=", "Bytes=", "byte=", "" };
+    static const char *SEPARATORS[] = { ",", ",", ", ", " ,", ",,", ",\t", ";" };
+    for (int n = 0; n < cases; n += 1) {
+        char value[CASE_SIZE];
+        int len = 0;
+        APPEND_ONE(value, len, UNITS);
+        for (int specs = 1 + pick(5); specs > 0; specs -= 1) {
+            int first = pick(60);
+            int last = pick(60);
+            switch (pick(8)) {
+            case 0: len += snprintf(value + len, CASE_SIZE - len, "%d-", first); break;
+            case 1: len += snprintf(value + len, CASE_SIZE - len, "-%d", last); break;
+            case 2: len += snprintf(value + len, CASE_SIZE - len, "%d", first); break;
+            case 3: len += snprintf(value + len, CASE_SIZE - len, "-"); break;
+            case 4: len += snprintf(value + len, CASE_SIZE - len, " %d-%d\t", first, last); break;
+            case 5: len += snprintf(value + len, CASE_SIZE - len, "%d--%d", first, last); break;
+            default: len += snprintf(value + len, CASE_SIZE - len, "%d-%d", first, last); break;
+            }
+            if (specs > 1 || pick(10) == 0) {
+                APPEND_ONE(value, len, SEPARATORS);
+            }
+        }
+        check_range(value, pick(50), 1 + pick(MAX_RANGES));
+    }
+}
+
+/* ----------------------------------------------------------------------------------------------
+   Chunk size
+   ---------------------------------------------------------------------------------------------- */
+
+static long reference_chunk_size(const char *line) {
+    regmatch_t m[2];
+    if (regexec(&chunk_regex, line, 2, m, 0) != 0) {
+        return -1;
+    }
+    return strtol(line + m[1].rm_so, NULL, 16);
+}
+
+static void chunk_size_cases(int cases) {
+    static const struct {
+        const char *line;
+        long size;
+    } CASES[] = {
+        { "0", 0 },
+        { "1a", 26 },
+        { "FF", 255 },
+        { "ff ; name=value", 255 },
+        { "10\t;x", 16 },
+        { "10;", 16 },
+        { "fffffffffffffff", 0xfffffffffffffffL },
+        { "1000000000000000", -1 },
+        { "", -1 },
+        { " 1", -1 },
+        { "1 2", -1 },
+        { "0x10", -1 },
+        { "-1", -1 },
+        { "g", -1 },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        int len = strlen(CASES[i].line);
+        long size = parse_chunk_size(CASES[i].line, len);
+        CHECK(size == CASES[i].size, "chunk size %s: got %ld, expected %ld",
+            show(CASES[i].line, len), size, CASES[i].size);
+    }
+    static const char ALPHABET[] = "0123456789abcdefABCDEF0123456789gx ;\t=-\r";
+    for (int n = 0; n < cases; n += 1) {
+        char line[CASE_SIZE];
+        int len = pick(20);
+        for (int i = 0; i < len; i += 1) {
+            line[i] = ALPHABET[pick(sizeof(ALPHABET) - 1)];
+        }
+        line[len] = '\0';
+        long size = parse_chunk_size(line, len);
+        long expected = reference_chunk_size(line);
+        CHECK(size == expected, "chunk size %s: got %ld, expected %ld", show(line, len), size,
+            expected);
+    }
+}
+
+/* ----------------------------------------------------------------------------------------------
+   Entity-tags
+   ---------------------------------------------------------------------------------------------- */
+
+static void etag_cases(void) {
+    static const char ETAG[] = "\"1-2-3\"";
+    static const struct {
+        const char *value;
+        int strong;
+        int weak;
+    } CASES[] = {
+        { "*", 1, 1 },
+        { " *", 1, 1 },
+        { "\"1-2-3\"", 1, 1 },
+        { "W/\"1-2-3\"", 0, 1 },
+        { "\"x\", \"1-2-3\"", 1, 1 },
+        { "\"x\",W/\"1-2-3\"", 0, 1 },
+        { "\"x\" ,\t\"1-2-3\"", 1, 1 },
+        { "\"1-2-3", 0, 0 },
+        { "1-2-3", 0, 0 },
+        { "w/\"1-2-3\"", 0, 0 },
+        { "\"1-2-3 \"", 0, 0 },
+        { "\"1-2-4\"", 0, 0 },
+        { "\"x\" \"1-2-3\"", 1, 1 },
+        { "**", 0, 0 },
+        { "*, \"1-2-3\"", 0, 0 },
+        { "W/", 0, 0 },
+        { "", 0, 0 },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        int len = strlen(CASES[i].value);
+        int strong = parse_etag_match(CASES[i].value, len, ETAG, strlen(ETAG), 0);
+        int weak = parse_etag_match(CASES[i].value, len, ETAG, strlen(ETAG), 1);
+        CHECK(strong == CASES[i].strong && weak == CASES[i].weak,
+            "etag %s: got %d strong and %d weak, expected %d and %d", show(CASES[i].value, len),
+            strong, weak, CASES[i].strong, CASES[i].weak);
+    }
+}
+
+/* ----------------------------------------------------------------------------------------------
+   HTTP-date
+   ---------------------------------------------------------------------------------------------- */
+
+// Matches the IMF-fixdate shape, checks each field's range, and lets timegm do the arithmetic. The
+// day of the week is not checked, and days past the end of a month roll over into the next.
+static long reference_http_date(const char *value) {
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    regmatch_t m[7];
+    if (regexec(&date_regex, value, 7, m, 0) != 0) {
+        return -1;
+    }
+    struct tm tm = { 0 };
+    tm.tm_mday = atoi(value + m[1].rm_so);
+    tm.tm_mon = (strstr(MONTHS, (char[]) { value[m[2].rm_so], value[m[2].rm_so + 1],
+                                              value[m[2].rm_so + 2], '\0' })
+                    - MONTHS)
+                / 3;
+    tm.tm_year = atoi(value + m[3].rm_so) - 1900;
+    tm.tm_hour = atoi(value + m[4].rm_so);
+    tm.tm_min = atoi(value + m[5].rm_so);
+    tm.tm_sec = atoi(value + m[6].rm_so);
+    if (tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_year < 70 || tm.tm_hour > 23 || tm.tm_min > 59
+        || tm.tm_sec > 60) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+static void http_date_cases(int cases) {
+    static const struct {
+        const char *value;
+        long seconds;
+    } CASES[] = {
+        { "Sun, 06 Nov 1994 08:49:37 GMT", 784111777 },
+        { "Thu, 01 Jan 1970 00:00:00 GMT", 0 },
+        { "Thu, 29 Feb 2024 00:00:00 GMT", 1709164800 },
+        { "Fri, 31 Dec 9999 23:59:59 GMT", 253402300799L },
+        { "Wed, 31 Dec 1969 23:59:59 GMT", -1 },
+        { "Sunday, 06-Nov-94 08:49:37 GMT", -1 },
+        { "Sun Nov  6 08:49:37 1994", -1 },
+        { "Sun, 06 Nov 1994 08:49:37 UTC", -1 },
+        { "Sun, 06 nov 1994 08:49:37 GMT", -1 },
+        { "Sun, 00 Nov 1994 08:49:37 GMT", -1 },
+        { "Sun, 06 Nov 1994 24:00:00 GMT", -1 },
+        { "Sun, 06 Nov 1994 08:60:00 GMT", -1 },
+        { "Sun, 6 Nov 1994 08:49:37 GMT", -1 },
+        { "Sun, 06 Nov 1994 08:49:37 GMT ", -1 },
+        { "", -1 },
+    };
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(*CASES); i += 1) {
+        int len = strlen(CASES[i].value);
+        long seconds = parse_http_date(CASES[i].value, len);
+        CHECK(seconds == CASES[i].seconds, "date %s: got %ld, expected %ld",
+            show(CASES[i].value, len), seconds, CASES[i].seconds);
+    }
+    // Every date the server itself writes reads back as the same second, and any one character
+    // changed in it reads the same as the reference does.
+    static const char NOISE[] = "0123456789 :,ADGJMNOSFadgnotuyxZ-";
+    for (int n = 0; n < cases; n += 1) {
+        char value[CASE_SIZE];
+        struct tm tm;
+        time_t t = next_random() % 253402300800L;
+        gmtime_r(&t, &tm);
+        int len = strftime(value, CASE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        long seconds = parse_http_date(value, len);
+        CHECK(seconds == t, "date %s: got %ld, expected %ld", show(value, len), seconds, (long) t);
+        value[pick(len)] = NOISE[pick(sizeof(NOISE) - 1)];
+        seconds = parse_http_date(value, len);
+        long expected = reference_http_date(value);
+        CHECK(seconds == expected, "date %s: got %ld, expected %ld", show(value, len), seconds,
+            expected);
+    }
+}
+
+int main(int argc, char **argv) {
+    int cases = DEFAULT_CASES;
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'n': cases = atoi(optarg); break;
+        case 's': state = strtoul(optarg, NULL, 10); break;
+        default: errx(EXIT_FAILURE, "usage: %s [-n cases] [-s seed]", argv[0]);
+        }
+    }
+    if (cases < 0 || state == 0) {
+        errx(EXIT_FAILURE, "cases must not be negative and the seed must not be 0");
+    }
+    compile(&old_line, OLD_LINE_REGEX);
+    compile(&old_hf, OLD_HF_REGEX);
+    compile(&line_regex, LINE_REGEX);
+    compile(&chunk_regex, CHUNK_REGEX);
+    compile(&spec_regex, SPEC_REGEX);
+    compile(&date_regex, DATE_REGEX);
+
+    request_line_cases();
+    request_line_random(cases);
+    header_fields_cases();
+    header_fields_random(cases);
+    uri_cases();
+    range_cases();
+    range_random(cases);
+    chunk_size_cases(cases);
+    etag_cases();
+    http_date_cases(cases);
+
+    printf("%d checks, %d failed\n", checks, failures);
+    printf("request-line differences from the original grammar: %ld slash-only URIs refused, %ld "
+           "empty segments accepted, %ld methods matched in full\n",
+        deviations.slash_only, deviations.empty_segment, deviations.method);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include "urilock.h"
+#include "utils.h"
+#include "stats.h"
+#include "slab.h"
+
+typedef struct lock_stripe {
+    pthread_mutex_t mutex;
+    uri_lock *head;
+} lock_stripe;
+
+static lock_stripe stripes[URI_LOCK_STRIPES];
+static pthread_rwlockattr_t rwlock_attr;
+
+void uri_lock_init(void) {
+    for (int i = 0; i < URI_LOCK_STRIPES; i += 1) {
+        pthread_mutex_init(&stripes[i].mutex, NULL);
+        stripes[i].head = NULL;
+    }
+    // Readers only hold their lock for an instant, so let writers cut in rather than starve.
+    pthread_rwlockattr_init(&rwlock_attr);
+    pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+}
+
+int uri_normalize(const char *uri, char *out) {
+    int len = 0;
+    if (uri[0] == '.' && uri[1] == '/') {
+        uri += 1;
+    }
+    for (; *uri != '\0' && len < BLOCK_2048 - 1; uri += 1) {
+        if (*uri == '/' && len > 0 && out[len - 1] == '/') {
+            continue;
+        }
+        out[len] = *uri;
+        len += 1;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// FNV-1a
+uint64_t uri_hash(const char *uri, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i += 1) {
+        hash ^= (unsigned char) uri[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uri_lock *uri_lock_get(const char *uri) {
+    char path[BLOCK_2048];
+    int len = uri_normalize(uri, path);
+    uint64_t hash = uri_hash(path, len);
+    lock_stripe *stripe = &stripes[hash % URI_LOCK_STRIPES];
+
+    pthread_mutex_lock(&stripe->mutex);
+    uri_lock *lock = stripe->head;
+    while (lock && (lock->hash != hash || lock->len != len || memcmp(lock->uri, path, len) != 0)) {
+        lock = lock->next;
+    }
+    if (lock == NULL) {
+        lock = slab_alloc(sizeof(uri_lock) + len + 1);
+        if (lock == NULL) {
+            pthread_mutex_unlock(&stripe->mutex);
+            return NULL;
+        }
+        pthread_rwlock_init(&lock->rwlock, &rwlock_attr);
+        pthread_mutex_init(&lock->combine_mutex, NULL);
+        pthread_cond_init(&lock->combined, NULL);
+        lock->combine_head = lock->combine_tail = NULL;
+        lock->combining = 0;
+        lock->hash = hash;
+        lock->refs = 0;
+        lock->len = len;
+        memcpy(lock->uri, path, len + 1);
+        lock->next = stripe->head;
+        stripe->head = lock;
+    }
+    lock->refs += 1;
+    pthread_mutex_unlock(&stripe->mutex);
+    return lock;
+}
+
+void uri_lock_put(uri_lock *lock) {
+    if (lock == NULL) {
+        return;
+    }
+    lock_stripe *stripe = &stripes[lock->hash % URI_LOCK_STRIPES];
+    pthread_mutex_lock(&stripe->mutex);
+    lock->refs -= 1;
+    if (lock->refs == 0) {
+        uri_lock **cursor = &stripe->head;
+        while (*cursor != lock) {
+            cursor = &(*cursor)->next;
+        }
+        *cursor = lock->next;
+        pthread_rwlock_destroy(&lock->rwlock);
+        pthread_mutex_destroy(&lock->combine_mutex);
+        pthread_cond_destroy(&lock->combined);
+        slab_free(lock, sizeof(uri_lock) + lock->len + 1);
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+void uri_lock_lock(uri_lock *lock, int exclusive) {
+    // Only a lock that has to be waited for reads the clock.
+    long start = -1;
+    if ((exclusive ? pthread_rwlock_trywrlock(&lock->rwlock) : pthread_rwlock_tryrdlock(&lock->rwlock))
+        != 0) {
+        start = STATS_NOW();
+        if (exclusive) {
+            pthread_rwlock_wrlock(&lock->rwlock);
+        } else {
+            pthread_rwlock_rdlock(&lock->rwlock);
+        }
+    }
+    STATS_RECORD(STAGE_LOCK, start);
+}
+
+void uri_lock_unlock(uri_lock *lock) {
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+uri_lock *uri_lock_acquire(const char *uri, int exclusive) {
+    uri_lock *lock = uri_lock_get(uri);
+    if (lock != NULL) {
+        uri_lock_lock(lock, exclusive);
+    }
+    return lock;
+}
+
+void uri_lock_release(uri_lock *lock) {
+    if (lock == NULL) {
+        return;
+    }
+    uri_lock_unlock(lock);
+    uri_lock_put(lock);
+}
@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <stdint.h>
+
+#pragma once
+
+// Number of independently locked buckets in the lock table
+#define URI_LOCK_STRIPES 256
+
+struct append_op;
+
+// Reader-writer lock for one URI. Entries are created on first use and freed when the last
+// holder releases them, so the table only ever holds URIs that are in use. Each entry also keeps
+// the queue of APPENDs waiting to be written to the URI as one group, guarded by combine_mutex.
+typedef struct uri_lock {
+    pthread_rwlock_t rwlock;
+    pthread_mutex_t combine_mutex;
+    pthread_cond_t combined;
+    struct append_op *combine_head;
+    struct append_op *combine_tail;
+    int combining;
+    uint64_t hash;
+    int refs;
+    int len;
+    struct uri_lock *next;
+    char uri[];
+} uri_lock;
+
+// @brief Normalizes a URI into the key its lock and cache entries are found by: a leading ./ is
+// dropped and runs of slashes are collapsed into one.
+// @param uri Path of the URI.
+// @param out Buffer of BLOCK_2048 bytes for the key, which is NUL terminated.
+// @return Length of the key.
+int uri_normalize(const char *uri, char *out);
+
+// @brief Hashes a normalized key.
+// @param uri The key.
+// @param len Length of the key.
+// @return The hash the lock and cache tables are indexed by.
+uint64_t uri_hash(const char *uri, int len);
+
+// @brief Initializes the lock table. Must be called before any other uri_lock function.
+void uri_lock_init(void);
+
+// @brief Locks a URI, creating its entry if needed. Paths are normalized first, so ./a//b and /a/b share a lock.
+// @param uri Path of the URI.
+// @param exclusive Non-zero for a writer lock, zero for a reader lock.
+// @return The held lock, to be handed to uri_lock_release, or NULL if no entry could be allocated.
+uri_lock *uri_lock_acquire(const char *uri, int exclusive);
+
+// @brief Unlocks a URI and frees its entry if nobody else holds or waits on it.
+// @param lock Lock returned by uri_lock_acquire. NULL is ignored.
+void uri_lock_release(uri_lock *lock);
+
+// @brief Finds or creates the entry of a URI and keeps it alive without locking it, for threads
+// that wait on its APPEND queue.
+// @param uri Path of the URI.
+// @return The entry, to be handed to uri_lock_put, or NULL if it could not be allocated.
+uri_lock *uri_lock_get(const char *uri);
+
+// @brief Drops the reference taken by uri_lock_get and frees the entry if it was the last one.
+// @param lock Entry returned by uri_lock_get. NULL is ignored.
+void uri_lock_put(uri_lock *lock);
+
+// @brief Locks the URI of an entry the caller already holds a reference to.
+// @param lock Entry returned by uri_lock_get.
+// @param exclusive Non-zero for a writer lock, zero for a reader lock.
+void uri_lock_lock(uri_lock *lock, int exclusive);
+
+// @brief Unlocks the URI of an entry without dropping the caller's reference.
+// @param lock Entry locked with uri_lock_lock.
+void uri_lock_unlock(uri_lock *lock);
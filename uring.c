@@ -0,0 +1,161 @@
+#include "uring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define load_acquire(p)      atomic_load_explicit((_Atomic unsigned *) (p), memory_order_acquire)
+#define store_release(p, v)  atomic_store_explicit((_Atomic unsigned *) (p), (v), memory_order_release)
+#define store_release16(p, v) atomic_store_explicit((_Atomic uint16_t *) (p), (v), memory_order_release)
+
+int uring_init(uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // One mapping holds both the submission and the completion ring.
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    char *base = ring->sq_ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *) (base + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (base + params.sq_off.array);
+    ring->cq_head = (unsigned *) (base + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+    for (unsigned i = 0; i < ring->sq_entries; i += 1) {
+        ring->sq_array[i] = i;
+    }
+    ring->sq_local_tail = *ring->sq_tail;
+    return 0;
+}
+
+uring *uring_local(void) {
+    static _Thread_local uring ring;
+    static _Thread_local int state = 0;
+    if (state == 0) {
+        state = (uring_init(&ring, URING_LOCAL_ENTRIES) == 0) ? 1 : -1;
+    }
+    return (state == 1) ? &ring : NULL;
+}
+
+void uring_destroy(uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+struct io_uring_sqe *uring_sqe(uring *ring) {
+    if (ring->sq_local_tail - load_acquire(ring->sq_head) >= ring->sq_entries) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    ring->sq_local_tail += 1;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+// io_uring_enter is not a cancellation point either, so waits get the same treatment as the
+// futex waits in the queue.
+static int enter(uring *ring, unsigned submit, unsigned wait) {
+    int type = 0;
+    if (wait > 0) {
+        pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &type);
+    }
+    int ret = syscall(
+        __NR_io_uring_enter, ring->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (wait > 0) {
+        pthread_setcanceltype(type, NULL);
+    }
+    return ret;
+}
+
+int uring_submit(uring *ring, unsigned wait) {
+    unsigned pending = ring->sq_local_tail - *ring->sq_tail;
+    store_release(ring->sq_tail, ring->sq_local_tail);
+    return enter(ring, pending, wait);
+}
+
+struct io_uring_cqe *uring_peek(uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == load_acquire(ring->cq_tail)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_advance(uring *ring) {
+    store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+int uring_bufs_init(uring *ring, uring_bufs *bufs, int group, unsigned count, unsigned size) {
+    struct io_uring_buf_reg reg;
+    bufs->count = count;
+    bufs->size = size;
+    bufs->group = group;
+    bufs->ring_size = count * sizeof(struct io_uring_buf);
+    bufs->ring = mmap(
+        NULL, bufs->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    bufs->base = malloc((size_t) count * size);
+    if (bufs->ring == MAP_FAILED || bufs->base == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) bufs->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    bufs->tail = 0;
+    for (unsigned i = 0; i < count; i += 1) {
+        struct io_uring_buf *buf = &bufs->ring->bufs[i];
+        buf->addr = (uintptr_t) (bufs->base + (size_t) i * size);
+        buf->len = size;
+        buf->bid = i;
+        bufs->tail += 1;
+    }
+    store_release16(&bufs->ring->tail, bufs->tail);
+    return 0;
+}
+
+char *uring_buf(uring_bufs *bufs, unsigned flags) {
+    return bufs->base + (size_t) (flags >> IORING_CQE_BUFFER_SHIFT) * bufs->size;
+}
+
+void uring_buf_recycle(uring_bufs *bufs, unsigned flags) {
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->count - 1)];
+    buf->addr = (uintptr_t) (bufs->base + (size_t) bid * bufs->size);
+    buf->len = bufs->size;
+    buf->bid = bid;
+    bufs->tail += 1;
+    store_release16(&bufs->ring->tail, bufs->tail);
+}
@@ -0,0 +1,94 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#pragma once
+
+// Submission entries of each thread's own ring
+#define URING_LOCAL_ENTRIES 16
+
+// Minimal io_uring ring driven through the raw syscalls. The submission and completion rings are
+// mapped once at setup; SQEs are written in place and handed to the kernel in one io_uring_enter.
+typedef struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local_tail;
+    void *sq_ring;
+    size_t sq_ring_size;
+    size_t sqes_size;
+} uring;
+
+// Ring of buffers the kernel picks from when a receive completes, so a connection waiting for bytes
+// does not have to lend the kernel a buffer of its own.
+typedef struct uring_bufs {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned count;
+    unsigned size;
+    int group;
+    unsigned tail;
+    size_t ring_size;
+} uring_bufs;
+
+// @brief Sets up a ring.
+// @param ring The ring to set up.
+// @param entries Number of submission entries, rounded up to a power of two by the kernel.
+// @return 0 on success, -1 with errno set if io_uring is not available.
+int uring_init(uring *ring, unsigned entries);
+
+// @brief Returns the calling thread's own small ring, set up on first use.
+// @return The ring, or NULL if it could not be set up.
+uring *uring_local(void);
+
+// @brief Unmaps and closes a ring.
+// @param ring The ring to destroy.
+void uring_destroy(uring *ring);
+
+// @brief Reserves the next submission entry, zeroed.
+// @param ring The ring to submit to.
+// @return The entry, or NULL if every entry is already queued.
+struct io_uring_sqe *uring_sqe(uring *ring);
+
+// @brief Submits every queued entry and optionally waits for completions.
+// @param ring The ring to submit to.
+// @param wait Number of completions to wait for, 0 to only submit.
+// @return Number of entries submitted, or -1 with errno set.
+int uring_submit(uring *ring, unsigned wait);
+
+// @brief Returns the oldest unseen completion without waiting.
+// @param ring The ring to look at.
+// @return The completion, or NULL if there is none.
+struct io_uring_cqe *uring_peek(uring *ring);
+
+// @brief Marks the completion returned by uring_peek as seen.
+// @param ring The ring it came from.
+void uring_advance(uring *ring);
+
+// @brief Registers a ring of provided buffers with a ring.
+// @param ring The ring the buffers are used with.
+// @param bufs The buffer ring to set up.
+// @param group Buffer group id that receive entries select from.
+// @param count Number of buffers, a power of two.
+// @param size Size of each buffer.
+// @return 0 on success, -1 with errno set.
+int uring_bufs_init(uring *ring, uring_bufs *bufs, int group, unsigned count, unsigned size);
+
+// @brief Returns a buffer picked by the kernel.
+// @param bufs The buffer ring.
+// @param flags Flags of the completion that used the buffer.
+// @return Start of the buffer.
+char *uring_buf(uring_bufs *bufs, unsigned flags);
+
+// @brief Hands a buffer back to the kernel once its bytes have been consumed.
+// @param bufs The buffer ring.
+// @param flags Flags of the completion that used the buffer.
+void uring_buf_recycle(uring_bufs *bufs, unsigned flags);
@@ -1,77 +1,118 @@
+#define _GNU_SOURCE
 #include "utils.h"
+#include "urilock.h"
+#include "auditlog.h"
+#include "cache.h"
+#include "uring.h"
+#include "stats.h"
+#include "slab.h"
+#include "follow.h"
+#include "syncer.h"
+#include "fdcache.h"
 #include <err.h>
-#include <poll.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
-#include <assert.h>
 #include <pthread.h>
-#include <sys/file.h>
-
-enum METHODS { PUT, GET, APPEND };
-
-#define LOG(...) handle_log(logfile, __VA_ARGS__);
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
 
 const char *STATUS_PHRASES[] = { [OK] = "HTTP/1.1 200 OK\r\nContent-Length: 3 \r\n\r\nOK\n",
     [CREATED] = "HTTP/1.1 201 Created\r\nContent-Length: 8 \r\n\r\nCreated\n",
     [BAD_REQ] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 12 \r\n\r\nBad Request\n",
     [FORBIDDEN] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 10 \r\n\r\nForbidden\n",
     [NOT_FOUND] = "HTTP/1.1 404 Not Found\r\nContent-Length: 10 \r\n\r\nNot Found\n",
+    [REQ_TIMEOUT] = "HTTP/1.1 408 Request Timeout\r\nContent-Length: 16 \r\n"
+                    "Connection: close\r\n\r\nRequest Timeout\n",
+    [PRECOND_FAILED]
+    = "HTTP/1.1 412 Precondition Failed\r\nContent-Length: 20 \r\n\r\nPrecondition Failed\n",
     [INTER_SERV_ERROR]
     = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 22 \r\n\r\nInternal Server Error\n",
     [NOT_IMPL] = "HTTP/1.1 501 Not Implemented\r\nContent-Length: 16 \r\n\r\nNot Implemented\n" };
 
-void handle_log(FILE *logfile, char *buffer, int *status_code) {
-    char method[BLOCK_256] = { 0 };
-    char uri[BLOCK_256] = { 0 };
-    int req_id = 0;
-    sscanf(buffer, "%s %s", method, uri);
-    char *cursor = strstr(buffer, "Request-Id: ");
-    if (cursor) {
-        sscanf(cursor + 12, "%d", &req_id);
+int io_backend = BACKEND_EPOLL;
+int durability = DURABLE_NONE;
+long direct_threshold = 0;
+int transfer_timeout = 0;
+
+static long clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+long transfer_deadline(const transfer *x) {
+    if (transfer_timeout <= 0 || x->since == 0) {
+        return 0;
+    }
+    long progress = x->moved + x->sent;
+    return x->since + transfer_timeout * 1000L + (progress - x->base) * 1000 / TRANSFER_MIN_RATE;
+}
+
+/**
+   Reports whether a transfer that has to wait has run out of time. From its first wait a transfer
+   has transfer_timeout seconds plus the time the bytes it moves since then earn at
+   TRANSFER_MIN_RATE, so a client that trickles a few bytes at a time runs out of time as surely as
+   one that stops. The clock starts at the first wait, so a transfer that never waits never reads
+   it.
+ */
+static int transfer_expired(transfer *x) {
+    if (transfer_timeout <= 0) {
+        return 0;
     }
-    if (method[0] != 0) {
-        fprintf(logfile, "%s,%s,%d,%d\n", method, uri, *status_code, req_id);
+    long now = clock_ms();
+    if (x->since == 0) {
+        x->since = now;
+        x->base = x->moved + x->sent;
+        return 0;
     }
-    return;
+    return now > transfer_deadline(x);
 }
 
-void handle_response(int connfd, int content_length, int *status_code) {
-    if (content_length > 0) {
-        content_length -= 1;
-        char response[BLOCK_2048];
-        snprintf(
-            response, BLOCK_2048, "HTTP/1.1 200 OK\r\nContent-Length: %d \r\n\r\n", content_length);
-        write(connfd, response, strlen(response));
-    } else {
-        write(connfd, STATUS_PHRASES[*status_code], strlen(STATUS_PHRASES[*status_code]));
+// Called when the socket of a message runs dry: wait for it, unless the client is out of time.
+static int transfer_wait(conn_struct *conn, int *status_code) {
+    if (transfer_expired(&conn->xfer)) {
+        *status_code = REQ_TIMEOUT;
+        return XFER_DONE;
     }
+    return XFER_WAIT;
 }
 
-void handle_dir(char *uri_path) {
-    regmatch_t match;
-    regex_t dir_regex;
-    regcomp(&dir_regex, DIR_REGEX, REG_EXTENDED);
-    if (regexec(&dir_regex, uri_path, 1, &match, 0) != 0) {
-        regfree(&dir_regex);
-        return;
-    } else {
-        char *dir_buf = (char *) calloc(((match.rm_eo - match.rm_so) + 1), sizeof(char));
-        memcpy(dir_buf, uri_path + match.rm_so, (match.rm_eo - match.rm_so));
-
-        // Make Nested Directories
-        char *cursor = dir_buf;
-        while (cursor < dir_buf + strlen(dir_buf)) {
-            if (*cursor == '/') {
-                *cursor = '\0'; // mkdir goes to null term
-                mkdir(dir_buf, S_IRWXU);
-                *cursor = '/';
-            }
-            cursor += 1;
-        }
+// Formats one audit record and queues it for the writer.
+static void log_record(
+    const char *method, int method_len, const char *uri, int uri_len, int code, int request_id) {
+    char record[BLOCK_2048 + BLOCK_256];
+    int len = snprintf(record, sizeof(record), "%.*s,%.*s,%d,%d\n", method_len, method, uri_len,
+        uri, code, request_id);
+    audit_record(record, (len < (int) sizeof(record)) ? len : (int) sizeof(record) - 1);
+}
 
-        free(dir_buf);
+void handle_log(char *buffer, request_t *req, int *status_code) {
+    if (req->method_len > 0) {
+        log_record(buffer, req->method_len, buffer + req->uri_off, req->uri_len, *status_code,
+            req->request_id);
     }
+    return;
+}
 
-    regfree(&dir_regex);
+void handle_response(conn_struct *conn, int *status_code) {
+    outbox box;
+    out_init(&box);
+    out_bytes(&box, STATUS_PHRASES[*status_code], strlen(STATUS_PHRASES[*status_code]));
+    handle_flush(conn, &box, status_code);
+}
+
+void handle_dir(char *uri_path, int *status_code) {
+    // Only directories missing from the descriptor cache are looked up, and only missing ones made.
+    fd_entry *dir = fdcache_dir(uri_path, 1);
+    if (dir == NULL && errno == EIO) {
+        *status_code = INTER_SERV_ERROR;
+    }
+    fdcache_release(dir);
     return;
 }
 
@@ -80,252 +121,1405 @@ void handle_urifd(int *method, char *uri_path, int *uri_fd, int *status_code) {
         *status_code = NOT_IMPL;
         return;
     }
+    if (*method == PUT) {
+        return;
+    }
+
+    // Resolved against the cached descriptor of the URI's directory instead of walking the path.
+    fd_entry *dir = fdcache_dir(uri_path, 0);
+    if (dir != NULL) {
+        *uri_fd = openat(dir->fd, strrchr(uri_path, '/') + 1,
+            ((*method == GET) ? O_RDONLY : O_WRONLY) | O_CLOEXEC, S_IRWXU);
+        int error = errno;
+        fdcache_release(dir);
+        errno = error;
+    }
+    if (dir == NULL || *uri_fd == -1) {
+        if (errno == ENOENT) {
+            *status_code = NOT_FOUND;
+        } else if (errno == EACCES) {
+            *status_code = FORBIDDEN;
+        } else if (errno == EISDIR) {
+            *status_code = FORBIDDEN;
+        } else {
+            *status_code = BAD_REQ;
+        }
+        *uri_fd = -1;
+    }
+    return;
+}
 
-    char tmp[BLOCK_2048] = { 0 };
-    snprintf(tmp, BLOCK_2048, "./%s", uri_path);
-    memcpy(uri_path, tmp, strlen(tmp));
+void handle_request(char *buffer, int size, request_t *req, char *uri, int *status_code) {
+    int code = parse_request_line(buffer, size, req);
+    if (req->uri_len > 0) {
+        uri[0] = '.';
+        memcpy(uri + 1, buffer + req->uri_off, req->uri_len);
+        uri[req->uri_len + 1] = '\0';
+    }
+    if (*status_code == OK) {
+        *status_code = code;
+    }
+    return;
+}
 
-    switch (*method) {
-    case (PUT): {
-        return;
+void handle_hf(char *buffer, int size, request_t *req, int *status_code) {
+    int code = parse_header_fields(buffer, size, req);
+    if (code != OK) {
+        *status_code = code;
     }
-    case (GET): {
-        *uri_fd = open(uri_path, O_RDONLY, S_IRWXU);
-        if (*uri_fd == -1) {
-            if (errno == ENOENT) {
-                *status_code = NOT_FOUND;
-            } else if (errno == EACCES) {
-                *status_code = FORBIDDEN;
-            } else if (errno == EISDIR) {
-                *status_code = FORBIDDEN;
-            } else {
+    return;
+}
+
+// Fallback for descriptors that cannot be spliced: a read and a write through a small buffer.
+// Returns the bytes moved, 0 if the socket has none yet, or -1 with status_code set.
+static long copy_some(int in, int out, long len, int *status_code) {
+    char buffer[BLOCK_2048];
+    int local_read = read(in, buffer, (BLOCK_2048 < len) ? BLOCK_2048 : len);
+    if (local_read == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    if (local_read <= 0) {
+        *status_code = BAD_REQ;
+        return -1;
+    }
+    if (write(out, buffer, local_read) != local_read) {
+        *status_code = INTER_SERV_ERROR;
+        return -1;
+    }
+    return local_read;
+}
+
+// Reads what the socket has of a message gathered in memory. Returns as copy_some.
+static long read_some(int in, char *body, long len, int *status_code) {
+    ssize_t local_read = read(in, body, len);
+    if (local_read == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    if (local_read <= 0) {
+        *status_code = BAD_REQ;
+        return -1;
+    }
+    return local_read;
+}
+
+// Splices what the socket has, up to SPLICE_CHUNK bytes, from the socket to the file through a
+// pipe, so the bytes never pass through user space. Returns as copy_some.
+static long splice_some(int in, int out, long len, int *status_code) {
+    // One pipe per worker, reused by every request it serves. It is always left empty.
+    static _Thread_local int pipefds[2] = { -1, -1 };
+    if (pipefds[0] == -1 && pipe2(pipefds, O_CLOEXEC) == -1) {
+        return copy_some(in, out, len, status_code);
+    }
+    ssize_t moved = splice(in, NULL, pipefds[1], NULL, (SPLICE_CHUNK < len) ? SPLICE_CHUNK : len,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    if (moved == -1 && errno == EINVAL) {
+        return copy_some(in, out, len, status_code);
+    }
+    if (moved <= 0) {
+        *status_code = BAD_REQ;
+        return -1;
+    }
+    for (ssize_t left = moved; left > 0;) {
+        ssize_t local_write = splice(pipefds[0], NULL, out, NULL, left, SPLICE_F_MOVE);
+        if (local_write <= 0) {
+            // The pipe may still hold bytes, so replace it rather than hand it to the next request.
+            close(pipefds[0]);
+            close(pipefds[1]);
+            pipefds[0] = pipefds[1] = -1;
+            *status_code = INTER_SERV_ERROR;
+            return -1;
+        }
+        left -= local_write;
+    }
+    return moved;
+}
+
+/**
+   Receives what the socket holds through the worker's own ring. A submission links up to
+   URING_CHAIN recv->write pairs, so one io_uring_enter moves URING_CHAIN chunks. Receives wait for
+   their whole chunk, which keeps every write's length fixed, so a chain only asks for the bytes
+   FIONREAD reports as queued and never waits on the client. A message that ends early fails its
+   receive, and the kernel cancels the rest of the chain. Writes go to the file position like the
+   other paths do, so a message can land after bytes already in the file, such as earlier chunks of
+   a chunked message. Returns as copy_some, and splices instead if no ring is available.
+ */
+static long uring_some(int in, int out, long len, int *status_code) {
+    static _Thread_local char *buffers = NULL;
+    uring *ring = uring_local();
+    int queued = 0;
+    if (buffers == NULL) {
+        buffers = malloc((size_t) URING_CHAIN * SPLICE_CHUNK);
+    }
+    if (ring == NULL || buffers == NULL || ioctl(in, FIONREAD, &queued) == -1) {
+        return splice_some(in, out, len, status_code);
+    }
+    if (queued == 0) {
+        // Nothing queued: the client has yet to send more, or it has closed.
+        char probe;
+        ssize_t peeked = recv(in, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (peeked == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (peeked <= 0) {
+            *status_code = BAD_REQ;
+            return -1;
+        }
+        queued = peeked;
+    }
+
+    long want = (queued < len) ? queued : len;
+    int links = 0;
+    int sizes[URING_CHAIN];
+    for (long offset = 0; links < URING_CHAIN && offset < want; links += 1) {
+        sizes[links] = (SPLICE_CHUNK < want - offset) ? SPLICE_CHUNK : (want - offset);
+        char *buffer = buffers + (size_t) links * SPLICE_CHUNK;
+        struct io_uring_sqe *sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = in;
+        sqe->addr = (uintptr_t) buffer;
+        sqe->len = sizes[links];
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = 2 * links;
+        sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = out;
+        sqe->addr = (uintptr_t) buffer;
+        sqe->len = sizes[links];
+        sqe->off = (uint64_t) -1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = 2 * links + 1;
+        offset += sizes[links];
+    }
+    ring->sqes[(ring->sq_local_tail - 1) & *ring->sq_mask].flags = 0;
+    if (uring_submit(ring, 2 * links) < 0) {
+        *status_code = INTER_SERV_ERROR;
+        return -1;
+    }
+
+    // Completions of a chain arrive in order. The first failure decides the status and everything
+    // after it is cancelled. A failed park from this thread can complete in between; its user_data
+    // is a connection, never a small index, and it is handled as uring_park would.
+    long moved = 0;
+    for (int i = 0; i < 2 * links;) {
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(ring)) == NULL) {
+            uring_submit(ring, 1);
+        }
+        if (cqe->user_data >= (uint64_t) 2 * links) {
+            park_failed(cqe->user_data);
+            uring_advance(ring);
+            continue;
+        }
+        i += 1;
+        int link = cqe->user_data / 2;
+        if (*status_code == OK && cqe->res != sizes[link]) {
+            *status_code = (cqe->user_data % 2 == 0) ? BAD_REQ : INTER_SERV_ERROR;
+        } else if (*status_code == OK && cqe->user_data % 2 == 1) {
+            moved += sizes[link];
+        }
+        uring_advance(ring);
+    }
+    return (*status_code == OK) ? moved : -1;
+}
+
+/**
+   Moves up to *left bytes of a message to the transfer's file or buffer: first those that were
+   read along with the head, which are dropped from the connection's buffer, then what the socket
+   has. Returns XFER_WAIT if the socket runs dry first.
+ */
+static int move_message(conn_struct *conn, long *left, int *status_code) {
+    transfer *x = &conn->xfer;
+    char *pre = conn->buffer + conn->head_len;
+    long buffered = conn->bytes_read - conn->head_len;
+    long bytes = (buffered < *left) ? buffered : *left;
+
+    if (bytes > 0) {
+        if (x->body) {
+            memcpy(x->body + x->moved, pre, bytes);
+        } else if (write(x->fd, pre, bytes) != bytes) {
+            *status_code = INTER_SERV_ERROR;
+            return XFER_DONE;
+        }
+        memmove(pre, pre + bytes, buffered - bytes);
+        conn->bytes_read -= bytes;
+        *left -= bytes;
+        x->moved += bytes;
+    }
+    while (*left > 0) {
+        long moved;
+        if (x->body) {
+            moved = read_some(conn->fd, x->body + x->moved, *left, status_code);
+        } else if (io_backend == BACKEND_URING) {
+            moved = uring_some(conn->fd, x->fd, *left, status_code);
+        } else {
+            moved = splice_some(conn->fd, x->fd, *left, status_code);
+        }
+        if (moved == 0) {
+            return transfer_wait(conn, status_code);
+        }
+        if (moved < 0) {
+            break;
+        }
+        *left -= moved;
+        x->moved += moved;
+    }
+    return XFER_DONE;
+}
+
+void handle_begin(conn_struct *conn, int fd, char *body, long length) {
+    transfer *x = &conn->xfer;
+    x->phase = XFER_BODY;
+    x->fd = fd;
+    x->body = body;
+    x->length = length;
+    x->left = (length < 0) ? 0 : length;
+    x->chunk = CHUNK_SIZE;
+}
+
+int handle_message(conn_struct *conn, int *status_code) {
+    return move_message(conn, &conn->xfer.left, status_code);
+}
+
+// Reads more of a chunked message into the connection's buffer, after the bytes not yet parsed.
+static int fill_chunked(conn_struct *conn, int *status_code) {
+    if (conn->bytes_read == BLOCK_2048) {
+        // A size line or trailer that does not fit beside the head
+        *status_code = BAD_REQ;
+        return XFER_DONE;
+    }
+    int local_read = read(conn->fd, conn->buffer + conn->bytes_read, BLOCK_2048 - conn->bytes_read);
+    if (local_read == -1 && errno == EAGAIN) {
+        return transfer_wait(conn, status_code);
+    }
+    if (local_read <= 0) {
+        *status_code = BAD_REQ;
+    } else {
+        conn->bytes_read += local_read;
+    }
+    return XFER_DONE;
+}
+
+int handle_chunked(conn_struct *conn, int *status_code) {
+    transfer *x = &conn->xfer;
+    char *line = conn->buffer + conn->head_len;
+
+    while (*status_code == OK) {
+        if (x->chunk == CHUNK_DATA) {
+            if (move_message(conn, &x->left, status_code) == XFER_WAIT) {
+                return XFER_WAIT;
+            }
+            x->chunk = CHUNK_END;
+            continue;
+        }
+        char *cr = memmem(line, conn->bytes_read - conn->head_len, "\r\n", 2);
+        if (cr == NULL) {
+            if (fill_chunked(conn, status_code) == XFER_WAIT) {
+                return XFER_WAIT;
+            }
+            continue;
+        }
+        int line_len = cr - line;
+        long size = (x->chunk == CHUNK_SIZE) ? parse_chunk_size(line, line_len) : 0;
+        // A parsed line is dropped, so the next one always starts right after the head.
+        conn->bytes_read -= line_len + 2;
+        memmove(line, cr + 2, conn->bytes_read - conn->head_len);
+
+        if (x->chunk == CHUNK_END) {
+            // Every chunk's data ends with a CRLF of its own.
+            if (line_len != 0) {
                 *status_code = BAD_REQ;
             }
-            return;
+            x->chunk = CHUNK_SIZE;
+        } else if (x->chunk == CHUNK_TRAILER) {
+            // Trailer fields are read past and ignored; an empty line ends the message.
+            if (line_len == 0) {
+                break;
+            }
+        } else if (size < 0) {
+            *status_code = BAD_REQ;
+        } else if (size == 0) {
+            x->chunk = CHUNK_TRAILER;
+        } else {
+            x->left = size;
+            x->chunk = CHUNK_DATA;
         }
-        return;
     }
-    case (APPEND): {
-        *uri_fd = open(uri_path, O_WRONLY, S_IRWXU);
-        if (*uri_fd == -1) {
-            if (errno == ENOENT) {
-                *status_code = NOT_FOUND;
-            } else if (errno == EACCES) {
-                *status_code = FORBIDDEN;
-            } else if (errno == EISDIR) {
-                *status_code = FORBIDDEN;
-            } else {
-                *status_code = BAD_REQ;
+    return XFER_DONE;
+}
+
+int handle_direct(conn_struct *conn, int *status_code) {
+    static _Thread_local char *buffer = NULL;
+    transfer *x = &conn->xfer;
+    if (buffer == NULL && posix_memalign((void **) &buffer, DIRECT_ALIGN, DIRECT_CHUNK) != 0) {
+        buffer = NULL;
+        if (x->direct == 1) {
+            x->direct = 0;
+            return -1;
+        }
+        *status_code = INTER_SERV_ERROR;
+        return XFER_DONE;
+    }
+    if (x->direct == 1) {
+        int flags = fcntl(x->fd, F_GETFL);
+        if (fcntl(x->fd, F_SETFL, flags | O_DIRECT) == -1) {
+            x->direct = 0;
+            return -1;
+        }
+        x->direct_flags = flags;
+        x->direct = 2;
+    }
+
+    // What did not fill a block before the last wait comes first, then what was read with the head.
+    int filled = x->tail_len;
+    if (x->tail) {
+        memcpy(buffer, x->tail, filled);
+        slab_free(x->tail, DIRECT_ALIGN);
+        x->tail = NULL;
+        x->tail_len = 0;
+    }
+    char *pre = conn->buffer + conn->head_len;
+    int buffered = conn->bytes_read - conn->head_len;
+    int bytes = (buffered < x->left) ? buffered : x->left;
+    memcpy(buffer + filled, pre, bytes);
+    memmove(pre, pre + bytes, buffered - bytes);
+    conn->bytes_read -= bytes;
+    filled += bytes;
+    x->left -= bytes;
+    x->moved += bytes;
+
+    int result = XFER_DONE;
+    while (*status_code == OK) {
+        // Only a full buffer or the end of the message is written, always in whole blocks.
+        int whole = (filled == DIRECT_CHUNK || x->left == 0) ? filled & ~(DIRECT_ALIGN - 1) : 0;
+        if (whole > 0 && write(x->fd, buffer, whole) != whole) {
+            *status_code = INTER_SERV_ERROR;
+            break;
+        }
+        memmove(buffer, buffer + whole, filled - whole);
+        filled -= whole;
+        if (x->left == 0) {
+            break;
+        }
+        int local_read = read(conn->fd, buffer + filled,
+            (DIRECT_CHUNK - filled < x->left) ? DIRECT_CHUNK - filled : x->left);
+        if (local_read == -1 && errno == EAGAIN) {
+            result = transfer_wait(conn, status_code);
+            break;
+        }
+        if (local_read <= 0) {
+            *status_code = BAD_REQ;
+            break;
+        }
+        filled += local_read;
+        x->left -= local_read;
+        x->moved += local_read;
+    }
+
+    if (result == XFER_WAIT) {
+        // The buffer belongs to this worker and the next wakeup may be on another, so the whole
+        // blocks are written now and only the rest waits with the connection. The file position
+        // stays block aligned.
+        int whole = filled & ~(DIRECT_ALIGN - 1);
+        filled -= whole;
+        if (whole > 0 && write(x->fd, buffer, whole) != whole) {
+            *status_code = INTER_SERV_ERROR;
+        } else if (filled > 0 && (x->tail = slab_alloc(DIRECT_ALIGN)) == NULL) {
+            *status_code = INTER_SERV_ERROR;
+        } else {
+            if (filled > 0) {
+                memcpy(x->tail, buffer + whole, filled);
             }
-            return;
+            x->tail_len = filled;
+            return XFER_WAIT;
         }
-        return;
+        filled = 0;
     }
+    fcntl(x->fd, F_SETFL, x->direct_flags);
+    x->direct = 0;
+    if (*status_code == OK && filled > 0 && write(x->fd, buffer, filled) != filled) {
+        *status_code = INTER_SERV_ERROR;
     }
+    return XFER_DONE;
 }
 
-void handle_request(char *buffer, int *method, int *uri_fd, char *uri, int *status_code) {
-    regmatch_t match;
-    regex_t uri_regex;
-    regex_t method_regex;
-    regex_t http_regex;
-    regex_t req_regex;
+int handle_sync(int fd) {
+    if (durability == DURABLE_REQUEST) {
+        return fdatasync(fd);
+    }
+    if (durability == DURABLE_BATCH) {
+        return syncer_wait(fd);
+    }
+    return 0;
+}
 
-    regcomp(&req_regex, REQ_REGEX, REG_EXTENDED);
-    if (regexec(&req_regex, buffer, 0, NULL, 0) != 0) {
-        *status_code = BAD_REQ;
-        regfree(&req_regex);
-        return;
+int handle_sync_dir(int dirfd, const char *path) {
+    if (durability == DURABLE_NONE) {
+        return 0;
+    }
+    // Cached directories are O_PATH descriptors, which cannot be synced, so it is opened again.
+    int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
     }
-    regfree(&req_regex);
+    int result = handle_sync(fd);
+    close(fd);
+    return result;
+}
 
-    // METHOD REGEX
-    regcomp(&method_regex, METH_REGEX, REG_EXTENDED);
-    if (regexec(&method_regex, buffer, 1, &match, 0) != 0) {
-        *status_code = BAD_REQ;
-        regfree(&method_regex);
-        return;
+void out_init(outbox *box) {
+    box->count = 0;
+    box->next = 0;
+    box->fd = -1;
+    box->holds = 0;
+    box->entry = NULL;
+    box->kept_size = 0;
+    box->text_len = 0;
+}
+
+static void out_add(outbox *box, int kind, const char *data, off_t offset, off_t end) {
+    if (box->count < OUT_PARTS) {
+        box->parts[box->count] = (out_part) { kind, box->fd, data, offset, end };
+        box->count += 1;
     }
-    regfree(&method_regex);
-    char *method_buf = (char *) calloc(((match.rm_eo - match.rm_so) + 1), sizeof(char));
-    memcpy(method_buf, buffer + match.rm_so, (match.rm_eo - match.rm_so));
+}
 
-    if (strncasecmp(method_buf, "PUT", 3) == 0) {
-        *method = PUT;
-    } else if (strncasecmp(method_buf, "GET", 3) == 0) {
-        *method = GET;
-    } else if (strncasecmp(method_buf, "APPEND", 6) == 0) {
-        *method = APPEND;
+void out_printf(outbox *box, const char *format, ...) {
+    int room = OUT_TEXT - box->text_len;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(box->text + box->text_len, room, format, args);
+    va_end(args);
+    len = (len < 0) ? 0 : (len < room) ? len : room - 1;
+    // Text that follows text goes out as one piece.
+    out_part *last = (box->count > 0) ? &box->parts[box->count - 1] : NULL;
+    if (last && last->kind == PART_TEXT && last->end == box->text_len) {
+        last->end += len;
     } else {
-        *status_code = NOT_IMPL;
-        free(method_buf);
-        return;
+        out_add(box, PART_TEXT, NULL, box->text_len, box->text_len + len);
     }
+    box->text_len += len;
+}
 
-    free(method_buf);
+void out_bytes(outbox *box, const char *data, size_t length) {
+    out_add(box, PART_BYTES, data, 0, length);
+}
 
-    // URI REGEX
-    regcomp(&uri_regex, URI_REGEX, REG_EXTENDED);
-    if (regexec(&uri_regex, buffer, 1, &match, 0) != 0) {
-        *status_code = BAD_REQ;
-        regfree(&uri_regex);
+void out_hold(outbox *box, int fd, fd_entry *file) {
+    if (fd != -1 && box->holds < BATCH_MAX) {
+        box->held[box->holds] = (out_held) { fd, file };
+        box->holds += 1;
+    }
+    box->fd = fd;
+}
+
+void out_file(outbox *box, off_t offset, off_t length) {
+    if (length > 0) {
+        out_add(box, PART_FILE, NULL, offset, offset + length);
+    }
+    // A large part is read sequentially, so the kernel reads ahead in big windows and starts on
+    // the first one before sendfile asks for it.
+    if (box->fd != -1 && length >= STREAM_MIN) {
+        posix_fadvise(box->fd, offset, length, POSIX_FADV_SEQUENTIAL);
+        readahead(box->fd, offset, (length < READAHEAD_WINDOW) ? length : READAHEAD_WINDOW);
+    }
+}
+
+// Moves an outbox that has to wait into a slab object of the connection's, up to the end of its
+// text. The file and cache entry it sends from go with it.
+static outbox *out_keep(conn_struct *conn, outbox *box) {
+    int size = offsetof(outbox, text) + box->text_len;
+    outbox *kept = slab_alloc(size);
+    if (kept == NULL) {
+        return NULL;
+    }
+    memcpy(kept, box, size);
+    kept->kept_size = size;
+    conn->xfer.out = kept;
+    // A response is timed from its own first wait, not from that of the message before it.
+    conn->xfer.since = 0;
+    return kept;
+}
+
+static void out_release(conn_struct *conn, outbox *box) {
+    for (int i = 0; i < box->holds; i += 1) {
+        if (box->held[i].file) {
+            fdcache_release(box->held[i].file);
+        } else {
+            close(box->held[i].fd);
+        }
+    }
+    if (box->entry) {
+        cache_release(box->entry);
+    }
+    if (box == conn->xfer.out) {
+        conn->xfer.out = NULL;
+        slab_free(box, box->kept_size);
+    }
+    conn->xfer.phase = XFER_HEAD;
+}
+
+int handle_flush(conn_struct *conn, outbox *box, int *status_code) {
+    while (box->next < box->count) {
+        out_part *part = &box->parts[box->next];
+        ssize_t sent;
+        if (part->kind == PART_FILE) {
+            off_t offset = part->offset;
+            sent = sendfile(conn->fd, part->fd, &offset, part->end - part->offset);
+        } else {
+            // Without MSG_MORE a head goes out alone and a short message then waits on Nagle for
+            // the client's delayed ACK.
+            const char *data = (part->kind == PART_TEXT) ? box->text : part->data;
+            sent = send(conn->fd, data + part->offset, part->end - part->offset,
+                (box->next + 1 < box->count) ? MSG_MORE : 0);
+        }
+        if (sent == -1 && errno == EAGAIN) {
+            if (box != conn->xfer.out) {
+                outbox *kept = out_keep(conn, box);
+                if (kept == NULL) {
+                    *status_code = INTER_SERV_ERROR;
+                    break;
+                }
+                box = kept;
+            }
+            if (transfer_expired(&conn->xfer)) {
+                *status_code = REQ_TIMEOUT;
+                break;
+            }
+            conn->xfer.phase = XFER_SEND;
+            return XFER_WAIT;
+        }
+        if (sent <= 0) {
+            *status_code = INTER_SERV_ERROR;
+            break;
+        }
+        part->offset += sent;
+        conn->xfer.sent += sent;
+        if (part->offset == part->end) {
+            box->next += 1;
+        }
+    }
+    out_release(conn, box);
+    return XFER_DONE;
+}
+
+void handle_abort(conn_struct *conn) {
+    transfer *x = &conn->xfer;
+    if (x->phase == XFER_BODY) {
+        if (x->fd != -1) {
+            close(x->fd);
+        }
+        if (x->body) {
+            slab_free(x->body, x->length);
+        }
+        slab_free(x->tail, DIRECT_ALIGN);
+    }
+    if (x->out) {
+        out_release(conn, x->out);
+    }
+    x->phase = XFER_HEAD;
+}
+
+void handle_validator(const struct stat *uri_stat, validator *valid) {
+    struct tm tm;
+    valid->mtime = uri_stat->st_mtim.tv_sec;
+    snprintf(valid->etag, VALIDATOR_ETAG, "\"%lx-%lx-%lx\"", (unsigned long) uri_stat->st_ino,
+        (unsigned long) uri_stat->st_size,
+        (unsigned long) uri_stat->st_mtim.tv_sec * 1000000000UL + uri_stat->st_mtim.tv_nsec);
+    gmtime_r(&valid->mtime, &tm);
+    strftime(valid->last_modified, VALIDATOR_DATE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void handle_entity(outbox *box, off_t size, const validator *valid, int *status_code) {
+    if (*status_code == NOT_MODIFIED) {
+        out_printf(box, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n",
+            valid->etag, valid->last_modified);
         return;
     }
-    regfree(&uri_regex);
-    memcpy(uri, buffer + match.rm_so, (match.rm_eo - match.rm_so));
-    handle_urifd(method, uri, uri_fd, status_code);
+    out_printf(box, ENTITY_HEAD, (long) size, valid->etag, valid->last_modified);
+}
 
-    // HTTP REGEX
-    regcomp(&http_regex, HTTP_REGEX, REG_EXTENDED);
-    if (regexec(&http_regex, buffer, 1, &match, 0) != 0) {
-        *status_code = BAD_REQ;
-        regfree(&http_regex);
+// Random half of every multipart boundary, drawn once by handle_ranges_init
+static unsigned long boundary_key = 0;
+
+void handle_ranges_init(void) {
+    if (getrandom(&boundary_key, sizeof(boundary_key), 0) != sizeof(boundary_key)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        boundary_key = ((unsigned long) now.tv_sec << 32) ^ (unsigned long) now.tv_nsec
+                       ^ (unsigned long) getpid();
+    }
+}
+
+void handle_ranges(outbox *box, off_t size, byte_range *ranges, int count) {
+    static _Atomic unsigned long responses = 0;
+    char header[BLOCK_256];
+    char boundary[32];
+
+    if (count == 0) {
+        out_printf(box,
+            "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 22 \r\nContent-Range: bytes */%ld\r\n"
+            "\r\nRange Not Satisfiable\n",
+            (long) size);
+        return;
+    }
+    if (count == 1) {
+        out_printf(box,
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %ld \r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+            ranges[0].end - ranges[0].start + 1, ranges[0].start, ranges[0].end, (long) size);
+        out_file(box, ranges[0].start, ranges[0].end - ranges[0].start + 1);
         return;
     }
-    regfree(&http_regex);
+
+    // Every part is a CRLF, the boundary line, its Content-Range and an empty line, then its bytes.
+    // The length of the whole message is known before anything is sent.
+    // Made of the process's random key and a count, so it says nothing about the server's memory.
+    snprintf(boundary, sizeof(boundary), "%016lx%08lx", boundary_key,
+        atomic_fetch_add(&responses, 1) & 0xffffffffUL);
+    long total = 0;
+    for (int i = 0; i < count; i += 1) {
+        total += snprintf(header, BLOCK_256, "\r\n--%s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                     boundary, ranges[i].start, ranges[i].end, (long) size)
+                 + (ranges[i].end - ranges[i].start + 1);
+    }
+    total += snprintf(header, BLOCK_256, "\r\n--%s--\r\n", boundary);
+    out_printf(box,
+        "HTTP/1.1 206 Partial Content\r\nContent-Length: %ld \r\nContent-Type: multipart/byteranges; "
+        "boundary=%s\r\n\r\n",
+        total, boundary);
+    for (int i = 0; i < count; i += 1) {
+        out_printf(box, "\r\n--%s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n", boundary,
+            ranges[i].start, ranges[i].end, (long) size);
+        out_file(box, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+    }
+    out_printf(box, "\r\n--%s--\r\n", boundary);
     return;
 }
 
-void handle_hf(char *buffer, char hf[BLOCK_2048], int *length, int *status_code) {
-    regex_t regex;
-    regcomp(&regex, HF_REGEX, REG_EXTENDED);
-    int tmp = 0;
-    char *cursor = strstr(buffer, "\r\n") + 2;
-    while ((tmp = sscanf(cursor, "%[^\r\n]", hf)) > 0) {
-        if (tmp < 0) {
+int handle_tmpfile(char *uri, int *status_code) {
+    fd_entry *dir = fdcache_dir(uri, 0);
+    int fd = (dir != NULL) ? openat(dir->fd, ".", __O_TMPFILE | O_RDWR, S_IRWXU) : -1;
+    int error = errno;
+    fdcache_release(dir);
+    if (fd == -1) {
+        if (error == EACCES) {
+            *status_code = FORBIDDEN;
+        } else if (error == ENOENT || error == ENOTDIR) {
             *status_code = BAD_REQ;
-            break;
-        }
-        if (regexec(&regex, hf, 0, NULL, 0) != 0) {
-            *status_code = BAD_REQ;
-            regfree(&regex);
-            return;
-        }
-        if (strncmp(hf, "Content-Length: ", 16) == 0) {
-            sscanf(hf + 16, "%d", length);
+        } else {
+            *status_code = INTER_SERV_ERROR;
         }
-        cursor += strlen(hf) + 2;
     }
-    if (tmp < 0) {
-        *status_code = BAD_REQ;
+    return fd;
+}
+
+void handle_publish(int fd, char *uri, int *status_code) {
+    static _Atomic unsigned long version = 0;
+    char proc_path[BLOCK_256];
+    char tmp_name[BLOCK_2048 + BLOCK_256];
+    char *name = strrchr(uri, '/') + 1;
+
+    fd_entry *dir = fdcache_dir(uri, 0);
+    if (dir == NULL) {
+        *status_code = INTER_SERV_ERROR;
+        return;
     }
-    regfree(&regex);
-    if (*length < 0) {
-        *status_code = BAD_REQ;
+    // Give the anonymous inode a hidden name next to the URI, then rename it over the URI in one step.
+    snprintf(proc_path, BLOCK_256, "/proc/self/fd/%d", fd);
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.%lu", name, atomic_fetch_add(&version, 1));
+    if (linkat(AT_FDCWD, proc_path, dir->fd, tmp_name, AT_SYMLINK_FOLLOW) == -1) {
+        *status_code = INTER_SERV_ERROR;
+    } else if (renameat(dir->fd, tmp_name, dir->fd, name) == -1) {
+        unlinkat(dir->fd, tmp_name, 0);
+        *status_code = INTER_SERV_ERROR;
+    } else if (handle_sync_dir(dir->fd, ".") == -1) {
+        // The data was synced before the rename; the name it now has is only durable with its
+        // directory.
+        *status_code = INTER_SERV_ERROR;
     }
+    fdcache_release(dir);
     return;
 }
 
-void handle_message(int in, int out, int *length, int *status_code) {
-
-    char buffer[BLOCK_2048] = { 0 };
-    int bytes = 0;
-    int local_read = 0;
-    int local_write = 0;
-    int num_bytes = (BLOCK_2048 < *length) ? BLOCK_2048 : (*length);
-    struct pollfd pollfds[1];
-    pollfds[0].fd = in;
-    pollfds[0].events = POLLIN;
-
-    for (;;) {
-        while ((local_read = read(in, buffer, num_bytes)) > 0) {
-            bytes += local_read;
-            local_write = write(out, buffer, local_read);
-            if (local_write == -1) {
-                if (errno == EAGAIN) {
-                    poll(pollfds, 1, -1);
-                    continue;
-                } else {
-                    *status_code = BAD_REQ;
-                    return;
-                }
-            }
-            if (local_write == 0) {
-                return;
+// Stats the URI through the cached descriptor of its directory.
+static int stat_uri(char *uri, struct stat *uri_stat) {
+    fd_entry *dir = fdcache_dir(uri, 0);
+    int result = (dir != NULL) ? fstatat(dir->fd, strrchr(uri, '/') + 1, uri_stat, 0) : -1;
+    int error = errno;
+    fdcache_release(dir);
+    errno = error;
+    return result;
+}
+
+// Evaluates If-Match and If-None-Match for a PUT. current is NULL when the URI does not exist.
+static int preconditions_hold(conn_struct *conn, request_t *req, const struct stat *current) {
+    validator valid;
+    if (current) {
+        handle_validator(current, &valid);
+    }
+    if (req->if_match_len > 0
+        && (current == NULL
+            || !parse_etag_match(conn->buffer + req->if_match_off, req->if_match_len, valid.etag,
+                strlen(valid.etag), 0))) {
+        return 0;
+    }
+    if (req->if_none_match_len > 0 && current != NULL
+        && parse_etag_match(conn->buffer + req->if_none_match_off, req->if_none_match_len,
+            valid.etag, strlen(valid.etag), 1)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Sends the fixed response for a status code with the ETag of the version a write produced.
+static void respond_tagged(conn_struct *conn, const validator *valid, int *code) {
+    outbox box;
+    const char *phrase = STATUS_PHRASES[*code];
+    const char *end = strstr(phrase, "\r\n\r\n");
+    out_init(&box);
+    out_printf(&box, "%.*s\r\nETag: %s%s", (int) (end - phrase), phrase, valid->etag, end);
+    handle_flush(conn, &box, code);
+}
+
+/**
+   Moves as much of the message of a PUT or APPEND as the socket has. Returns XFER_WAIT with the
+   connection still in XFER_BODY, or XFER_DONE with it back in XFER_HEAD, its file or buffer handed
+   back to the caller in xfer, and body_done set if the whole message arrived.
+ */
+static int receive_message(conn_struct *conn, request_t *req, int *code) {
+    long start = STATS_NOW();
+    int result;
+    if (req->chunked) {
+        result = handle_chunked(conn, code);
+    } else if (!conn->xfer.direct || (result = handle_direct(conn, code)) == -1) {
+        result = handle_message(conn, code);
+    }
+    STATS_RECORD(STAGE_BODY, start);
+    if (result == XFER_WAIT) {
+        return XFER_WAIT;
+    }
+    conn->xfer.phase = XFER_HEAD;
+    req->body_done = (*code == OK);
+    return XFER_DONE;
+}
+
+void put_request(conn_struct *conn, request_t *req, char *uri, int *code) {
+
+    transfer *x = &conn->xfer;
+    int tmp_fd = -1;
+    struct stat uri_stat;
+    validator valid;
+
+    // Stream the message into a new inode next to the URI without holding any lock. Nothing is
+    // written twice and readers holding the old inode keep a consistent snapshot.
+    if (x->phase == XFER_HEAD) {
+        tmp_fd = handle_tmpfile(uri, code);
+        if (tmp_fd == -1 && *code == BAD_REQ) {
+            *code = OK;
+            handle_dir(uri, code);
+            if (*code == OK) {
+                tmp_fd = handle_tmpfile(uri, code);
             }
-            if (local_write == -1) {
-                printf("ERR[%s]\n", strerror(errno));
-                assert(local_write != -1);
+        }
+        if (tmp_fd != -1) {
+            handle_begin(conn, tmp_fd, NULL, req->chunked ? -1 : req->length);
+            x->direct = !req->chunked && direct_threshold > 0 && req->length >= direct_threshold;
+            // A known length is reserved up front so a large object lands in few extents. The
+            // size is left alone, so a message that ends early is never padded out.
+            if (!req->chunked && req->length >= STREAM_MIN) {
+                fallocate(tmp_fd, FALLOC_FL_KEEP_SIZE, 0, req->length);
             }
-            num_bytes = (BLOCK_2048 < *length - bytes) ? BLOCK_2048 : (*length - bytes);
         }
-        if (*length == bytes || local_read == 0) {
+    }
+    if (x->phase == XFER_BODY) {
+        if (receive_message(conn, req, code) == XFER_WAIT) {
             return;
         }
-        if (*status_code == -1) {
-            if (errno == EAGAIN) {
-                poll(pollfds, 1, -1);
-                continue;
-            } else {
-                *status_code = BAD_REQ;
-                return;
+        tmp_fd = x->fd;
+        // Synced before it is published, so the URI never names a version that is not durable.
+        if (*code == OK && handle_sync(tmp_fd) == -1) {
+            *code = INTER_SERV_ERROR;
+        }
+    }
+
+    uri_lock *lock = uri_lock_acquire(uri, 1);
+    if (lock == NULL) {
+        *code = INTER_SERV_ERROR;
+    }
+    if (*code == OK) {
+        if (stat_uri(uri, &uri_stat) == -1) {
+            *code = (errno == ENOENT) ? CREATED : BAD_REQ;
+        } else if (S_ISDIR(uri_stat.st_mode)) {
+            *code = FORBIDDEN;
+        } else {
+            fchmod(tmp_fd, uri_stat.st_mode & 07777);
+        }
+    }
+    // Checked against the version being replaced while no other write can publish, which makes
+    // If-Match a compare-and-swap.
+    if ((*code == OK || *code == CREATED)
+        && !preconditions_hold(conn, req, (*code == OK) ? &uri_stat : NULL)) {
+        *code = PRECOND_FAILED;
+    }
+    if (*code == OK || *code == CREATED) {
+        handle_publish(tmp_fd, uri, code);
+        cache_invalidate(lock->uri, lock->len, lock->hash);
+        fdcache_invalidate(lock->uri, lock->len, lock->hash);
+    }
+    int tagged = (*code == OK || *code == CREATED) && fstat(tmp_fd, &uri_stat) == 0;
+    if (tagged) {
+        handle_validator(&uri_stat, &valid);
+    }
+    LOG(conn->buffer, req, code);
+    uri_lock_release(lock);
+
+    if (tmp_fd != -1) {
+        close(tmp_fd);
+    }
+    if (tagged) {
+        respond_tagged(conn, &valid, code);
+    } else {
+        handle_response(conn, code);
+    }
+    return;
+}
+
+#ifndef NO_STATS
+// Serves the merged statistics from the reserved URIs. They bypass the file system entirely.
+static int stats_request(conn_struct *conn, request_t *req, int *code) {
+    char *path = conn->buffer + req->uri_off;
+    int json = (req->uri_len == sizeof(STATS_URI_JSON) - 1
+                && strncmp(path, STATS_URI_JSON, req->uri_len) == 0);
+    if (!json && (req->uri_len != sizeof(STATS_URI) - 1 || strncmp(path, STATS_URI, req->uri_len) != 0)) {
+        return 0;
+    }
+    char body[2 * BLOCK_2048];
+    outbox box;
+    int body_len = stats_render(body, sizeof(body), json);
+    out_init(&box);
+    out_printf(&box, "HTTP/1.1 200 OK\r\nContent-Length: %d \r\nContent-Type: %s\r\n\r\n%.*s",
+        body_len, json ? "application/json" : "text/plain", body_len, body);
+    LOG(conn->buffer, req, code);
+    handle_flush(conn, &box, code);
+    return 1;
+}
+#endif
+
+// Evaluates If-None-Match, or If-Modified-Since when there is none, for a GET. Returns 1 when the
+// client's copy is still current. A date later than the server's clock is ignored (RFC 9110
+// 13.1.3).
+static int not_modified(conn_struct *conn, request_t *req, const validator *valid) {
+    if (req->if_none_match_len > 0) {
+        return parse_etag_match(conn->buffer + req->if_none_match_off, req->if_none_match_len,
+            valid->etag, strlen(valid->etag), 1);
+    }
+    if (req->if_modified_since_len > 0) {
+        long since
+            = parse_http_date(conn->buffer + req->if_modified_since_off, req->if_modified_since_len);
+        return since >= 0 && since <= time(NULL) && valid->mtime <= since;
+    }
+    return 0;
+}
+
+void get_request(conn_struct *conn, request_t *req, char *uri, int *code) {
+
+    int urifd = -1;
+    struct stat uri_stat;
+    validator valid;
+    byte_range ranges[RANGE_MAX];
+    int count = -1;
+    outbox box;
+    out_init(&box);
+
+#ifndef NO_STATS
+    if (stats_request(conn, req, code)) {
+        return;
+    }
+#endif
+
+    // PUT publishes a new inode instead of writing in place and APPEND only writes past the end
+    // under the writer lock, so the inode and length taken here are a snapshot no write can change.
+    uri_lock *lock = uri_lock_acquire(uri, 0);
+    if (lock == NULL) {
+        *code = INTER_SERV_ERROR;
+        LOG(conn->buffer, req, code);
+        handle_response(conn, code);
+        return;
+    }
+    cache_entry *entry = (req->range_len == 0 && !req->follow)
+                             ? cache_lookup(lock->uri, lock->len, lock->hash)
+                             : NULL;
+    if (entry) {
+        *code = not_modified(conn, req, &entry->valid) ? NOT_MODIFIED : OK;
+        LOG(conn->buffer, req, code);
+        uri_lock_release(lock);
+        long start = STATS_NOW();
+        // The entry stays pinned until its response has gone out, however long that takes.
+        box.entry = entry;
+        if (*code == NOT_MODIFIED) {
+            handle_entity(&box, 0, &entry->valid, code);
+        } else {
+            out_bytes(&box, entry->response, entry->size);
+        }
+        handle_flush(conn, &box, code);
+        STATS_RECORD(STAGE_SEND, start);
+        return;
+    }
+    // A hot file stays open with its fstat, so only the first GET of a version opens it. A followed
+    // GET hands its descriptor to the follower thread and never shares one.
+    fd_entry *file = req->follow ? NULL : fdcache_file(lock->uri, lock->len, lock->hash);
+    if (file) {
+        urifd = file->fd;
+        uri_stat = file->st;
+        valid = file->valid;
+    } else {
+        handle_urifd(&req->method, uri, &urifd, code);
+        if (*code == OK) {
+            fstat(urifd, &uri_stat);
+            if (!S_ISREG(uri_stat.st_mode)) {
+                *code = FORBIDDEN;
             }
         }
+        if (*code == OK) {
+            handle_validator(&uri_stat, &valid);
+        }
+        if (*code == OK && !req->follow) {
+            file = fdcache_insert(lock->uri, lock->len, lock->hash, urifd, &uri_stat, &valid);
+        }
+    }
+    // A current copy is answered from the inode's metadata, before any of the file is read.
+    if (*code == OK && !req->follow && not_modified(conn, req, &valid)) {
+        *code = NOT_MODIFIED;
     }
+    // Filled under the reader lock, so no write can publish between the read and the insert. Only
+    // a whole GET fills it, so a range or a followed GET never reads the rest of the file, and an
+    // object too large to be kept is not read at all.
+    if (*code == OK && req->range_len == 0 && !req->follow && cache_admits(uri_stat.st_size)) {
+        cache_insert(lock->uri, lock->len, lock->hash, urifd, uri_stat.st_size, &valid);
+    }
+    if (*code == OK && req->range_len > 0 && !req->follow) {
+        count = parse_range(conn->buffer + req->range_off, req->range_len, uri_stat.st_size, ranges,
+            RANGE_MAX);
+        *code = (count == 0) ? RANGE_NOT_SAT : (count > 0) ? PARTIAL : OK;
+    }
+    LOG(conn->buffer, req, code);
+    uri_lock_release(lock);
 
+    // A followed GET streams the file and what is appended to it from the follower thread.
+    if (*code == OK && req->follow && follow_start(conn, urifd) == 0) {
+        req->detached = 1;
+        return;
+    }
+    // The response owns the file from here on and releases it once it is sent.
+    long start = STATS_NOW();
+    out_hold(&box, urifd, file);
+    if (*code == PARTIAL || *code == RANGE_NOT_SAT) {
+        handle_ranges(&box, uri_stat.st_size, ranges, (count > 0) ? count : 0);
+    } else if (*code == OK) {
+        handle_entity(&box, uri_stat.st_size, &valid, code);
+        out_file(&box, 0, uri_stat.st_size);
+    } else if (*code == NOT_MODIFIED) {
+        handle_entity(&box, 0, &valid, code);
+    } else {
+        out_bytes(&box, STATUS_PHRASES[*code], strlen(STATUS_PHRASES[*code]));
+    }
+    handle_flush(conn, &box, code);
+    STATS_RECORD(STAGE_SEND, start);
     return;
 }
 
-void put_request(int urifd, char *uri, int connfd, int length, int *code) {
+// An APPEND waiting to be written together with others to the same URI.
+typedef struct append_op {
+    conn_struct *conn;
+    request_t *req;
+    char *body;
+    long length;
+    int code;
+    int done;
+    int lead;
+    struct append_op *next;
+} append_op;
 
-    off_t offset = 0;
+/**
+   Writes a group of APPENDs at the end of the URI with pwritev, one message after another, and
+   syncs them once with handle_sync when every write must be durable. The caller holds the URI's
+   writer lock. A write that fails part way is cut back to the last whole message, so no message is
+   ever partly in the file, and each request is logged with its own outcome.
+ */
+static void append_group(uri_lock *lock, char *uri, append_op *group, int count) {
+    struct iovec iov[APPEND_GROUP];
+    int urifd = -1;
+    int code = OK;
+    off_t total = 0;
+    off_t written = 0;
 
-    int tmp_fd = open("./", __O_TMPFILE | O_RDWR, S_IRWXU);
+    handle_urifd(&group->req->method, uri, &urifd, &code);
+    off_t start = (code == OK) ? lseek(urifd, 0, SEEK_END) : 0;
+    append_op *op = group;
+    for (int i = 0; i < count; i += 1, op = op->next) {
+        iov[i].iov_base = op->body;
+        iov[i].iov_len = op->length;
+        total += op->length;
+    }
+    // A short write resumes from the first iovec it did not finish.
+    int first = 0;
+    while (code == OK && written < total) {
+        ssize_t local_write = pwritev(urifd, iov + first, count - first, start + written);
+        if (local_write <= 0) {
+            code = INTER_SERV_ERROR;
+            break;
+        }
+        written += local_write;
+        while (first < count && (size_t) local_write >= iov[first].iov_len) {
+            local_write -= iov[first].iov_len;
+            first += 1;
+        }
+        if (local_write > 0) {
+            iov[first].iov_base = (char *) iov[first].iov_base + local_write;
+            iov[first].iov_len -= local_write;
+        }
+    }
 
-    handle_message(connfd, tmp_fd, &length, code);
+    off_t kept = 0;
+    op = group;
+    for (int i = 0; i < count; i += 1, op = op->next) {
+        if (urifd == -1) {
+            op->code = code;
+        } else if (kept + op->length <= written) {
+            op->code = OK;
+            kept += op->length;
+        } else {
+            op->code = INTER_SERV_ERROR;
+        }
+    }
+    if (kept < written) {
+        ftruncate(urifd, start + kept);
+    }
+    int durable = (kept == 0 || handle_sync(urifd) == 0);
+    if (urifd != -1) {
+        cache_invalidate(lock->uri, lock->len, lock->hash);
+        fdcache_invalidate(lock->uri, lock->len, lock->hash);
+        close(urifd);
+    }
+    op = group;
+    for (int i = 0; i < count; i += 1, op = op->next) {
+        op->code = (op->code == OK && !durable) ? INTER_SERV_ERROR : op->code;
+        LOG(op->conn->buffer, op->req, &op->code);
+    }
+}
 
-    urifd = open(uri, O_WRONLY | O_TRUNC, S_IRWXU);
-    if (urifd == -1) {
-        if (errno == ENOENT) {
-            handle_dir(uri);
-            urifd = open(uri, O_CREAT | O_WRONLY, S_IRWXU);
-            *code = CREATED;
+/**
+   Group commit for APPENDs held in memory. Each request joins its URI's queue. The thread that
+   finds no group being written leads: it takes the queue, writes it under a single writer lock
+   with append_group, then hands leadership to the first request that queued meanwhile, so the
+   next group is written while its own response goes out. Returns once op is written and, if
+   required, durable; op->code holds the outcome.
+ */
+static void append_combine(char *uri, append_op *op) {
+    uri_lock *lock = uri_lock_get(uri);
+    if (lock == NULL) {
+        op->code = INTER_SERV_ERROR;
+        LOG(op->conn->buffer, op->req, &op->code);
+        return;
+    }
+    pthread_mutex_lock(&lock->combine_mutex);
+    op->next = NULL;
+    op->done = op->lead = 0;
+    if (lock->combine_tail) {
+        lock->combine_tail->next = op;
+    } else {
+        lock->combine_head = op;
+    }
+    lock->combine_tail = op;
+    while (lock->combining && !op->done && !op->lead) {
+        pthread_cond_wait(&lock->combined, &lock->combine_mutex);
+    }
+    if (op->done) {
+        pthread_mutex_unlock(&lock->combine_mutex);
+        uri_lock_put(lock);
+        return;
+    }
+
+    // The leader is always at the head of the queue.
+    lock->combining = 1;
+    append_op *group = lock->combine_head;
+    append_op *last = group;
+    int count = 1;
+    while (last->next && count < APPEND_GROUP) {
+        last = last->next;
+        count += 1;
+    }
+    lock->combine_head = last->next;
+    if (lock->combine_head == NULL) {
+        lock->combine_tail = NULL;
+    }
+    pthread_mutex_unlock(&lock->combine_mutex);
+
+    uri_lock_lock(lock, 1);
+    append_group(lock, uri, group, count);
+    uri_lock_unlock(lock);
+
+    pthread_mutex_lock(&lock->combine_mutex);
+    for (append_op *cursor = group; count > 0; cursor = cursor->next, count -= 1) {
+        cursor->done = 1;
+    }
+    if (lock->combine_head) {
+        lock->combine_head->lead = 1;
+    } else {
+        lock->combining = 0;
+    }
+    pthread_cond_broadcast(&lock->combined);
+    pthread_mutex_unlock(&lock->combine_mutex);
+    uri_lock_put(lock);
+}
+
+void append_request(conn_struct *conn, request_t *req, char *uri, int *code) {
+
+    transfer *x = &conn->xfer;
+    int urifd = -1;
+    int tmp_fd = -1;
+    long length = req->length;
+    char *body = NULL;
+
+    // Receive the whole message before taking the lock: small messages into a buffer from the
+    // thread's slab, large ones and those of unknown length spliced into a temp file on the same
+    // file system.
+    if (x->phase == XFER_HEAD) {
+        if (length <= APPEND_INLINE && !req->chunked) {
+            body = slab_alloc(length);
+            if (body == NULL) {
+                *code = INTER_SERV_ERROR;
+            } else {
+                handle_begin(conn, -1, body, length);
+            }
         } else {
-            *code = BAD_REQ;
+            tmp_fd = handle_tmpfile(uri, code);
+            if (tmp_fd != -1) {
+                handle_begin(conn, tmp_fd, NULL, req->chunked ? -1 : length);
+            }
         }
     }
-    if (*code != BAD_REQ) {
-        flock(urifd, LOCK_EX);
-        sendfile(urifd, tmp_fd, &offset, length);
-        flock(urifd, LOCK_UN);
+    if (x->phase == XFER_BODY) {
+        if (receive_message(conn, req, code) == XFER_WAIT) {
+            return;
+        }
+        body = x->body;
+        tmp_fd = x->fd;
+        if (req->chunked) {
+            length = x->moved;
+        }
     }
-    close(tmp_fd);
-    handle_response(connfd, 0, code);
+
+    if (*code == OK && tmp_fd == -1) {
+        append_op op = { .conn = conn, .req = req, .body = body, .length = length };
+        append_combine(uri, &op);
+        *code = op.code;
+        slab_free(body, length);
+        handle_response(conn, code);
+        return;
+    }
+
+    // The URI is opened under the lock so a PUT that swapped in a new version is never missed.
+    uri_lock *lock = uri_lock_acquire(uri, 1);
+    if (lock == NULL) {
+        *code = INTER_SERV_ERROR;
+    }
+    if (*code == OK) {
+        handle_urifd(&req->method, uri, &urifd, code);
+    }
+    if (*code == OK) {
+        // Copied in the kernel, or reflinked where the file system supports it.
+        off_t in_offset = 0;
+        off_t out_offset = lseek(urifd, 0, SEEK_END);
+        while (in_offset < length) {
+            if (copy_file_range(tmp_fd, &in_offset, urifd, &out_offset, length - in_offset, 0) <= 0) {
+                *code = INTER_SERV_ERROR;
+                break;
+            }
+        }
+        if (*code == OK && handle_sync(urifd) == -1) {
+            *code = INTER_SERV_ERROR;
+        }
+    }
+    if (urifd != -1) {
+        cache_invalidate(lock->uri, lock->len, lock->hash);
+        fdcache_invalidate(lock->uri, lock->len, lock->hash);
+    }
+    LOG(conn->buffer, req, code);
+    uri_lock_release(lock);
+
+    if (urifd != -1) {
+        close(urifd);
+    }
+    if (tmp_fd != -1) {
+        close(tmp_fd);
+    }
+    slab_free(body, length);
+    handle_response(conn, code);
     return;
 }
 
-void get_request(int urifd, char *uri, int connfd, int length, int *code) {
-    (void) uri;
+// One URI listed by an MGET: the file it is sent from, or the status it failed with
+typedef struct mget_item {
+    int code;
+    int fd;
+    fd_entry *file;
+    off_t size;
+    char *line;
+    int line_len;
+} mget_item;
+
+// The message of the fixed response for a status code, such as Not Found followed by a newline.
+static const char *status_message(int code) {
+    return strstr(STATUS_PHRASES[code], "\r\n\r\n") + 4;
+}
 
-    off_t offset = 0;
+/**
+   Opens one URI of an MGET and fixes its length under the URI's reader lock, as a GET does, so
+   every item is a snapshot of its own. Files come from the descriptor cache where they can, and
+   the item is logged before the lock is released.
+ */
+static void mget_open(conn_struct *conn, request_t *req, char *path, mget_item *item) {
+    int method = GET;
     struct stat uri_stat;
-    fstat(urifd, &uri_stat);
-    length = uri_stat.st_size;
-    handle_response(connfd, length + 1, code);
-    flock(urifd, LOCK_SH);
-    int tmp_fd = open("./", __O_TMPFILE | O_RDWR, S_IRWXU);
-    handle_message(urifd, tmp_fd, &length, code);
-    flock(urifd, LOCK_UN);
-    sendfile(connfd, tmp_fd, &offset, length);
-    close(tmp_fd);
-    return;
+    validator valid;
+    item->code = OK;
+    item->fd = -1;
+    item->file = NULL;
+    item->size = 0;
+
+    uri_lock *lock = uri_lock_acquire(path, 0);
+    if (lock == NULL) {
+        item->code = INTER_SERV_ERROR;
+        log_record(conn->buffer, req->method_len, path + 1, strlen(path + 1), item->code,
+            req->request_id);
+        return;
+    }
+    fd_entry *file = fdcache_file(lock->uri, lock->len, lock->hash);
+    if (file) {
+        item->fd = file->fd;
+        uri_stat = file->st;
+    } else {
+        handle_urifd(&method, path, &item->fd, &item->code);
+        if (item->code == OK) {
+            fstat(item->fd, &uri_stat);
+            if (!S_ISREG(uri_stat.st_mode)) {
+                item->code = FORBIDDEN;
+            }
+        }
+        if (item->code == OK) {
+            handle_validator(&uri_stat, &valid);
+            file = fdcache_insert(lock->uri, lock->len, lock->hash, item->fd, &uri_stat, &valid);
+        }
+    }
+    item->file = file;
+    item->size = (item->code == OK) ? uri_stat.st_size : 0;
+    log_record(conn->buffer, req->method_len, path + 1, strlen(path + 1), item->code,
+        req->request_id);
+    uri_lock_release(lock);
 }
 
-void append_request(int urifd, char *uri, int connfd, int length, int *code) {
-    (void) uri;
+void mget_request(conn_struct *conn, request_t *req, char *uri, int *code) {
 
-    off_t offset = 0;
+    transfer *x = &conn->xfer;
+    long length = req->length;
+    mget_item items[BATCH_MAX];
+    char path[2 * BLOCK_2048];
+    int count = 0;
+    outbox box;
+    out_init(&box);
 
-    int tmp_fd = open("./", __O_TMPFILE | O_RDWR, S_IRWXU);
-    handle_message(connfd, tmp_fd, &length, code);
+    // The list is gathered in memory like a small APPEND message; it has to be whole before any
+    // item can be answered.
+    if (x->phase == XFER_HEAD) {
+        if (req->chunked || length == 0 || length > BATCH_MAX * BLOCK_2048) {
+            *code = BAD_REQ;
+        } else if ((x->body = slab_alloc(length)) == NULL) {
+            *code = INTER_SERV_ERROR;
+        } else {
+            handle_begin(conn, -1, x->body, length);
+        }
+    }
+    if (x->phase == XFER_BODY && receive_message(conn, req, code) == XFER_WAIT) {
+        return;
+    }
+    char *body = x->body;
+    x->body = NULL;
+
+    // One URI per line, with or without a CR, and blank lines skipped. Every URI is under the
+    // directory of the request's own, which is ./ for the root.
+    int base_len = strlen(uri);
+    if (base_len > 0 && uri[base_len - 1] == '/') {
+        base_len -= 1;
+    }
+    memcpy(path, uri, base_len);
+    // The whole list is split and checked before anything is opened or logged, so a list that is
+    // refused as a whole leaves no trace of its items.
+    char *line = body;
+    char *end = (body != NULL) ? body + length : NULL;
+    while (*code == OK && line < end) {
+        char *newline = memchr(line, '\n', end - line);
+        char *line_end = (newline != NULL) ? newline : end;
+        int line_len = line_end - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len -= 1;
+        }
+        if (line_len > 0 && count == BATCH_MAX) {
+            *code = BAD_REQ;
+        } else if (line_len > 0) {
+            // A malformed URI fails alone.
+            int valid = line_len < BLOCK_2048 && parse_uri(line, line_len) == OK;
+            items[count] = (mget_item) { valid ? OK : BAD_REQ, -1, NULL, 0, line, line_len };
+            count += 1;
+        }
+        line = line_end + 1;
+    }
+    if (*code == OK && count == 0) {
+        *code = BAD_REQ;
+    }
+    for (int i = 0; *code == OK && i < count; i += 1) {
+        if (items[i].code != OK) {
+            // Logged without the URI, which is not one.
+            log_record(conn->buffer, req->method_len, "", 0, BAD_REQ, req->request_id);
+            continue;
+        }
+        memcpy(path + base_len, items[i].line, items[i].line_len);
+        path[base_len + items[i].line_len] = '\0';
+        mget_open(conn, req, path, &items[i]);
+    }
+    slab_free(body, length);
+    if (*code != OK) {
+        LOG(conn->buffer, req, code);
+        out_bytes(&box, STATUS_PHRASES[*code], strlen(STATUS_PHRASES[*code]));
+        handle_flush(conn, &box, code);
+        return;
+    }
 
-    lseek(urifd, 0, SEEK_END);
-    if (*code != BAD_REQ) {
-        flock(urifd, LOCK_EX);
-        sendfile(urifd, tmp_fd, &offset, length);
-        flock(urifd, LOCK_UN);
+    // Every item is its status and length on a line of their own, its bytes and a CRLF, so the
+    // length of the whole message is known before anything is sent.
+    long start = STATS_NOW();
+    long total = 0;
+    for (int i = 0; i < count; i += 1) {
+        long size
+            = (items[i].code == OK) ? items[i].size : (long) strlen(status_message(items[i].code));
+        total += snprintf(NULL, 0, "%d %ld\r\n", items[i].code, size) + size + 2;
+    }
+    out_printf(&box, "HTTP/1.1 200 OK\r\nContent-Length: %ld \r\n\r\n", total);
+    for (int i = 0; i < count; i += 1) {
+        const char *message = status_message(items[i].code);
+        out_hold(&box, items[i].fd, items[i].file);
+        if (items[i].code == OK) {
+            out_printf(&box, "%d %ld\r\n", OK, (long) items[i].size);
+            out_file(&box, 0, items[i].size);
+        } else {
+            out_printf(&box, "%d %ld\r\n%s", items[i].code, (long) strlen(message), message);
+        }
+        out_printf(&box, "\r\n");
     }
-    close(tmp_fd);
-    handle_response(connfd, 0, code);
+    handle_flush(conn, &box, code);
+    STATS_RECORD(STAGE_SEND, start);
     return;
 }
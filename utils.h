@@ -6,93 +6,408 @@
 #include <sys/stat.h>
 #include <sys/sendfile.h>
 #include <stdio.h>
-#include <regex.h>
+#include <stdint.h>
 
 #pragma once
 
+#include "parser.h"
+
 // Specifies a block of bytes
 #define BLOCK_2048 2048
 #define BLOCK_256  256
 
-// REGEX used for parsing the request-line
-#define REQ_REGEX  "([a-zA-Z]+)[ ]+(/+(/?[a-zA-Z0-9_.])+)*[ ]+(HTTP/1.1)[\r\n]"
-#define METH_REGEX "^([a-zA-Z]+)"
-#define HF_REGEX   "([a-zA-Z0-9_.-]+: [^\r\n]+)"
-#define URI_REGEX  "/+(/?[a-zA-Z0-9_.])*"
-#define HTTP_REGEX "HTTP/1.1"
-#define DIR_REGEX  "([./]+/?[A-z0-9]+)+/"
+// Most bytes moved per splice call, the default capacity of a pipe
+#define SPLICE_CHUNK 65536
+
+// Largest APPEND message gathered in memory instead of a temp file
+#define APPEND_INLINE 65536
+
+// Most ranges served for one GET, more and the Range header is ignored
+#define RANGE_MAX 16
+
+// Most APPENDs to one URI written by a single pwritev, within IOV_MAX
+#define APPEND_GROUP 64
+
+// Chunks of a message received and written by one io_uring chain
+#define URING_CHAIN 4
+
+// Longest quoted ETag and HTTP-date a validator holds, with their terminators
+#define VALIDATOR_ETAG 56
+#define VALIDATOR_DATE 32
+
+// Head of a 200 response to a GET: its Content-Length, ETag and Last-Modified
+#define ENTITY_HEAD \
+    "HTTP/1.1 200 OK\r\nContent-Length: %ld \r\nETag: %s\r\nLast-Modified: %s\r\n\r\n"
+
+enum METHODS { PUT, GET, APPEND, MGET };
+
+enum BACKENDS { BACKEND_EPOLL, BACKEND_URING };
+
+enum DURABILITY { DURABLE_NONE, DURABLE_REQUEST, DURABLE_BATCH };
+
+// Alignment of O_DIRECT writes and the size of the buffer they are gathered in
+#define DIRECT_ALIGN 4096
+#define DIRECT_CHUNK (1 << 20)
+
+// Smallest file part streamed with readahead hints or reserved with fallocate, and how far ahead
+// of sendfile a GET starts reading
+#define STREAM_MIN (1 << 20)
+#define READAHEAD_WINDOW (8 << 20)
+
+// I/O backend chosen at startup
+extern int io_backend;
+
+// Whether PUT and APPEND sync their data before they are answered, chosen at startup
+extern int durability;
+
+// Smallest PUT message written with O_DIRECT, 0 to never use it
+extern long direct_threshold;
+
+// Seconds a message or response may take from its first wait before it is abandoned, 0 for no
+// limit
+extern int transfer_timeout;
+
+// Bytes per second a transfer must average to keep earning time past its first transfer_timeout
+#define TRANSFER_MIN_RATE 4096
+
+// @brief Closes the connection of a message that failed to hand it back to the reactor. Such a
+// failure completes on the worker's own ring, possibly while the worker waits there for something
+// else. Defined in httpserver.c.
+// @param user_data The user_data of the failed completion, which is the connection.
+void park_failed(uint64_t user_data);
+
+// Bytes of headers and generated messages an outbox holds itself
+#define OUT_TEXT (3 * BLOCK_2048)
+
+// Most URIs one MGET lists, each of them at most BLOCK_2048 bytes long
+#define BATCH_MAX 32
+
+// Most pieces of one response: its head, a part head and range per range or item, and the closing
+// line
+#define OUT_PARTS (2 * BATCH_MAX + 2)
+
+// What a connection is in the middle of. A connection waiting in XFER_HEAD or XFER_BODY is parked
+// until it is readable, one in XFER_SEND until it is writable.
+enum XFER_PHASES { XFER_HEAD, XFER_BODY, XFER_SEND };
+
+// Returned by every step that moves bytes over a socket: finished, or parked until it can go on
+enum XFER_RESULTS { XFER_DONE, XFER_WAIT };
+
+// Where the parser of a chunked message is: at a size line, in chunk data, at the CRLF that ends a
+// chunk's data, or among the trailer fields
+enum CHUNK_STATES { CHUNK_SIZE, CHUNK_DATA, CHUNK_END, CHUNK_TRAILER };
+
+enum PART_KINDS { PART_TEXT, PART_BYTES, PART_FILE };
+
+// One piece of a response, whose bytes from offset to end are still to be sent. Text lives in the
+// outbox, bytes are borrowed from memory that outlives the response, and a file piece is a range of
+// fd, one of the files the outbox holds.
+typedef struct out_part {
+    int kind;
+    int fd;
+    const char *data;
+    off_t offset;
+    off_t end;
+} out_part;
+
+// A file a response sends from: an entry of the descriptor cache, or a descriptor of its own when
+// file is NULL
+typedef struct out_held {
+    int fd;
+    struct fd_entry *file;
+} out_held;
+
+// A response waiting to be sent. It is built on the stack of the worker that answers the request
+// and sent at once. Only if the socket fills up is it copied, up to the end of its text, into a
+// slab object the connection owns until the rest has gone out. The files and cache entry it sends
+// from are released once it is sent; fd is the one file ranges are added from.
+typedef struct outbox {
+    int count;
+    int next;
+    int fd;
+    int holds;
+    struct cache_entry *entry;
+    int kept_size;
+    int text_len;
+    out_held held[BATCH_MAX];
+    out_part parts[OUT_PARTS];
+    char text[OUT_TEXT];
+} outbox;
+
+// Progress of the request a connection is serving, kept in the connection so that whichever worker
+// it wakes up on carries on where the last one stopped. A message goes to fd, or to body when it is
+// gathered in memory; left counts what is still to come of it, or of the current chunk. moved
+// counts the bytes of the message moved so far and sent those of the response, and since and base
+// time the transfer from its first wait.
+typedef struct transfer {
+    int phase;
+    int code;
+    int body_done;
+    int fd;
+    char *body;
+    long length;
+    long left;
+    long moved;
+    long sent;
+    int chunk;
+    int direct;
+    int direct_flags;
+    int tail_len;
+    char *tail;
+    long since;
+    long base;
+    outbox *out;
+} transfer;
+
+// State of an accepted connection. Bytes past head_len that arrived with the head belong to the
+// message body, or to the next request when requests are pipelined. Message bytes are dropped from
+// the buffer as they are moved, so once a message is done whatever follows the head is the start of
+// the next request. The buffer comes last so that a recycled connection only needs the fields
+// before it cleared.
+typedef struct conn_struct {
+    int fd;
+    int bytes_read;
+    int head_len;
+    int requests;
+    long last_active;
+    long queued;
+    long head_started;
+    long deadline;
+    long enqueued;
+    int ip_slot;
+    transfer xfer;
+    struct conn_struct *prev;
+    struct conn_struct *next;
+    char buffer[BLOCK_2048];
+} conn_struct;
+
+// Validators of one version of a URI. PUT publishes a new inode and APPEND grows the file, so the
+// inode number, size and modification time in nanoseconds together name a version; the strong ETag
+// is built from them. last_modified is the same time in seconds, as an HTTP-date.
+typedef struct validator {
+    time_t mtime;
+    char etag[VALIDATOR_ETAG];
+    char last_modified[VALIDATOR_DATE];
+} validator;
+
+#define LOG(...) handle_log(__VA_ARGS__);
 
 enum STATUS_CODES {
     OK = 200,
     CREATED = 201,
+    PARTIAL = 206,
+    NOT_MODIFIED = 304,
     BAD_REQ = 400,
     FORBIDDEN = 403,
     NOT_FOUND = 404,
+    PRECOND_FAILED = 412,
+    REQ_TIMEOUT = 408,
+    RANGE_NOT_SAT = 416,
     INTER_SERV_ERROR = 500,
     NOT_IMPL = 501
 };
 
-// @brief Processes the response to the request.
-// @param connfd The connections descriptor.
-// @param content_length The length of the response.
+// @brief Sends the fixed response for a status code, or queues what the socket does not take.
+// @param conn The connection to respond on.
 // @param status_code The relevant status code to the processed request.
-void handle_response(int connfd, int content_length, int *status_code);
+void handle_response(conn_struct *conn, int *status_code);
 
-// @brief Processes any audit logging for keeping track of processed requests.
-// @param logfile The FILE type for the logfile
+// @brief Processes any audit logging for keeping track of processed requests. Formats the entry and queues it for the audit log writer.
 // @param buffer Buffer containing the request type and URI.
+// @param req The parsed request holding the offsets of the request type and URI.
 // @param status_code The relevant status code to the processed request.
-void handle_log(FILE *logfile, char *buffer, int *status_code);
+void handle_log(char *buffer, request_t *req, int *status_code);
 
-// @brief Processes the requests URI. Opens the valid URI or creates a URI if the URI specified is not present.
+// @brief Processes the requests URI. Opens the URI with openat relative to the cached descriptor of its directory.
 // @param method The request type.
-// @param uri_path The specified path to open or create the URI for the request.
+// @param uri_path The relative path (./URI) to open or create the URI for the request.
 // @param uri_fd Pointer to keep track the URI descriptor among multiple functions.
 // @param status_code Pointer for the status_code used across multiple functions.
 void handle_urifd(int *method, char *uri_path, int *uri_fd, int *status_code);
 
-// @brief Takes in bytes from the buffer and uses REGEX to parse for information relevant to the request such as the request type, URI, and message.
+// @brief Parses the request-line for the request type and URI. A status_code that is already an error is kept.
 // @param buffer Buffer containting all relevant bytes present in the inbound request.
-// @param method Pointer to keep track of the request's type across multiple functions.
-// @param uri_fd Pointer to keep track of the URI's file descriptor across multiple functions.
-// @param uri String containing the location of the request's URI.
+// @param size Number of bytes in the buffer.
+// @param req Request to fill in with the parsed method and offsets.
+// @param uri String to hold the relative path (./URI) of the request's URI.
 // @param status_code Pointer to keep track of the status_code across multiple functions.
-void handle_request(char *buffer, int *method, int *uri_fd, char *uri, int *status_code);
-
-// @brief Uses REGEX to parse for relevant header-fields such as Content-Length.
-// @param buffer Buffer containing bytes of the request-line.
-// @param hf Buffer to hold header-fields parsed from the request buffer.
-// @param length Variable for the content length of the request's message field.
-// @param Current status_code of the request.
-void handle_hf(char *buffer, char hf[BLOCK_2048], int *length, int *status_code);
-
-// @brief Processes the message portion of the request. Writes from infile to outfile. Polls for stale connections.
-// @param File descriptor for the file to read bytes from.
-// @param File descriptor to write bytes to.
-// @param Length of the specified message.
-// @param Current status code of the request.
-void handle_message(int in, int out, int *length, int *status_code);
-
-// @brief Function for a PUT request. Writes the request's message to a tempfile and uses locks and sendfile to the specified URI to ensure fully atomic behavior.
-// @param urifd File descriptor to the requested URI.
+void handle_request(char *buffer, int size, request_t *req, char *uri, int *status_code);
+
+// @brief Parses the header-fields for relevant values such as Content-Length.
+// @param buffer Buffer containing bytes of the request head.
+// @param size Number of bytes in the buffer.
+// @param req Request already holding the parsed request-line. Gains the header-field values and head_len.
+// @param Current status_code of the request. Only changed if the header-fields are malformed.
+void handle_hf(char *buffer, int size, request_t *req, int *status_code);
+
+// @brief Starts receiving the message of a request. The connection enters XFER_BODY and the message
+// is then moved by handle_message, handle_chunked or handle_direct, across as many wakeups as it
+// takes.
+// @param conn The connection.
+// @param fd File descriptor to write the message to, or -1 when it is gathered in body.
+// @param body Buffer of at least length bytes, or NULL. Owned by the connection until the message
+// is done, like fd.
+// @param length Length of the message, or -1 when it is chunked.
+void handle_begin(conn_struct *conn, int fd, char *body, long length);
+
+// @brief Moves the message of the request to its file or buffer: first the bytes read along with
+// the head, then what the socket has. Files are filled by splicing through a pipe, so bytes never
+// pass through user space, or through the worker's ring with io_uring.
+// @param conn The connection, in XFER_BODY.
+// @param status_code Current status code of the request. BAD_REQ if the message ends early,
+// REQ_TIMEOUT if the client is too slow.
+// @return XFER_WAIT if the socket ran dry first, to be called again once it is readable, or
+// XFER_DONE.
+int handle_message(conn_struct *conn, int *status_code);
+
+// @brief Receives a message sent with Transfer-Encoding: chunked and writes the decoded bytes to the
+// message's file. Size lines and trailers are parsed in the connection's buffer after the head and
+// dropped once parsed, and chunk data is moved like that of handle_message, so nothing past the
+// message is read except into that buffer. Bytes that follow the message are left right after the
+// head, as the start of the next request. The number of decoded bytes ends up in xfer.moved.
+// @param conn The connection, in XFER_BODY.
+// @param status_code Current status code. BAD_REQ if the message is malformed or ends early,
+// REQ_TIMEOUT if the client is too slow.
+// @return XFER_WAIT or XFER_DONE, as for handle_message.
+int handle_chunked(conn_struct *conn, int *status_code);
+
+// @brief Receives a message into a file with O_DIRECT, so it goes to the disk without passing
+// through the page cache and evicting the hot objects there. Whole blocks are written from an
+// aligned buffer of the worker's. Before it waits the blocks it has are written and the rest is kept
+// with the connection; the tail that does not fill a block is written through the page cache.
+// @param conn The connection, in XFER_BODY with the file at offset 0 when it first starts.
+// @param status_code Current status code. BAD_REQ if the message ends early, REQ_TIMEOUT if the
+// client is too slow.
+// @return XFER_WAIT or XFER_DONE, or -1 without touching anything if the file does not support
+// O_DIRECT.
+int handle_direct(conn_struct *conn, int *status_code);
+
+// @brief Makes the data written to a file durable as the durability policy requires: not at all,
+// with fdatasync, or by waiting for the next batch of the sync thread.
+// @param fd Descriptor of the file.
+// @return 0 on success, -1 if the sync failed.
+int handle_sync(int fd);
+
+// @brief Makes the names in a directory durable as the durability policy requires, so a file renamed
+// or a directory made in it survives a crash along with its data.
+// @param dirfd Descriptor path is resolved against, which may be an O_PATH one, or AT_FDCWD.
+// @param path Path of the directory, "." for dirfd itself.
+// @return 0 on success, -1 if the directory could not be opened or synced.
+int handle_sync_dir(int dirfd, const char *path);
+
+// @brief Empties an outbox before a response is built in it.
+// @param box The outbox, usually on the caller's stack.
+void out_init(outbox *box);
+
+// @brief Adds formatted text to a response.
+// @param box The outbox.
+// @param format Format string for vsnprintf.
+void out_printf(outbox *box, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// @brief Adds bytes to a response by reference. The memory must outlive the response, as static
+// strings and the response of box->entry do.
+// @param box The outbox.
+// @param data Bytes to send.
+// @param length Number of bytes.
+void out_bytes(outbox *box, const char *data, size_t length);
+
+// @brief Hands a file to a response, which releases it once it is sent, and makes it box->fd.
+// @param box The outbox, holding fewer than BATCH_MAX files.
+// @param fd Descriptor of the file, -1 to hold nothing.
+// @param file Descriptor cache entry fd belongs to, or NULL if the response is to close fd.
+void out_hold(outbox *box, int fd, struct fd_entry *file);
+
+// @brief Adds a range of box->fd to a response, sent with sendfile. A range of at least
+// STREAM_MIN bytes is marked sequential and its first READAHEAD_WINDOW bytes are read ahead.
+// @param box The outbox, whose fd is already set.
+// @param offset Offset in the file to start from.
+// @param length Number of bytes to send.
+void out_file(outbox *box, off_t offset, off_t length);
+
+// @brief Sends what is left of a response. Each piece but the last goes out with MSG_MORE. If the
+// socket fills up the outbox is kept with the connection, which enters XFER_SEND.
+// @param conn The connection.
+// @param box The outbox, on the caller's stack or the one the connection already keeps.
+// @param status_code Set to INTER_SERV_ERROR if the transfer fails, or REQ_TIMEOUT if the client is
+// too slow. Either way the response is cut short.
+// @return XFER_WAIT, to be called again with conn->xfer.out once the socket is writable, or
+// XFER_DONE once the response is sent or abandoned and its file released.
+int handle_flush(conn_struct *conn, outbox *box, int *status_code);
+
+// @brief Tells when a transfer that is waiting on its socket runs out of time, so the poller can
+// wake it then and let it fail with REQ_TIMEOUT.
+// @param x The transfer, which has waited at least once.
+// @return The CLOCK_MONOTONIC time in milliseconds, or 0 if transfers have no time limit.
+long transfer_deadline(const transfer *x);
+
+// @brief Releases whatever a connection that is closed in the middle of a request holds: the file
+// and buffer of a message, or the rest of a response.
+// @param conn The connection.
+void handle_abort(conn_struct *conn);
+
+// @brief Builds the validators of the version of a URI an open file descriptor or path was stat'ed
+// at. Only metadata is used, never the file's data.
+// @param uri_stat Result of fstat or stat on the URI.
+// @param valid Filled with the validators.
+void handle_validator(const struct stat *uri_stat, validator *valid);
+
+// @brief Adds the head of a GET response with the validators of the URI: a 200 whose message
+// follows from the file, or a bodiless 304 when status_code is NOT_MODIFIED.
+// @param box The outbox.
+// @param size Size of the message.
+// @param valid Validators of the version being sent.
+// @param status_code OK or NOT_MODIFIED.
+void handle_entity(outbox *box, off_t size, const validator *valid, int *status_code);
+
+// @brief Builds the response with the requested ranges of a file: a 206 with the single range, a
+// 206 with a multipart/byteranges message for several, or a 416 when none could be satisfied. Every
+// range is sent straight from box->fd with sendfile.
+// @param box The outbox.
+// @param size Size of the file.
+// @param ranges Satisfiable ranges, in request order.
+// @param count Number of ranges, 0 for a 416.
+void handle_ranges(outbox *box, off_t size, byte_range *ranges, int count);
+
+// @brief Draws the random key multipart boundaries are made from. Called once at startup.
+void handle_ranges_init(void);
+
+// @brief Opens an unnamed temporary file in the directory of the URI, to be published over it later.
+// @param uri Relative path of the URI.
+// @param status_code Set on failure.
+// @return The file descriptor, or -1 on failure.
+int handle_tmpfile(char *uri, int *status_code);
+
+// @brief Atomically replaces the URI with the file behind fd, which must come from handle_tmpfile.
+// Readers that already opened the URI keep the old version.
+// @param fd File descriptor returned by handle_tmpfile.
+// @param uri Relative path of the URI.
+// @param status_code Set on failure.
+void handle_publish(int fd, char *uri, int *status_code);
+
+// @brief Function for a PUT request. Streams the request's message into a new version of the URI, then swaps that version into place under the URI's writer lock so the update is fully atomic. If-Match and If-None-Match are checked against the version being replaced under that lock, failing with 412, and the response carries the ETag of the new version. Called again on every wakeup while the message is still arriving, and returns with the connection in XFER_BODY or XFER_SEND whenever it must wait.
+// @param conn The currently opened connection, holding any body bytes read with the head.
+// @param req The parsed request.
 // @param uri Path specifying the requested URI.
-// @param connfd File descriptor for the currently opened connection.
-// @param content_length Length of the requested message.
-// param status_code Current status code of the request.
-void put_request(int urifd, char *uri, int connfd, int content_length, int *status_code);
+// @param status_code Current status code of the request.
+void put_request(conn_struct *conn, request_t *req, char *uri, int *status_code);
 
-// @brief Processes a GET request. Reads all bytes from the specified URI to a tempfile then writes to the socket to ensure atomicity.
-// @param urifd File descriptor to the requested URI.
+// @brief Processes a GET request. Opens the URI and fixes its length under the URI's reader lock, then sends the bytes straight from its file descriptor. Writers never change bytes below that length, so the response is an atomic snapshot. A client whose If-None-Match or If-Modified-Since shows its copy is current gets a 304 built from the validators alone. Returns with the connection in XFER_SEND if the socket fills up before the response is sent.
+// @param conn The currently opened connection.
+// @param req The parsed request.
 // @param uri Path specifying the requested URI.
-// @param connfd File descriptor for the currently opened connection.
-// @param content_length Length of the requested message.
-// param status_code Current status code of the request.
-void get_request(int urifd, char *uri, int connfd, int content_length, int *status_code);
+// @param status_code Current status code of the request.
+void get_request(conn_struct *conn, request_t *req, char *uri, int *status_code);
 
-// @brief Processes a APPEND request. Functions in the same way as a PUT request but writes to an OFFSET. This OFFSET being the EOF of the outfile.
-// @param urifd File descriptor to the requested URI.
+// @brief Processes a APPEND request. Receives the whole message first, then writes it once at the EOF of the URI while holding the URI's writer lock. Messages held in memory are group committed: concurrent APPENDs to the same URI are written by one pwritev under one lock acquisition, each message whole, and each is answered once its group is written and, when required, synced. Resumed like a PUT while the message is arriving.
+// @param conn The currently opened connection, holding any body bytes read with the head.
+// @param req The parsed request.
 // @param uri Path specifying the requested URI.
-// @param connfd File descriptor for the currently opened connection.
-// @param content_length Length of the requested message.
-// param status_code Current status code of the request.
-void append_request(int urifd, char *uri, int connfd, int content_length, int *status_code);
+// @param status_code Current status code of the request.
+void append_request(conn_struct *conn, request_t *req, char *uri, int *status_code);
+
+// @brief Processes an MGET request, which reads up to BATCH_MAX URIs in one round trip. Its message lists them one per line, under the directory named by its own URI. The response is a 200 whose message frames each item in order as its status code, its length and a CRLF, then its bytes and a CRLF. A found URI is sent straight from its file with sendfile, as a snapshot taken under its reader lock, and anything else is sent as the phrase of its status. Each item is logged with its own status. Resumed like a PUT while the list is arriving.
+// @param conn The currently opened connection, holding any message bytes read with the head.
+// @param req The parsed request.
+// @param uri Path of the directory the listed URIs are under.
+// @param status_code Current status code of the request.
+void mget_request(conn_struct *conn, request_t *req, char *uri, int *status_code);